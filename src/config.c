@@ -21,6 +21,18 @@ int iniHandler(void* user, const char* section, const char* name, const char* va
         config->showConfidence = (bool)atoi(value);
     else if (MATCH("markov", "show_confusion_matrix"))
         config->showConfMatrix = (bool)atoi(value);
+    else if (MATCH("markov", "sparse_matrix"))
+        config->sparseMatrix = (bool)atoi(value);
+    else if (MATCH("markov", "online_update"))
+        config->onlineUpdate = (bool)atoi(value);
+    else if (MATCH("markov", "one_step_test"))
+        config->oneStepTest = (bool)atoi(value);
+    else if (MATCH("markov", "lazy_states"))
+        config->lazyStates = (bool)atoi(value);
+    else if (MATCH("markov", "threads"))
+        config->threads = (uint)atoi(value);
+    else if (MATCH("markov", "sampling_precision"))
+        config->samplingPrecision = (uint)atoi(value);
 
     else if (MATCH("data", "default_file")) {
         config->fileNameLen = strlen(value);
@@ -44,6 +56,8 @@ int iniHandler(void* user, const char* section, const char* name, const char* va
         config->minErrFactor = strtod(value, NULL);
     else if (MATCH("network", "err_func_id"))
         config->errFuncID = (uint)atoi(value);
+    else if (MATCH("network", "noise_on_counts"))
+        config->netCountNoise = (bool)atoi(value);
     else if (MATCH("network", "get_most_optimal_node"))
         config->getMostOptimalNode = (bool)atoi(value);
     else if (MATCH("network", "score_alpha"))
@@ -53,13 +67,72 @@ int iniHandler(void* user, const char* section, const char* name, const char* va
         config->useMarkovGraph = (bool)atoi(value);
     else if (MATCH("graph", "export"))
         config->exportGraph = (bool)atoi(value);
+    else if (MATCH("graph", "export_format"))
+        config->graphExportFormat = (uint)atoi(value);
+    else if (MATCH("graph", "export_top_k"))
+        config->graphExportTopK = (size_t)strtol(value, NULL, 10);
+    else if (MATCH("graph", "export_min_weight"))
+        config->graphExportMinWeight = strtod(value, NULL);
     else if (MATCH("graph", "find_disconnected"))
         config->findDisconnected = (bool)atoi(value);
+    else if (MATCH("graph", "classes"))
+        config->findClasses = (bool)atoi(value);
+    else if (MATCH("graph", "analytics"))
+        config->graphAnalytics = (bool)atoi(value);
+    else if (MATCH("graph", "compact"))
+        config->compactGraph = (bool)atoi(value);
+    else if (MATCH("graph", "min_edge_weight"))
+        config->minEdgeWeight = strtod(value, NULL);
     else if (MATCH("graph", "random_walk"))
         config->doRandomWalk = (bool)atoi(value);
 
+    else if (MATCH("tree", "use"))
+        config->useMarkovTree = (bool)atoi(value);
+    else if (MATCH("tree", "max_depth"))
+        config->treeMaxDepth = (uint)atoi(value);
+    else if (MATCH("tree", "max_memory_mb"))
+        config->treeMaxMemory = strtod(value, NULL);
+    else if (MATCH("tree", "min_count"))
+        config->treeMinCount = (uint64_t)strtoull(value, NULL, 10);
+    else if (MATCH("tree", "prune_threshold"))
+        config->treePruneThreshold = strtod(value, NULL);
+
+    else if (MATCH("multi_order", "use"))
+        config->useOrderSweep = (bool)atoi(value);
+    else if (MATCH("multi_order", "max_order"))
+        config->sweepMaxOrder = (uint)atoi(value);
+    else if (MATCH("multi_order", "min_support"))
+        config->backoffMinSupport = (uint64_t)strtoull(value, NULL, 10);
+
     else if(MATCH("predictions", "steps"))
         config->predictSteps = (size_t)strtol(value, NULL, 10);
+    else if (MATCH("predictions", "monte_carlo"))
+        config->useMonteCarlo = (bool)atoi(value);
+    else if (MATCH("predictions", "monte_carlo_paths"))
+        config->monteCarloPaths = (size_t)strtol(value, NULL, 10);
+    else if (MATCH("predictions", "exact_forecast"))
+        config->useExactForecast = (bool)atoi(value);
+    else if (MATCH("predictions", "exact_horizon"))
+        config->exactHorizon = (size_t)strtol(value, NULL, 10);
+    else if (MATCH("predictions", "stationary"))
+        config->useStationary = (bool)atoi(value);
+    else if (MATCH("predictions", "stationary_method"))
+        config->stationaryMethod = (uint)atoi(value);
+    else if (MATCH("predictions", "mixing_epsilon"))
+        config->mixingEpsilon = strtod(value, NULL);
+
+    else if (MATCH("model", "save"))
+        config->saveModel = (bool)atoi(value);
+    else if (MATCH("model", "load"))
+        config->loadModel = (bool)atoi(value);
+    else if (MATCH("model", "chain_file")) {
+        free(config->chainFile);
+        config->chainFile = strdup(value);
+    }
+    else if (MATCH("model", "network_file")) {
+        free(config->networkFile);
+        config->networkFile = strdup(value);
+    }
 
     else
         return 0;
@@ -84,6 +157,8 @@ void configFree(ContextConfiguration** cfg) {
         return;
     if ((*cfg)->defaultFile)
         free((*cfg)->defaultFile);
+    free((*cfg)->chainFile);
+    free((*cfg)->networkFile);
     free(*cfg);
     *cfg = NULL;
 }
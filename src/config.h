@@ -10,6 +10,12 @@ typedef struct {
     bool showTransMatrix;
     bool showConfidence;
     bool showConfMatrix;
+    bool sparseMatrix;
+    bool onlineUpdate;
+    bool oneStepTest;
+    bool lazyStates;
+    uint threads;
+    uint samplingPrecision;
 
     // data section
     char* defaultFile;
@@ -24,17 +30,50 @@ typedef struct {
     double lr;
     double minErrFactor;
     uint errFuncID;
+    bool netCountNoise;
     bool getMostOptimalNode;
     double scoreAlpha;
 
     // Graph section
     bool useMarkovGraph;
     bool exportGraph;
+    uint graphExportFormat;
+    size_t graphExportTopK;
+    double graphExportMinWeight;
     bool findDisconnected;
+    bool findClasses;
+    bool graphAnalytics;
+    bool compactGraph;
+    double minEdgeWeight;
     bool doRandomWalk;
 
+    // Tree section
+    bool useMarkovTree;
+    uint treeMaxDepth;
+    double treeMaxMemory;
+    uint64_t treeMinCount;
+    double treePruneThreshold;
+
+    // Multi order section
+    bool useOrderSweep;
+    uint sweepMaxOrder;
+    uint64_t backoffMinSupport;
+
     // Predictions section
     size_t predictSteps;
+    bool useMonteCarlo;
+    size_t monteCarloPaths;
+    bool useExactForecast;
+    size_t exactHorizon;
+    bool useStationary;
+    uint stationaryMethod;
+    double mixingEpsilon;
+
+    // Model section
+    bool saveModel;
+    bool loadModel;
+    char* chainFile;
+    char* networkFile;
 
 } ContextConfiguration;
 
@@ -0,0 +1,118 @@
+#include "hashmap.h"
+
+#include <stdlib.h>
+
+#include "logging.h"
+
+static size_t hashKey(size_t key) {
+    // 64-bit finalizer from splitmix64, spreads consecutive state ids over the table
+    uint64_t x = (uint64_t)key;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = x ^ (x >> 31);
+    return (size_t)x;
+}
+
+static bool hashMapAlloc(HashMap* map, const size_t capacity) {
+    map->keys = malloc(sizeof(size_t) * capacity);
+    map->values = malloc(sizeof(size_t) * capacity);
+    if (!map->keys || !map->values) {
+        free(map->keys);
+        free(map->values);
+        return false;
+    }
+    for (size_t i = 0; i < capacity; i++)
+        map->keys[i] = HASHMAP_EMPTY_KEY;
+    map->capacity = capacity;
+    map->size = 0;
+    return true;
+}
+
+HashMap* hashMapInit(const size_t expected) {
+    HashMap* map = malloc(sizeof(HashMap));
+    if (!map) {
+        LOG_ERROR("malloc failed for HashMap* map");
+        return NULL;
+    }
+
+    // Keep the load factor under 0.5
+    size_t capacity = 16;
+    while (capacity < 2 * expected)
+        capacity <<= 1;
+
+    if (!hashMapAlloc(map, capacity)) {
+        LOG_ERROR("malloc failed for hash map buckets");
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void hashMapFree(HashMap** map) {
+    if (!map || !(*map))
+        return;
+
+    free((*map)->keys);
+    free((*map)->values);
+    free(*map);
+    *map = NULL;
+}
+
+static bool hashMapGrow(HashMap* map) {
+    size_t* oldKeys = map->keys;
+    size_t* oldValues = map->values;
+    const size_t oldCapacity = map->capacity;
+
+    if (!hashMapAlloc(map, oldCapacity * 2)) {
+        map->keys = oldKeys;
+        map->values = oldValues;
+        return false;
+    }
+
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (oldKeys[i] != HASHMAP_EMPTY_KEY)
+            hashMapPut(map, oldKeys[i], oldValues[i]);
+    }
+
+    free(oldKeys);
+    free(oldValues);
+    return true;
+}
+
+bool hashMapPut(HashMap* map, const size_t key, const size_t value) {
+    if (!map || key == HASHMAP_EMPTY_KEY)
+        return false;
+
+    if (2 * (map->size + 1) > map->capacity && !hashMapGrow(map)) {
+        LOG_ERROR("Unable to grow hash map");
+        return false;
+    }
+
+    const size_t mask = map->capacity - 1;
+    size_t slot = hashKey(key) & mask;
+    while (map->keys[slot] != HASHMAP_EMPTY_KEY && map->keys[slot] != key)
+        slot = (slot + 1) & mask;
+
+    if (map->keys[slot] == HASHMAP_EMPTY_KEY) {
+        map->keys[slot] = key;
+        map->size++;
+    }
+    map->values[slot] = value;
+    return true;
+}
+
+lli hashMapGet(const HashMap* map, const size_t key) {
+    if (!map || key == HASHMAP_EMPTY_KEY)
+        return -1;
+
+    const size_t mask = map->capacity - 1;
+    size_t slot = hashKey(key) & mask;
+    while (map->keys[slot] != HASHMAP_EMPTY_KEY) {
+        if (map->keys[slot] == key)
+            return (lli)map->values[slot];
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
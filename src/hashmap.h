@@ -0,0 +1,24 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include "typedefs.h"
+
+// Open addressing hash map from size_t keys to size_t values (linear probing).
+// Used to find rows/nodes by their state id when only a few states are stored.
+#define HASHMAP_EMPTY_KEY ((size_t)-1)
+typedef struct {
+    size_t* keys;
+    size_t* values;
+    size_t capacity; // always a power of 2
+    size_t size;
+} HashMap;
+
+// 'expected' is the number of keys expected to be inserted, so rehashing can be avoided
+HashMap* hashMapInit(const size_t expected);
+void hashMapFree(HashMap** map);
+// Insert or replace the value of 'key'. Returns false if the map couldn't grow
+bool hashMapPut(HashMap* map, const size_t key, const size_t value);
+// Returns the value of 'key', or -1 if it isn't in the map
+lli hashMapGet(const HashMap* map, const size_t key);
+
+#endif // HASHMAP_H
@@ -10,8 +10,15 @@
 #include "logging.h"
 #include "markovgraph.h"
 #include "markovnetwork.h"
+#include "markovtree.h"
+#include "markovforecast.h"
+#include "modelio.h"
+#include "rng.h"
 #include "utils.h"
 
+// Random stream of the seed used by each run, so turning a run on or off doesn't change the others
+enum { RNG_DEFAULT_MARKOV, RNG_MARKOV_GRAPH, RNG_MARKOV_NETWORK, RNG_MARKOV_TREE, RNG_ORDER_SWEEP, RNG_FORECAST };
+
 void printIntro() {
     printf("-------------------------------------------------------------------------------------------------\n");
     printf("---------------------------- TIME SERIES FORECAST WITH MARKOV CHAINS ----------------------------\n");
@@ -36,6 +43,8 @@ void printHelp() {
 TransitionMatrix* runDefaultMarkov(const int* train, const size_t trainSize, const int* valid, const size_t validSize,
                                     const int* test, const size_t testSize, MarkovState* states, const ContextConfiguration* cfg, double* outAcc) {
     printf("\n=====> INITIATING DEFAULT MARKOV FORECAST RUN <=====\n");
+    Rng rng;
+    rngInit(&rng, cfg->randSeed, RNG_DEFAULT_MARKOV);
     printf("=====> USING ORDER: %u\n", states->order);
 
     // Join train and valid data for default markov, since there's no validation step
@@ -48,12 +57,14 @@ TransitionMatrix* runDefaultMarkov(const int* train, const size_t trainSize, con
     memcpy(data, train, sizeof(int) * trainSize);
     memcpy(data+trainSize, valid, sizeof(int) * validSize);
 
-    TransitionMatrix* tm = markovBuildTransMatrix(data, n, states);
+    TransitionMatrix* tm = markovBuildTransMatrixParallel(data, n, states, (cfg->sparseMatrix) ? TM_SPARSE : TM_DENSE,
+                                                          cfg->threads);
     if (!tm) {
         LOG_ERROR("Unable to build transition matrix in runDefaultMarkov");
         free(data);
         return NULL;
     }
+    markovSetPrecision(tm, (TransMatrixPrecision)cfg->samplingPrecision);
 
     if (cfg->showTransMatrix) {
         printf("=====> MARKOV TRANSITION MATRIX WITH ORDER = %u\n", states->order);
@@ -76,7 +87,27 @@ TransitionMatrix* runDefaultMarkov(const int* train, const size_t trainSize, con
     }
 
     clock_t time = clock();
-    markovPredict(tm, testSize, data, n, predictions, conf);
+    if (cfg->onlineUpdate) {
+        // Predict each test value from the true history, then append it to a copy of the model
+        // (the trained matrix is kept as it is for the next runs)
+        TransitionMatrix* online = markovCopyTransMatrix(tm);
+        if (!online) {
+            LOG_ERROR("Unable to copy transition matrix for the online test");
+            markovFreeTransMatrix(&tm);
+            free(predictions);
+            free(conf);
+            free(data);
+            return NULL;
+        }
+        for (size_t i = 0; i < testSize; i++) {
+            predictions[i] = markovPredictNext(online, data, n + i, &rng, &conf[i]);
+            data[n + i] = test[i];
+            markovAppend(online, &test[i], 1);
+        }
+        markovFreeTransMatrix(&online);
+    }
+    else
+        markovPredict(tm, testSize, data, n, &rng, predictions, conf);
     time = clock() - time;
     double delta = ((double)time)/CLOCKS_PER_SEC; // time in seconds
     printf("=====> TIME TAKEN IN PREDICTIONS (%lu steps): %lf s\n", testSize, delta);
@@ -101,6 +132,27 @@ TransitionMatrix* runDefaultMarkov(const int* train, const size_t trainSize, con
     if (outAcc)
         *outAcc = acc;
 
+    // One step ahead: each test value from the true values before it, every context in a single batch
+    const uint order = states->order;
+    if (cfg->oneStepTest && n >= order) {
+        int* contexts = malloc(sizeof(int) * testSize * order);
+        if (!contexts)
+            LOG_ERROR("malloc failed for the contexts of the one step test");
+        else {
+            memcpy(data + n, test, sizeof(int) * testSize);
+            for (size_t i = 0; i < testSize; i++)
+                memcpy(contexts + i * order, data + n + i - order, sizeof(int) * order);
+
+            time = clock();
+            markovPredictBatch(tm, contexts, testSize, rngNext(&rng), predictions, conf);
+            time = clock() - time;
+            delta = ((double)time)/CLOCKS_PER_SEC;
+            printf("=====> ONE STEP TIME TAKEN IN PREDICTIONS (%lu contexts): %lf s\n", testSize, delta);
+            printf("=====> ONE STEP ACCURACY: %lf\n", calcAccuracy(test, predictions, testSize));
+            free(contexts);
+        }
+    }
+
     putchar('\n');
 
     free(predictions);
@@ -115,6 +167,8 @@ TransitionMatrix* runDefaultMarkov(const int* train, const size_t trainSize, con
 MarkovGraph* runMarkovGraph(const TransitionMatrix* tm, const int* valid, const size_t validSize, const int* test,
                             const size_t testSize, const ContextConfiguration* cfg, double* outAcc) {
     printf("\n=====> INITIATING MARKOV GRAPH RUN <=====\n");
+    Rng rng;
+    rngInit(&rng, cfg->randSeed, RNG_MARKOV_GRAPH);
 
     MarkovGraph* graph = mkGraphInit(tm->state);
     if (!graph) {
@@ -123,6 +177,20 @@ MarkovGraph* runMarkovGraph(const TransitionMatrix* tm, const int* valid, const
     }
     mkGraphBuildTransitions(graph, tm);
 
+    if (cfg->compactGraph) {
+        // Walks start from the last state of the validation set here, and of the test set in the final forecast
+        size_t starts[2];
+        size_t nStarts = 0;
+        const lli validID = mkGraphIdState(graph, &valid[validSize - graph->order]);
+        const lli testID = mkGraphIdState(graph, &test[testSize - graph->order]);
+        if (validID != -1)
+            starts[nStarts++] = (size_t)validID;
+        if (testID != -1)
+            starts[nStarts++] = (size_t)testID;
+        if (nStarts == 0 || !mkGraphCompact(graph, cfg->minEdgeWeight, starts, nStarts))
+            LOG_WARNING("Unable to compact the graph in runMarkovGraph");
+    }
+
     if (cfg->doRandomWalk) {
         // Predict values doing random walk in the graph
         int* predictions = malloc(sizeof(int) * testSize);
@@ -132,7 +200,7 @@ MarkovGraph* runMarkovGraph(const TransitionMatrix* tm, const int* valid, const
         const int* lastState = &valid[validSize - graph->order];
 
         clock_t time = clock();
-        mkGraphRandWalk(graph, lastState, testSize, predictions, conf);
+        mkGraphRandWalk(graph, lastState, testSize, &rng, predictions, conf);
         time = clock() - time;
         double delta = ((double)time)/CLOCKS_PER_SEC; // time in seconds
         printf("=====> TIME TAKEN IN PREDICTIONS (%lu steps): %lf s\n", testSize, delta);
@@ -176,8 +244,80 @@ MarkovGraph* runMarkovGraph(const TransitionMatrix* tm, const int* valid, const
         free(discIDs);
     }
 
-    if (cfg->exportGraph)
-        mkGraphExport(graph, "graph.dot");
+    if (cfg->findClasses) {
+        // Part of the graph a forecast from the last state can visit, and where walks end up
+        const lli lastID = mkGraphIdState(graph, &valid[validSize - graph->order]);
+        bool* reached = malloc(sizeof(bool) * (graph->nNodes + 1));
+        if (reached && lastID != -1) {
+            const size_t nReached = mkGraphReachable(graph, (size_t)lastID, reached);
+            printf("=====> NODES REACHABLE FROM LAST STATE: %lu of %lu\n", nReached, graph->nNodes);
+        }
+        free(reached);
+
+        MarkovGraphSCC* scc = mkGraphSCC(graph);
+        if (!scc)
+            LOG_ERROR("Unable to find the classes of the graph");
+        else {
+            size_t largest = 0, absorbingStates = 0;
+            for (size_t c = 0; c < scc->nComponents; c++) {
+                if (scc->sizes[c] > largest)
+                    largest = scc->sizes[c];
+                if (scc->closed[c] && scc->sizes[c] == 1)
+                    absorbingStates++;
+            }
+            printf("=====> CLASSES: %lu (largest: %lu nodes), ABSORBING: %lu (%lu absorbing states), TRANSIENT: %lu\n",
+                   scc->nComponents, largest, scc->nClosed, absorbingStates, scc->nComponents - scc->nClosed);
+            if (lastID != -1)
+                printf("=====> LAST STATE IS IN %s CLASS OF %lu NODES\n",
+                       (scc->closed[scc->component[lastID]]) ? "AN ABSORBING" : "A TRANSIENT",
+                       scc->sizes[scc->component[lastID]]);
+            mkGraphFreeSCC(&scc);
+        }
+    }
+
+    if (cfg->graphAnalytics) {
+        // Most visited states in the long run, and how long it takes to get to them
+        static const size_t nTop = 5;
+        const lli lastID = mkGraphIdState(graph, &valid[validSize - graph->order]);
+        double* scores = malloc(sizeof(double) * (graph->nNodes + 1));
+        double* times = malloc(sizeof(double) * (graph->nNodes + 1));
+        const lli iterations = (scores && times) ? mkGraphPageRank(graph, GRAPH_PAGERANK_DAMPING, GRAPH_SOLVER_TOLERANCE,
+                                                                   GRAPH_SOLVER_MAX_ITERATIONS, cfg->threads, scores)
+                                                 : -1;
+        if (iterations == -1)
+            LOG_ERROR("Unable to compute the PageRank of the graph");
+        else {
+            printf("=====> PAGERANK (damping %g, %lld iterations), TOP STATES:\n", GRAPH_PAGERANK_DAMPING, iterations);
+            for (size_t k = 0; k < nTop && k < graph->nNodes; k++) {
+                // k-th highest score (the ones already shown are marked negative)
+                size_t best = 0;
+                for (size_t i = 1; i < graph->nNodes; i++) {
+                    if (scores[i] > scores[best])
+                        best = i;
+                }
+                if (scores[best] < 0.0)
+                    break;
+                const double returnTime = mkGraphReturnTime(graph, best, GRAPH_SOLVER_TOLERANCE,
+                                                            GRAPH_SOLVER_MAX_ITERATIONS, cfg->threads);
+                const bool hit = lastID != -1 &&
+                    mkGraphHittingTimes(graph, &best, 1, GRAPH_SOLVER_TOLERANCE, GRAPH_SOLVER_MAX_ITERATIONS,
+                                        cfg->threads, times) != -1;
+                printf("SCORE %lf, RETURN TIME %lf, STEPS FROM LAST STATE %lf, STATE: ", scores[best], returnTime,
+                       (hit) ? times[lastID] : -1.0);
+                printArr_i(mkNodeState(mkGraphGetNode(graph, best)), graph->order);
+                scores[best] = -1.0 - scores[best];
+            }
+        }
+        free(scores);
+        free(times);
+    }
+
+    if (cfg->exportGraph) {
+        static const char* exportFiles[] = {"graph.dot", "graph.csv", "graph.bin"};
+        const GraphExportFormat format = (cfg->graphExportFormat <= GRAPH_EXPORT_BINARY)
+            ? (GraphExportFormat)cfg->graphExportFormat : GRAPH_EXPORT_DOT;
+        mkGraphExportAs(graph, exportFiles[format], format, cfg->graphExportTopK, cfg->graphExportMinWeight);
+    }
 
     printf("\n=====> ENDING MARKOV GRAPH RUN <=====\n");
 
@@ -189,6 +329,8 @@ MarkovGraph* runMarkovGraph(const TransitionMatrix* tm, const int* valid, const
 MarkovNetwork* runMarkovNetwork(MarkovState* states, int* train, size_t trainSize, int* valid, size_t validSize, int* test,
                         size_t testSize, const ContextConfiguration* cfg, double* outAcc) {
     printf("\n=====> INITIATING MARKOV NETWORK RUN <=====\n");
+    Rng rng;
+    rngInit(&rng, cfg->randSeed, RNG_MARKOV_NETWORK);
 
     // Calculate error factor for each matrix node
     double* errFactors = malloc(cfg->netNodes * sizeof(double));
@@ -208,17 +350,23 @@ MarkovNetwork* runMarkovNetwork(MarkovState* states, int* train, size_t trainSiz
         return NULL;
     }
 
-    MarkovNetwork* net = mkNetInit(states, cfg->netNodes, errFactors, map[cfg->errFuncID]);
+    MarkovNetwork* net = mkNetInit(states, cfg->netNodes, errFactors, map[cfg->errFuncID],
+                                   (cfg->sparseMatrix) ? TM_SPARSE : TM_DENSE);
     if (!net) {
         LOG_ERROR("Unable to initialize Markov Network in runMarkovNetwork");
         free(errFactors);
         return NULL;
     }
-
-    clock_t time = clock();
-    mkNetTrain(net, train, trainSize, valid, validSize, cfg->lr);
-    time = clock() - time;
-    double delta = ((double)time)/CLOCKS_PER_SEC;
+    for (size_t i = 0; i < net->nMatNodes; i++)
+        markovSetPrecision(net->input[i]->dest->matrix, (TransMatrixPrecision)cfg->samplingPrecision);
+    net->countNoise = cfg->netCountNoise;
+
+    // wall time, the nodes are trained in parallel
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    mkNetTrain(net, train, trainSize, valid, validSize, cfg->lr, &rng, cfg->threads);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double delta = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
     printf("=====> TIME TAKEN IN TRAINING (%lu nodes): %lf s\n", cfg->netNodes, delta);
 
     int* predictions = malloc(sizeof(int) * testSize);
@@ -234,8 +382,8 @@ MarkovNetwork* runMarkovNetwork(MarkovState* states, int* train, size_t trainSiz
         return NULL;
     }
 
-    time = clock();
-    mkNetPredict(net, testSize, predictions, conf);
+    clock_t time = clock();
+    mkNetPredict(net, testSize, &rng, predictions, conf);
     time = clock() - time;
     delta = ((double)time)/CLOCKS_PER_SEC; // time in seconds
     printf("=====> TIME TAKEN IN PREDICTIONS (%lu steps): %lf s\n", testSize, delta);
@@ -285,6 +433,253 @@ MarkovNetwork* runMarkovNetwork(MarkovState* states, int* train, size_t trainSiz
 }
 /* ------------------------------------------------------------------------------------------------------------------ */
 
+/* -------------------------------------------------- MARKOV TREE --------------------------------------------------- */
+MarkovTree* runMarkovTree(const int* train, const size_t trainSize, const int* valid, const size_t validSize,
+                          const int* test, const size_t testSize, const MarkovState* states,
+                          const ContextConfiguration* cfg, double* outAcc) {
+    printf("\n=====> INITIATING MARKOV TREE RUN <=====\n");
+    Rng rng;
+    rngInit(&rng, cfg->randSeed, RNG_MARKOV_TREE);
+    printf("=====> USING MAXIMUM DEPTH: %u\n", cfg->treeMaxDepth);
+
+    // Like the default markov chain, train with both train and valid data
+    size_t n = trainSize + validSize;
+    int* data = malloc(sizeof(int) * n);
+    if (!data) {
+        LOG_ERROR("malloc failed for 'data' allocation in runMarkovTree");
+        return NULL;
+    }
+    memcpy(data, train, sizeof(int) * trainSize);
+    memcpy(data+trainSize, valid, sizeof(int) * validSize);
+
+    // The memory budget limits the number of nodes
+    size_t maxNodes = (size_t)(cfg->treeMaxMemory * 1024.0 * 1024.0) / mkTreeNodeBytes(states->nVals);
+    if (maxNodes == 0)
+        maxNodes = 1;
+
+    clock_t time = clock();
+    MarkovTree* tree = mkTreeBuild(data, n, states, cfg->treeMaxDepth, maxNodes, cfg->treeMinCount,
+                                   cfg->treePruneThreshold);
+    time = clock() - time;
+    if (!tree) {
+        LOG_ERROR("Unable to build tree in runMarkovTree");
+        free(data);
+        return NULL;
+    }
+    double delta = ((double)time)/CLOCKS_PER_SEC;
+    printf("=====> TIME TAKEN IN TRAINING: %lf s\n", delta);
+    mkTreePrintStats(tree);
+
+    int* predictions = malloc(sizeof(int) * testSize);
+    double* conf = malloc(sizeof(double) * testSize);
+    if (!predictions || !conf) {
+        LOG_ERROR("malloc failed for either predictions or confOut");
+        mkTreeFree(&tree);
+        free(data);
+        free(predictions);
+        free(conf);
+        return NULL;
+    }
+
+    time = clock();
+    mkTreePredict(tree, testSize, data, n, &rng, predictions, conf);
+    time = clock() - time;
+    delta = ((double)time)/CLOCKS_PER_SEC; // time in seconds
+    printf("=====> TIME TAKEN IN PREDICTIONS (%lu steps): %lf s\n", testSize, delta);
+
+    if (cfg->showConfMatrix) {
+        printf("=====> CONFUSION MATRIX:\n");
+        showConfusionMatrix(test, predictions, testSize);
+    }
+
+    if (cfg->showConfidence) {
+        double propagated = 1.0;
+        for (size_t i = 0; i < testSize; i++)
+            propagated *= conf[i];
+        printf("Pred. confidence (%lu): ", testSize);
+        printArr_d(conf, testSize);
+        printf("Final propagated confidence: %lf\n", propagated);
+    }
+
+    double acc = calcAccuracy(test, predictions, testSize);
+    printf("=====> ACCURACY: %lf\n", acc);
+
+    if (outAcc)
+        *outAcc = acc;
+
+    putchar('\n');
+
+    free(predictions);
+    free(conf);
+    free(data);
+    printf("=====> ENDING MARKOV TREE RUN <=====\n");
+    return tree;
+}
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/* -------------------------------------------------- ORDER SWEEP --------------------------------------------------- */
+void runOrderSweep(const int* train, const size_t trainSize, const int* valid, const size_t validSize, const int* test,
+                   const size_t testSize, const MarkovState* states, const ContextConfiguration* cfg) {
+    printf("\n=====> INITIATING ORDER SWEEP RUN <=====\n");
+    Rng rng;
+    rngInit(&rng, cfg->randSeed, RNG_ORDER_SWEEP);
+    printf("=====> USING ORDERS: 1 to %u\n", cfg->sweepMaxOrder);
+
+    // Like the default markov chain, train with both train and valid data
+    size_t n = trainSize + validSize;
+    int* data = malloc(sizeof(int) * (n + testSize));
+    int* predictions = malloc(sizeof(int) * testSize);
+    double* conf = malloc(sizeof(double) * testSize);
+    size_t* ids = (cfg->oneStepTest) ? malloc(sizeof(size_t) * testSize) : NULL;
+    if (!data || !predictions || !conf || (cfg->oneStepTest && !ids)) {
+        LOG_ERROR("malloc failed for data or predictions in runOrderSweep");
+        free(ids);
+        free(data);
+        free(predictions);
+        free(conf);
+        return;
+    }
+    memcpy(data, train, sizeof(int) * trainSize);
+    memcpy(data+trainSize, valid, sizeof(int) * validSize);
+
+    // Every order is counted in the same pass
+    clock_t time = clock();
+    MarkovMultiOrder* mo = markovBuildMultiOrder(data, n, states->vals, states->nVals, cfg->sweepMaxOrder,
+                                                 (cfg->sparseMatrix) ? TM_SPARSE : TM_DENSE);
+    time = clock() - time;
+    if (!mo) {
+        LOG_ERROR("Unable to build the transition matrices in runOrderSweep");
+        free(ids);
+        free(data);
+        free(predictions);
+        free(conf);
+        return;
+    }
+    double delta = ((double)time)/CLOCKS_PER_SEC;
+    printf("=====> TIME TAKEN IN TRAINING (%u orders): %lf s\n", mo->maxOrder, delta);
+    for (uint k = 1; k <= mo->maxOrder; k++)
+        markovSetPrecision(mo->matrices[k-1], (TransMatrixPrecision)cfg->samplingPrecision);
+
+    for (uint k = 1; k <= mo->maxOrder; k++) {
+        markovPredict(mo->matrices[k-1], testSize, data, n, &rng, predictions, conf);
+        printf("=====> ORDER %u: ACCURACY: %lf\n", k, calcAccuracy(test, predictions, testSize));
+    }
+
+    // Then predict with the highest order that has enough support at every step
+    time = clock();
+    markovBackoffPredict(mo, testSize, data, n, cfg->backoffMinSupport, &rng, predictions, conf);
+    time = clock() - time;
+    delta = ((double)time)/CLOCKS_PER_SEC; // time in seconds
+    printf("=====> BACKOFF (minimum support %lu) TIME TAKEN IN PREDICTIONS (%lu steps): %lf s\n",
+           cfg->backoffMinSupport, testSize, delta);
+
+    if (cfg->showConfMatrix) {
+        printf("=====> CONFUSION MATRIX:\n");
+        showConfusionMatrix(test, predictions, testSize);
+    }
+    printf("=====> BACKOFF ACCURACY: %lf\n", calcAccuracy(test, predictions, testSize));
+
+    // One step ahead with every order: each test value from the state of the true values before it
+    if (cfg->oneStepTest) {
+        memcpy(data + n, test, sizeof(int) * testSize);
+        for (uint k = 1; k <= mo->maxOrder && k <= n; k++) {
+            for (size_t i = 0; i < testSize; i++) {
+                const lli id = markovEncodeState(mo->states[k-1], data + n + i - k);
+                ids[i] = (id == -1) ? 0 : (size_t)id;
+            }
+            markovPredictBatchIds(mo->matrices[k-1], ids, testSize, rngNext(&rng), predictions, conf);
+            printf("=====> ORDER %u: ONE STEP ACCURACY: %lf\n", k, calcAccuracy(test, predictions, testSize));
+        }
+    }
+
+    putchar('\n');
+
+    markovFreeMultiOrder(&mo);
+    free(ids);
+    free(predictions);
+    free(conf);
+    free(data);
+    printf("=====> ENDING ORDER SWEEP RUN <=====\n");
+}
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/* -------------------------------------------------- SAVED MODELS -------------------------------------------------- */
+// Predict the next 'steps' values from the end of the data, with the model in 'file' (mapped, not trained)
+void runModelForecast(const char* file, const int* data, const size_t n, const ContextConfiguration* cfg,
+                      int* predictions, double* conf) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    MarkovModel* model = modelOpen(file);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!model)
+        return;
+    const double delta = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    const uint order = model->header->order;
+    printf("\n=====> LOADED MODEL FILE %s (order %u, %lu matrices, %.2f MB) IN %lf s\n", file, order,
+           model->header->nMatrices, (double)model->size / (1024.0 * 1024.0), delta);
+    if (n < order) {
+        LOG_ERROR("Not enough data for the order of the model");
+        modelClose(&model);
+        return;
+    }
+
+    // Same stream as the forecast of the trained models, so the saved chain predicts what it predicted
+    Rng rng;
+    rngInit(&rng, cfg->randSeed, RNG_FORECAST);
+    if (model->header->kind == MODEL_NETWORK) {
+        MarkovNetwork* net = modelNetwork(model);
+        if (net) {
+            mkNetSetLastState(net, data + n - order);
+            mkNetPredict(net, cfg->predictSteps, &rng, predictions, conf);
+            printf("====> PREDICTIONS USING SAVED MARKOV NETWORK: ");
+            printArr_i(predictions, cfg->predictSteps);
+            mkNetFree(&net);
+        }
+    }
+    else {
+        TransitionMatrix* tm = modelMatrix(model, 0);
+        if (tm) {
+            markovPredict(tm, cfg->predictSteps, data + n - order, order, &rng, predictions, conf);
+            printf("====> PREDICTIONS USING SAVED DEFAULT MARKOV CHAIN: ");
+            printArr_i(predictions, cfg->predictSteps);
+            markovFreeTransMatrix(&tm);
+        }
+    }
+    if (cfg->showConfidence) {
+        printf("=====> CONFIDENCE: ");
+        printArr_d(conf, cfg->predictSteps);
+    }
+    modelClose(&model);
+}
+
+// Only predict with the saved models, without training anything
+int runSavedModels(const int* data, const size_t n, const ContextConfiguration* cfg) {
+    printf("\n----------------------------------- RUNNING SAVED MODELS FORECAST -----------------------------------\n");
+    printf("=====> STEPS TO PREDICT: %lu\n", cfg->predictSteps);
+    if (cfg->predictSteps == 0) {
+        printf("No steps to predict.\n");
+        return 0;
+    }
+
+    int* predictions = malloc(sizeof(int) * cfg->predictSteps);
+    double* conf = malloc(sizeof(double) * cfg->predictSteps);
+    if (!predictions || !conf) {
+        LOG_FATAL("malloc failed for either predictions or conf");
+        free(predictions);
+        free(conf);
+        return -1;
+    }
+    if (cfg->chainFile)
+        runModelForecast(cfg->chainFile, data, n, cfg, predictions, conf);
+    if (cfg->useMarkovNetwork && cfg->networkFile)
+        runModelForecast(cfg->networkFile, data, n, cfg, predictions, conf);
+
+    free(predictions);
+    free(conf);
+    return 0;
+}
+/* ------------------------------------------------------------------------------------------------------------------ */
+
 void manualInsertion(int** data, size_t* n) {
     const size_t BUCKET = 100;
     uint nBuckets = 1;
@@ -353,7 +748,6 @@ int main(int argc, char* argv[]) {
         configFree(&cfg);
         return -1;
     }
-    srand(cfg->randSeed);
 
     // Load data
     int* data = NULL;
@@ -373,6 +767,17 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    // Predict with the saved models instead of training
+    if (cfg->loadModel) {
+        const char* argSteps = getArg(argc, argv, "-s");
+        if (argSteps)
+            cfg->predictSteps = (size_t)strtol(argSteps, NULL, 10);
+        const int ret = runSavedModels(data, dataSize, cfg);
+        configFree(&cfg);
+        free(data);
+        return ret;
+    }
+
     // Get unique values from data
     int* unique = NULL;
     size_t uniqueSize = 0;
@@ -423,7 +828,8 @@ int main(int argc, char* argv[]) {
     }
 
     // Build markov states
-    MarkovState* states = markovBuildStates(cfg->order, unique, uniqueSize);
+    MarkovState* states = (cfg->lazyStates) ? markovBuildLazyStates(cfg->order, unique, uniqueSize)
+                                            : markovBuildStates(cfg->order, unique, uniqueSize);
     if (!states) {
         LOG_FATAL("Unable to build markov states");
         return -1;
@@ -458,6 +864,35 @@ int main(int argc, char* argv[]) {
     if (wait)
         enterWait();
 
+    // Build tree if requested
+    MarkovTree* tree = NULL;
+    double tAcc = 0.0;
+    if (cfg->useMarkovTree)
+        tree = runMarkovTree(train, trainSize, valid, validSize, test, testSize, states, cfg, &tAcc);
+
+    if (wait)
+        enterWait();
+
+    // Compare every order up to the max one, from a single counting pass
+    if (cfg->useOrderSweep && cfg->sweepMaxOrder > 0) {
+        runOrderSweep(train, trainSize, valid, validSize, test, testSize, states, cfg);
+
+        if (wait)
+            enterWait();
+    }
+
+    // Save the trained models, to load them later without training
+    if (cfg->saveModel) {
+        if (cfg->chainFile && modelSaveChain(tm, cfg->chainFile)) {
+            LOG_INFO("Default Markov Chain saved to model file:");
+            printf("%s\n", cfg->chainFile);
+        }
+        if (net && cfg->networkFile && modelSaveNetwork(net, cfg->networkFile)) {
+            LOG_INFO("Markov Network saved to model file:");
+            printf("%s\n", cfg->networkFile);
+        }
+    }
+
     // Finally, run requested forecast
     const char* argSteps = getArg(argc, argv, "-s");
     if (argSteps)
@@ -483,8 +918,11 @@ int main(int argc, char* argv[]) {
     printf("Starting from last state (based on test set): ");
     printArr_i(lastState, states->order);
 
+    Rng rng;
+    rngInit(&rng, cfg->randSeed, RNG_FORECAST);
+
     // Predictions using Default Markov Chain
-    markovPredict(tm, cfg->predictSteps, lastState, states->order, predictions, conf);
+    markovPredict(tm, cfg->predictSteps, lastState, states->order, &rng, predictions, conf);
     printf("\n====> PREDICTIONS USING DEFAULT MARKOV CHAIN (acc: %lf): ", mkAcc);
     printArr_i(predictions, cfg->predictSteps);
     if (cfg->showConfidence) {
@@ -496,12 +934,102 @@ int main(int argc, char* argv[]) {
         printf("=====> FINAL PROPAGATED CONFIDENCE: %lf\n", prop);
     }
 
+    // Distribution of the next values from many trajectories of the Default Markov Chain
+    if (cfg->useMonteCarlo && cfg->monteCarloPaths > 0) {
+        static const double quantiles[] = {0.05, 0.5, 0.95};
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        MarkovForecast* forecast = markovMonteCarlo(tm, lastState, states->order, (uint)cfg->predictSteps,
+                                                    cfg->monteCarloPaths, cfg->randSeed, cfg->threads, quantiles,
+                                                    sizeof(quantiles) / sizeof(quantiles[0]));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!forecast)
+            LOG_ERROR("Unable to run Monte Carlo forecast");
+        else {
+            const double delta = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+            printf("\n====> MONTE CARLO FORECAST USING DEFAULT MARKOV CHAIN (%lu paths, %lf s):\n",
+                   cfg->monteCarloPaths, delta);
+            markovPrintForecast(forecast);
+            markovFreeForecast(&forecast);
+        }
+    }
+
+    // Long-run distribution of the Default Markov Chain, and the steps it takes to get there from the last state
+    MarkovStationary* stationary = NULL;
+    lli mixingSteps = -1;
+    if (cfg->useStationary) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        stationary = markovStationary(tm, (StationaryMethod)cfg->stationaryMethod, MARKOV_STATIONARY_TOLERANCE,
+                                      MARKOV_STATIONARY_MAX_ITERATIONS, cfg->threads);
+        if (stationary)
+            mixingSteps = markovMixingTime(tm, stationary, lastState, states->order, cfg->mixingEpsilon,
+                                           MARKOV_STATIONARY_MAX_ITERATIONS, cfg->threads);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!stationary)
+            LOG_ERROR("Unable to compute the stationary distribution");
+        else {
+            const double delta = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+            printf("\n====> STATIONARY DISTRIBUTION OF DEFAULT MARKOV CHAIN (%lf s):\n", delta);
+            markovPrintStationary(stationary);
+            if (mixingSteps != -1)
+                printf("MIXING TIME FROM LAST STATE (distance <= %g): %lld steps\n", cfg->mixingEpsilon, mixingSteps);
+            else
+                printf("MIXING TIME FROM LAST STATE (distance <= %g): not reached\n", cfg->mixingEpsilon);
+        }
+    }
+
+    // Exact distribution of the next values, propagating the state probabilities of the Default Markov Chain
+    // (only up to the mixing time, if known)
+    if (cfg->useExactForecast) {
+        static const double quantiles[] = {0.05, 0.5, 0.95};
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        MarkovForecast* forecast = (stationary && mixingSteps != -1)
+            ? markovLongRunForecast(tm, stationary, (size_t)mixingSteps, lastState, states->order,
+                                    (uint)cfg->predictSteps, quantiles, sizeof(quantiles) / sizeof(quantiles[0]))
+            : markovExactForecast(tm, lastState, states->order, (uint)cfg->predictSteps, quantiles,
+                                  sizeof(quantiles) / sizeof(quantiles[0]));
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!forecast)
+            LOG_ERROR("Unable to compute exact forecast");
+        else {
+            const double delta = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+            printf("\n====> EXACT FORECAST USING DEFAULT MARKOV CHAIN (%lf s):\n", delta);
+            markovPrintForecast(forecast);
+            markovFreeForecast(&forecast);
+        }
+    }
+
+    // Exact distribution of the value 'exact_horizon' steps ahead only (repeated squaring for long horizons)
+    if (cfg->exactHorizon > 0) {
+        double* dist = malloc(sizeof(double) * states->nVals);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const bool ok = dist && markovExactMarginalAt(tm, lastState, states->order, cfg->exactHorizon, dist);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!ok)
+            LOG_ERROR("Unable to compute the exact distribution at the horizon");
+        else {
+            const double delta = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+            size_t mode = 0;
+            for (size_t v = 1; v < states->nVals; v++) {
+                if (dist[v] > dist[mode])
+                    mode = v;
+            }
+            printf("\n====> EXACT DISTRIBUTION %lu STEPS AHEAD USING DEFAULT MARKOV CHAIN (%lf s):\n",
+                   cfg->exactHorizon, delta);
+            printf("STEP %lu: MODE %d (%lf)\n", cfg->exactHorizon, states->vals[mode], dist[mode]);
+        }
+        free(dist);
+    }
+
     if (wait)
         enterWait();
 
     // Predictions using Markov Graph random walk
     if (cfg->useMarkovGraph && graph) {
-        mkGraphRandWalk(graph, lastState, cfg->predictSteps, predictions, conf);
+        mkGraphRandWalk(graph, lastState, cfg->predictSteps, &rng, predictions, conf);
 
         printf("\n====> PREDICTIONS USING RANDOM WALK IN MARKOV GRAPH (acc: %lf): ", gAcc);
         printArr_i(predictions, cfg->predictSteps);
@@ -513,6 +1041,32 @@ int main(int argc, char* argv[]) {
             printArr_d(conf, cfg->predictSteps);
             printf("=====> FINAL PROPAGATED CONFIDENCE: %lf\n", prop);
         }
+
+        // Distribution of the next values from many walkers in lockstep over the graph
+        if (cfg->useMonteCarlo && cfg->monteCarloPaths > 0) {
+            static const double quantiles[] = {0.05, 0.5, 0.95};
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            MarkovForecast* forecast = NULL;
+            double* marginals = malloc(sizeof(double) * (cfg->predictSteps * states->nVals + 1));
+            if (marginals && mkGraphWalkMarginals(graph, lastState, cfg->predictSteps, cfg->monteCarloPaths,
+                                                  cfg->randSeed, marginals))
+                forecast = markovForecastFromMarginals(states, (uint)cfg->predictSteps, marginals,
+                                                       cfg->monteCarloPaths, quantiles,
+                                                       sizeof(quantiles) / sizeof(quantiles[0]));
+            free(marginals);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            if (!forecast)
+                LOG_ERROR("Unable to run random walks forecast");
+            else {
+                const double delta =
+                    (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+                printf("\n====> RANDOM WALKS FORECAST USING MARKOV GRAPH (%lu walkers, %lf s):\n",
+                       cfg->monteCarloPaths, delta);
+                markovPrintForecast(forecast);
+                markovFreeForecast(&forecast);
+            }
+        }
     }
 
     if (wait)
@@ -521,7 +1075,7 @@ int main(int argc, char* argv[]) {
     // Predictions using Markov Network
     if (cfg->useMarkovNetwork && net) {
         mkNetSetLastState(net, lastState);
-        mkNetPredict(net, cfg->predictSteps, predictions, conf);
+        mkNetPredict(net, cfg->predictSteps, &rng, predictions, conf);
 
         printf("\n====> PREDICTIONS USING MARKOV NETWORK (acc: %lf): ", nAcc);
         printArr_i(predictions, cfg->predictSteps);
@@ -535,9 +1089,30 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (wait)
+        enterWait();
+
+    // Predictions using the longest matching contexts of the Markov Tree
+    if (cfg->useMarkovTree && tree) {
+        mkTreePredict(tree, cfg->predictSteps, data, dataSize, &rng, predictions, conf);
+
+        printf("\n====> PREDICTIONS USING MARKOV TREE (acc: %lf): ", tAcc);
+        printArr_i(predictions, cfg->predictSteps);
+        if (cfg->showConfidence) {
+            double prop = 1.0;
+            for (size_t i = 0; i < cfg->predictSteps; i++)
+                prop *= conf[i];
+            printf("=====> CONFIDENCE: ");
+            printArr_d(conf, cfg->predictSteps);
+            printf("=====> FINAL PROPAGATED CONFIDENCE: %lf\n", prop);
+        }
+    }
+
     configFree(&cfg);
+    markovFreeStationary(&stationary);
     mkGraphFree(&graph);
     mkNetFree(&net);
+    mkTreeFree(&tree);
     markovFreeTransMatrix(&tm);
     markovFreeState(&states);
     free(predictions);
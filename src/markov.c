@@ -8,8 +8,10 @@
 
 #include "utils.h"
 #include "logging.h"
+#include "parallel.h"
 
-MarkovState* markovBuildStates(const uint order, const int* vals, size_t nVals) {
+// Alphabet, value dictionary and number of states of a MarkovState, without its states block
+static MarkovState* markovInitStates(const uint order, const int* vals, size_t nVals) {
     MarkovState* state = malloc(sizeof(MarkovState));
     if (!state) {
         LOG_ERROR("malloc failed for MarkovState*");
@@ -27,26 +29,73 @@ MarkovState* markovBuildStates(const uint order, const int* vals, size_t nVals)
     }
     memcpy(state->vals, vals, nVals * sizeof(int));
 
-    // Allocate memory for states
-    state->nStates = (size_t)pow((double)nVals, (double)order);
-    state->states = malloc(state->nStates * sizeof(int*));
-    if (!state->states) {
-        LOG_ERROR("malloc failed for MarkovState states combinations (state->states)");
-        free(state->vals);
-        free(state);
-        return NULL;
+    // Build the value -> id dictionary when the values span a small range (always the case for binary series)
+    state->valIndex = NULL;
+    state->minVal = 0;
+    state->valRange = 0;
+    if (nVals > 0) {
+        int minVal = vals[0], maxVal = vals[0];
+        for (size_t i = 1; i < nVals; i++) {
+            if (vals[i] < minVal) minVal = vals[i];
+            if (vals[i] > maxVal) maxVal = vals[i];
+        }
+        const size_t range = (size_t)((lli)maxVal - (lli)minVal) + 1;
+        if (range <= MARKOV_MAX_DICT_RANGE || range <= 4 * nVals) {
+            state->valIndex = malloc(sizeof(lli) * range);
+            if (state->valIndex) {
+                for (size_t i = 0; i < range; i++)
+                    state->valIndex[i] = -1;
+                for (size_t i = 0; i < nVals; i++)
+                    state->valIndex[(size_t)((lli)vals[i] - (lli)minVal)] = (lli)i;
+                state->minVal = minVal;
+                state->valRange = range;
+            }
+        }
+    }
+    // spread out values get a hash map instead
+    state->valMap = NULL;
+    if (!state->valIndex && nVals > 0) {
+        state->valMap = hashMapInit(nVals);
+        for (size_t i = 0; i < nVals && state->valMap; i++) {
+            if (!hashMapPut(state->valMap, (size_t)(unsigned int)vals[i], i))
+                hashMapFree(&state->valMap);
+        }
+        if (!state->valMap)
+            LOG_WARNING("malloc failed for value dictionary, falling back to scanning values");
     }
-    for (size_t i = 0; i < state->nStates; i++) {
-        state->states[i] = calloc(order, sizeof(int));
-        if (!state->states[i]) {
-            LOG_ERROR("calloc failed for one of the state in MarkovState state->states");
-            for (size_t j = 0; j < i; j++)
-                free(state->states[j]);
-            free(state->states);
+
+    // nVals^order states, and every transition code (stateID*nVals + valID) must fit in a size_t
+    state->nStates = 1;
+    for (uint o = 0; o < order; o++) {
+        if (nVals > 1 && state->nStates > SIZE_MAX / nVals / nVals) {
+            LOG_ERROR("Too many states for the order and values in markovInitStates");
+            free(state->valIndex);
+            hashMapFree(&state->valMap);
             free(state->vals);
             free(state);
             return NULL;
         }
+        state->nStates *= nVals;
+    }
+    state->states = NULL;
+
+    return state;
+}
+
+MarkovState* markovBuildStates(const uint order, const int* vals, size_t nVals) {
+    MarkovState* state = markovInitStates(order, vals, nVals);
+    if (!state)
+        return NULL;
+
+    // All states live in one row-major block, state i is states[i*order .. (i+1)*order)
+    state->states = alignedAlloc(state->nStates * order * sizeof(int));
+    if (!state->states) {
+        LOG_ERROR("malloc failed for MarkovState states combinations (state->states)");
+        free(state->valIndex);
+        hashMapFree(&state->valMap);
+        free(state->vals);
+        free(state);
+        return NULL;
     }
 
     // Initialize states
@@ -57,16 +106,21 @@ MarkovState* markovBuildStates(const uint order, const int* vals, size_t nVals)
     return state;
 }
 
+MarkovState* markovBuildLazyStates(const uint order, const int* vals, size_t nVals) {
+    // states are decoded from their ids when needed (see markovDecodeState)
+    return markovInitStates(order, vals, nVals);
+}
+
 void markovFreeState(MarkovState** state) {
     if (!state || !(*state))
         return;
 
     // Free vals
     free((*state)->vals);
+    free((*state)->valIndex);
+    hashMapFree(&(*state)->valMap);
 
     // Free states
-    for (size_t i = 0; i < (*state)->nStates; i++)
-        free((*state)->states[i]);
     free((*state)->states);
 
     // Free the state pointer and set it to NULL
@@ -75,21 +129,31 @@ void markovFreeState(MarkovState** state) {
 }
 
 lli markovIdState(const MarkovState* state, const int* stateVec) {
-    if (!state || !stateVec || !state->states)
+    if (!state || !stateVec)
         return -1;
+    return markovEncodeState(state, stateVec);
+}
 
-    for (size_t stateID=0; stateID < state->nStates; stateID++) {
-        if (memcmp(stateVec, state->states[stateID], sizeof(int) * state->order) == 0)
-            return (lli)stateID;
-    }
-
-    return -1;
+int* markovStateVec(const MarkovState* state, const size_t stateID) {
+    if (!state->states)
+        return NULL;
+    return state->states + stateID * state->order;
 }
 
 lli markovIdValState(const MarkovState* state, const int val) {
     if (!state)
         return -1;
 
+    if (state->valIndex) {
+        const lli offset = (lli)val - (lli)state->minVal;
+        if (offset < 0 || (size_t)offset >= state->valRange)
+            return -1;
+        return state->valIndex[offset];
+    }
+    if (state->valMap)
+        return hashMapGet(state->valMap, (size_t)(unsigned int)val);
+
+    // no dictionary could be allocated
     for (size_t valID = 0; valID < state->nVals; valID++) {
         if (state->vals[valID] == val)
             return (lli)valID;
@@ -98,36 +162,63 @@ lli markovIdValState(const MarkovState* state, const int val) {
     return -1;
 }
 
-TransitionMatrix* markovInitTransMatrix(const double** probs, MarkovState* state) {
+lli markovEncodeState(const MarkovState* state, const int* stateVec) {
+    if (!state || !stateVec)
+        return -1;
+
+    size_t stateID = 0;
+    for (size_t o = 0; o < state->order; o++) {
+        const lli valID = markovIdValState(state, stateVec[o]);
+        if (valID == -1)
+            return -1;
+        stateID = stateID * state->nVals + (size_t)valID;
+    }
+
+    return (lli)stateID;
+}
+
+void markovDecodeState(const MarkovState* state, size_t stateID, int* outVec) {
+    if (!state || !outVec || state->nVals == 0)
+        return;
+
+    // Least significant digit is the last value of the state
+    for (size_t o = state->order; o > 0; o--) {
+        outVec[o-1] = state->vals[stateID % state->nVals];
+        stateID /= state->nVals;
+    }
+}
+
+size_t markovNextStateId(const MarkovState* state, size_t stateID, size_t valID) {
+    return (stateID * state->nVals + valID) % state->nStates;
+}
+
+TransitionMatrix* markovInitTransMatrix(const double* probs, MarkovState* state) {
     if (!state)
         return NULL;
 
-    TransitionMatrix* m = malloc(sizeof(TransitionMatrix));
+    TransitionMatrix* m = calloc(1, sizeof(TransitionMatrix));
     if (!m) {
         LOG_ERROR("malloc failed for TransitionMatrix* m");
         return NULL;
     }
 
     m->state = state;
+    m->layout = TM_DENSE;
+    m->sampler = calloc(1, sizeof(MarkovSampler));
+    if (!m->sampler) {
+        LOG_ERROR("calloc failed for TransitionMatrix sampler");
+        free(m);
+        return NULL;
+    }
     if (probs) {
-        m->probs = malloc(state->nStates * sizeof(double*));
+        m->probs = alignedAlloc(state->nStates * state->nVals * sizeof(double));
         if (!m->probs) {
             LOG_ERROR("malloc failed for probabilities matrix m->probs");
+            free(m->sampler);
             free(m);
             return NULL;
         }
-        for (size_t i = 0; i < state->nStates; i++) {
-            m->probs[i] = malloc(state->nVals * sizeof(double));
-            if (!m->probs[i]) {
-                LOG_ERROR("malloc failed for one of probabilities rows");
-                for (size_t j = 0; j < i; j++)
-                    free(m->probs[j]);
-                free(m->probs);
-                free(m);
-                return NULL;
-            }
-            memcpy(m->probs[i], probs[i], state->nVals * sizeof(double));
-        }
+        memcpy(m->probs, probs, state->nStates * state->nVals * sizeof(double));
     } else {
         m->probs = NULL;
     }
@@ -135,94 +226,1265 @@ TransitionMatrix* markovInitTransMatrix(const double** probs, MarkovState* state
     return m;
 }
 
+TransitionMatrix* markovInitSparseTransMatrix(MarkovState* state) {
+    TransitionMatrix* m = markovInitTransMatrix(NULL, state);
+    if (!m)
+        return NULL;
+    m->layout = TM_SPARSE;
+    return m;
+}
+
 TransitionMatrix* markovBuildTransMatrix(const int* data, const size_t n, MarkovState* state) {
     if (!data || !state)
         return NULL;
 
-    TransitionMatrix* m = malloc(sizeof(TransitionMatrix));
-    if (!m) {
-        LOG_ERROR("malloc failed for TransitionMatrix* m");
+    TransitionMatrix* m = markovInitTransMatrix(NULL, state);
+    if (!m)
         return NULL;
-    }
-    m->state = state;
 
-    // The probability matrix will have dimension N_States X N_Values
-    m->probs = malloc(state->nStates * sizeof(double*));
+    markovFillProbabilities(m, data, n);
     if (!m->probs) {
-        LOG_ERROR("malloc failed for probabilities matrix m->probs");
-        free(m);
+        LOG_ERROR("Unable to fill transition matrix");
+        markovFreeTransMatrix(&m);
         return NULL;
     }
-    for (size_t i = 0; i < state->nStates; i++) {
-        m->probs[i] = malloc(state->nVals * sizeof(double));
-        if (!m->probs[i]) {
-            LOG_ERROR("malloc failed for one of probabilities rows");
-            for (size_t j = 0; j < i; j++)
-                free(m->probs[j]);
-            free(m->probs);
-            free(m);
-            return NULL;
-        }
-    }
+
+    return m;
+}
+
+TransitionMatrix* markovBuildSparseTransMatrix(const int* data, const size_t n, MarkovState* state) {
+    if (!data || !state)
+        return NULL;
+
+    TransitionMatrix* m = markovInitSparseTransMatrix(state);
+    if (!m)
+        return NULL;
 
     markovFillProbabilities(m, data, n);
+    if (!m->rowPtr) {
+        LOG_ERROR("Unable to fill sparse transition matrix");
+        markovFreeTransMatrix(&m);
+        return NULL;
+    }
 
     return m;
 }
 
+// Free probabilities, counts and every sparse array (the matrix is left empty)
+static void markovFreeStorage(TransitionMatrix* m) {
+    if (m->readOnly) {
+        // the blocks belong to the mapping, only forget them
+        m->probs = m->sparseProbs = NULL;
+        m->rowStates = m->rowPtr = m->colIds = NULL;
+        m->counts = m->rowTotals = NULL;
+        m->dirty = NULL;
+    }
+    free(m->probs);
+    free(m->rowStates);
+    free(m->rowPtr);
+    free(m->colIds);
+    free(m->sparseProbs);
+    free(m->counts);
+    free(m->rowTotals);
+    free(m->dirty);
+    hashMapFree(&m->rowIndex);
+    m->probs = NULL;
+    m->rowStates = NULL;
+    m->rowPtr = NULL;
+    m->colIds = NULL;
+    m->sparseProbs = NULL;
+    m->counts = NULL;
+    m->rowTotals = NULL;
+    m->dirty = NULL;
+    m->nRows = 0;
+    m->rowCap = 0;
+    m->entryCap = 0;
+}
+
 void markovFreeTransMatrix(TransitionMatrix** m) {
-    if (!m || !(*m) || !(*m)->probs)
+    if (!m || !(*m))
         return;
 
     // Don't free state because it may be shared
 
-    // Free probabilities
-    for (size_t i = 0; i < (*m)->state->nStates; i++)
-        free((*m)->probs[i]);
-    free((*m)->probs);
+    // Free probabilities and counts
+    markovFreeStorage(*m);
+    markovResetSampler(*m);
+    free((*m)->sampler);
 
     // Finally free TM pointer and set it to NULL
     free(*m);
     *m = NULL;
 }
 
+// Bytes of the dense blocks of a matrix over 'state' (SIZE_MAX if they don't even fit in a size_t)
+static size_t markovDenseBytes(const MarkovState* state) {
+    const size_t size = state->nStates * state->nVals;
+    const size_t perEntry = sizeof(double) + sizeof(uint64_t);
+    const size_t perRow = sizeof(uint64_t) + sizeof(ubyte);
+    if (size > (SIZE_MAX - state->nStates * perRow) / perEntry)
+        return SIZE_MAX;
+    return size * perEntry + state->nStates * perRow;
+}
+
+// Allocate the dense blocks that are still missing (counts start at zero)
+static bool markovAllocDense(TransitionMatrix* m) {
+    const size_t nStates = m->state->nStates;
+    const size_t size = nStates * m->state->nVals;
+    if (!m->probs && markovDenseBytes(m->state) > MARKOV_DENSE_MAX_BYTES) {
+        LOG_ERROR("Dense transition matrix over the memory budget, use the sparse layout");
+        fprintf(stderr, "\t%zu states x %zu values (budget of %zu bytes)\n", nStates, m->state->nVals,
+                (size_t)MARKOV_DENSE_MAX_BYTES);
+        return false;
+    }
+    if (!m->probs) {
+        m->probs = alignedAlloc(size * sizeof(double));
+        if (m->probs)
+            memset(m->probs, 0, size * sizeof(double));
+    }
+    if (!m->counts)
+        m->counts = calloc(size, sizeof(uint64_t));
+    if (!m->rowTotals)
+        m->rowTotals = calloc(nStates, sizeof(uint64_t));
+    if (!m->dirty)
+        m->dirty = calloc(nStates, sizeof(ubyte));
+
+    if (!m->probs || !m->counts || !m->rowTotals || !m->dirty) {
+        LOG_ERROR("malloc failed for dense transition matrix");
+        markovFreeStorage(m);
+        return false;
+    }
+    return true;
+}
+
+// Make room for at least 'rows' rows and 'entries' transitions in a sparse matrix
+static bool markovReserveSparse(TransitionMatrix* m, const size_t rows, const size_t entries) {
+    const bool first = (m->rowPtr == NULL);
+    if (!m->rowIndex) {
+        m->rowIndex = hashMapInit(rows);
+        if (!m->rowIndex)
+            return false;
+    }
+
+    if (first || rows > m->rowCap) {
+        size_t cap = (m->rowCap > 0) ? m->rowCap : 1;
+        while (cap < rows)
+            cap *= 2;
+        size_t* rowStates = realloc(m->rowStates, sizeof(size_t) * (cap + 1));
+        if (rowStates) m->rowStates = rowStates;
+        size_t* rowPtr = realloc(m->rowPtr, sizeof(size_t) * (cap + 1));
+        if (rowPtr) m->rowPtr = rowPtr;
+        uint64_t* rowTotals = realloc(m->rowTotals, sizeof(uint64_t) * (cap + 1));
+        if (rowTotals) m->rowTotals = rowTotals;
+        ubyte* dirty = realloc(m->dirty, sizeof(ubyte) * (cap + 1));
+        if (dirty) m->dirty = dirty;
+        if (!rowStates || !rowPtr || !rowTotals || !dirty)
+            return false;
+        m->rowCap = cap;
+        if (first)
+            m->rowPtr[0] = 0;
+    }
+
+    if (first || entries > m->entryCap) {
+        size_t cap = (m->entryCap > 0) ? m->entryCap : 1;
+        while (cap < entries)
+            cap *= 2;
+        size_t* colIds = realloc(m->colIds, sizeof(size_t) * (cap + 1));
+        if (colIds) m->colIds = colIds;
+        double* sparseProbs = realloc(m->sparseProbs, sizeof(double) * (cap + 1));
+        if (sparseProbs) m->sparseProbs = sparseProbs;
+        uint64_t* counts = realloc(m->counts, sizeof(uint64_t) * (cap + 1));
+        if (counts) m->counts = counts;
+        if (!colIds || !sparseProbs || !counts)
+            return false;
+        m->entryCap = cap;
+    }
+
+    return true;
+}
+
+// Shift 'val' into the rolling state window (stateID, filled). If the window already held a full
+// state, the transition found is written to *code as stateID*nVals + valID and true is returned.
+// Values out of the alphabet restart the window
+static inline bool markovShiftValue(const MarkovState* state, size_t* stateID, uint* filled, const int val, size_t* code) {
+    const lli valID = markovIdValState(state, val);
+    if (valID == -1) {
+        *stateID = 0;
+        *filled = 0;
+        return false;
+    }
+
+    bool complete = false;
+    if (*filled >= state->order) {
+        *code = (*stateID) * state->nVals + (size_t)valID;
+        complete = true;
+    }
+    else
+        (*filled)++;
+    *stateID = markovNextStateId(state, *stateID, (size_t)valID);
+    return complete;
+}
+
+void markovCountTransitions(const MarkovState* state, const int* data, const size_t n, uint64_t* counts) {
+    if (!state || !data || !counts)
+        return;
+
+    // Walk the series once keeping a rolling id of the last 'order' values,
+    // shifting every new value into it (see markovEncodeState)
+    size_t stateID = 0, code = 0;
+    uint filled = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (markovShiftValue(state, &stateID, &filled, data[i], &code))
+            counts[code]++;
+    }
+}
+
+size_t markovCollectTransitions(const MarkovState* state, const int* data, const size_t n, size_t* codesOut) {
+    if (!state || !data || !codesOut)
+        return 0;
+
+    size_t stateID = 0, code = 0, nCodes = 0;
+    uint filled = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (markovShiftValue(state, &stateID, &filled, data[i], &code))
+            codesOut[nCodes++] = code;
+    }
+    return nCodes;
+}
+
+static int _cmpCodeAsc(const void* a, const void* b) {
+    const size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Fill the sparse matrix with the transition codes (sorted in place)
+static void markovFillSparseCodes(TransitionMatrix* m, size_t* codes, const size_t nCodes) {
+    const size_t nVals = m->state->nVals;
+
+    // Sort the transitions: equal transitions become consecutive
+    // and the rows come out in the order of the states
+    qsort(codes, nCodes, sizeof(size_t), _cmpCodeAsc);
+
+    size_t nnz = 0, nRows = 0;
+    for (size_t i = 0; i < nCodes; i++) {
+        if (i == 0 || codes[i] != codes[i-1])
+            nnz++;
+        if (i == 0 || codes[i] / nVals != codes[i-1] / nVals)
+            nRows++;
+    }
+
+    markovFreeStorage(m);
+    if (!markovReserveSparse(m, nRows, nnz)) {
+        LOG_ERROR("malloc failed for sparse transition matrix");
+        markovFreeStorage(m);
+        return;
+    }
+
+    // Run-length the sorted codes into CSR rows, counting each transition
+    size_t row = 0, entry = 0;
+    m->rowPtr[0] = 0;
+    for (size_t i = 0; i < nCodes; i++) {
+        const size_t stateID = codes[i] / nVals;
+        if (i == 0 || stateID != codes[i-1] / nVals) {
+            if (i > 0)
+                m->rowPtr[++row] = entry;
+            m->rowStates[row] = stateID;
+            m->rowTotals[row] = 0;
+            m->dirty[row] = 0;
+            hashMapPut(m->rowIndex, stateID, row);
+        }
+        if (i == 0 || codes[i] != codes[i-1]) {
+            m->colIds[entry] = codes[i] % nVals;
+            m->counts[entry] = 0;
+            entry++;
+        }
+        m->counts[entry-1]++;
+        m->rowTotals[row]++;
+    }
+    m->nRows = nRows;
+    m->rowPtr[nRows] = nnz;
+
+    // finally, normalize each row by its total
+    for (size_t r = 0; r < nRows; r++) {
+        for (size_t e = m->rowPtr[r]; e < m->rowPtr[r+1]; e++)
+            m->sparseProbs[e] = (double)m->counts[e] / (double)m->rowTotals[r];
+    }
+}
+
+static void markovFillSparse(TransitionMatrix* m, const int* data, const size_t n) {
+    // Collect every transition, then build the rows from them
+    size_t* codes = malloc(sizeof(size_t) * n);
+    if (!codes) {
+        LOG_ERROR("malloc failed for transition codes in markovFillProbabilities");
+        return;
+    }
+    const size_t nCodes = markovCollectTransitions(m->state, data, n, codes);
+    markovFillSparseCodes(m, codes, nCodes);
+    free(codes);
+}
+
+// Normalize every row of a dense matrix by its total (counts must be filled)
+static void markovNormalizeDense(TransitionMatrix* m) {
+    const size_t nVals = m->state->nVals;
+    for (size_t stateID = 0; stateID < m->state->nStates; stateID++) {
+        const uint64_t* row = m->counts + stateID * nVals;
+        double* probs = m->probs + stateID * nVals;
+        uint64_t total = 0;
+        for (size_t valID = 0; valID < nVals; valID++)
+            total += row[valID];
+
+        for (size_t valID = 0; valID < nVals; valID++)
+            probs[valID] = (total > 0) ? (double)row[valID] / (double)total : 0.0;
+        m->rowTotals[stateID] = total;
+        m->dirty[stateID] = 0;
+    }
+}
+
+// Keep the window of the last values, so markovAppend continues the series.
+// It only depends on the last 'order' values
+static void markovSetWindow(TransitionMatrix* m, const int* data, const size_t n) {
+    m->lastStateID = 0;
+    m->lastFilled = 0;
+    size_t code = 0;
+    const size_t start = (n > m->state->order) ? n - m->state->order : 0;
+    for (size_t i = start; i < n; i++)
+        markovShiftValue(m->state, &m->lastStateID, &m->lastFilled, data[i], &code);
+}
+
 void markovFillProbabilities(TransitionMatrix* m, const int* data, const size_t n) {
     if (!m || !data || !m->state)
         return;
+    if (m->readOnly) {
+        LOG_ERROR("Unable to fill a read-only transition matrix, copy it first");
+        return;
+    }
     if (m->state->order > (n-1))
         return;
 
-    if (!m->probs) {
-        m->probs = calloc(m->state->nStates, sizeof(double*));
-        for (size_t i = 0; i < m->state->nStates; i++)
-            m->probs[i] = calloc(m->state->nVals, sizeof(double));
+    markovResetSampler(m);
+
+    if (m->layout == TM_SPARSE)
+        markovFillSparse(m, data, n);
+    else {
+        if (!markovAllocDense(m))
+            return;
+
+        // Count every transition in a single pass through the data, then normalize every row by its total
+        memset(m->counts, 0, m->state->nStates * m->state->nVals * sizeof(uint64_t));
+        markovCountTransitions(m->state, data, n, m->counts);
+        markovNormalizeDense(m);
     }
 
-    // For every state size N, create a vector of N+1 size and count the occurrences of that vector
-    // since it will be the number of times that state transitioned to the (N+1) value
-    const size_t stateVecSize = m->state->order + 1;
-    int* stateVec = malloc(sizeof(int) * stateVecSize);
-    for (size_t stateID = 0; stateID < m->state->nStates; stateID++) {
-        // copy first (order) values to statevec
-        memcpy(stateVec, m->state->states[stateID], sizeof(int)*m->state->order);
+    markovSetWindow(m, data, n);
+    markovPrepareSampler(m);
+}
+
+// Defined with the sampling cache below
+static void markovFillRow(TransitionMatrix* m, const size_t row);
+// Defined with markovAdjustCounts below
+static bool markovApplyCounts(TransitionMatrix* m, const size_t* added, const uint64_t* weights, const size_t nAdded,
+                              const size_t* removed, const size_t nRemoved);
+
+void markovAppend(TransitionMatrix* m, const int* vals, const size_t k) {
+    if (!m || !vals || !m->state)
+        return;
+    if (m->readOnly) {
+        LOG_ERROR("Unable to append to a read-only transition matrix, copy it first");
+        return;
+    }
+    if (k == 0)
+        return;
+
+    // the transitions of the new values are counted all at once, and the window only moves if they are
+    size_t* codes = malloc(sizeof(size_t) * k);
+    if (!codes) {
+        LOG_ERROR("Unable to allocate memory in markovAppend");
+        return;
+    }
+    size_t stateID = m->lastStateID, nCodes = 0;
+    uint filled = m->lastFilled;
+    for (size_t i = 0; i < k; i++) {
+        if (markovShiftValue(m->state, &stateID, &filled, vals[i], codes + nCodes))
+            nCodes++;
+    }
+    if (markovApplyCounts(m, codes, NULL, nCodes, NULL, 0)) {
+        m->lastStateID = stateID;
+        m->lastFilled = filled;
+    }
+    else
+        LOG_ERROR("Unable to grow sparse transition matrix in markovAppend");
+    free(codes);
+}
+
+bool markovMergeCounts(TransitionMatrix* dst, const TransitionMatrix* src) {
+    if (!dst || !src || !src->counts)
+        return false;
+    if (dst->readOnly) {
+        LOG_ERROR("Unable to merge into a read-only transition matrix, copy it first");
+        return false;
+    }
+
+    const MarkovState* ds = dst->state;
+    const MarkovState* ss = src->state;
+    if (ds != ss && (ds->order != ss->order || ds->nVals != ss->nVals ||
+                     memcmp(ds->vals, ss->vals, sizeof(int) * ds->nVals) != 0)) {
+        LOG_ERROR("Unable to merge transition matrices with different states");
+        return false;
+    }
+
+    // Add every non-zero count of 'src', whatever the layouts are, as codes weighted by their counts
+    const size_t nVals = ss->nVals;
+    size_t nCodes = 0;
+    if (src->layout == TM_DENSE) {
+        for (size_t c = 0; c < ss->nStates * nVals; c++)
+            nCodes += (src->counts[c] > 0);
+    }
+    else
+        nCodes = src->rowPtr[src->nRows];
+    size_t* codes = malloc(sizeof(size_t) * (nCodes + 1));
+    uint64_t* weights = malloc(sizeof(uint64_t) * (nCodes + 1));
+    if (!codes || !weights) {
+        free(codes);
+        free(weights);
+        return false;
+    }
+    nCodes = 0;
+    if (src->layout == TM_DENSE) {
+        for (size_t c = 0; c < ss->nStates * nVals; c++) {
+            if (src->counts[c] > 0) {
+                codes[nCodes] = c;
+                weights[nCodes++] = src->counts[c];
+            }
+        }
+    }
+    else {
+        for (size_t r = 0; r < src->nRows; r++) {
+            for (size_t e = src->rowPtr[r]; e < src->rowPtr[r+1]; e++) {
+                codes[nCodes] = src->rowStates[r] * nVals + src->colIds[e];
+                weights[nCodes++] = src->counts[e];
+            }
+        }
+    }
+
+    const bool ok = markovApplyCounts(dst, codes, weights, nCodes, NULL, 0);
+    free(codes);
+    free(weights);
+    return ok;
+}
+
+typedef struct {
+    const int* data;
+    size_t n;
+    MarkovState* state;
+    TransMatrixLayout layout;
+    size_t nChunks;
+    TransitionMatrix** parts;
+} MarkovChunkJob;
+
+// Count the chunks [begin, end). Chunk c counts the transitions ending in its share of the data
+static void markovCountChunks(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    (void)thread;
+    MarkovChunkJob* job = (MarkovChunkJob*)ctx;
+    const size_t order = job->state->order;
+    for (size_t c = begin; c < end; c++) {
+        const size_t lo = job->n * c / job->nChunks;
+        const size_t hi = job->n * (c + 1) / job->nChunks;
+        const size_t from = (lo > order) ? lo - order : 0;
+        job->parts[c] = (job->layout == TM_SPARSE) ? markovBuildSparseTransMatrix(job->data + from, hi - from, job->state)
+                                                   : markovBuildTransMatrix(job->data + from, hi - from, job->state);
+    }
+}
+
+typedef struct {
+    size_t state;
+    size_t row;
+} MarkovRowKey;
+
+static int _cmpRowKeyAsc(const void* a, const void* b) {
+    const size_t x = ((const MarkovRowKey*)a)->state, y = ((const MarkovRowKey*)b)->state;
+    return (x > y) - (x < y);
+}
+
+// Put the rows of a sparse matrix back in the order of their states, like a serial build leaves them
+// (merged rows are appended at the end)
+static bool markovSortRows(TransitionMatrix* m) {
+    const size_t nRows = m->nRows, nnz = m->rowPtr[m->nRows];
+    bool sorted = true;
+    for (size_t r = 1; r < nRows && sorted; r++)
+        sorted = m->rowStates[r-1] < m->rowStates[r];
+    if (sorted)
+        return true;
+
+    MarkovRowKey* keys = malloc(sizeof(MarkovRowKey) * nRows);
+    size_t* rowStates = malloc(sizeof(size_t) * (nRows + 1));
+    size_t* rowPtr = malloc(sizeof(size_t) * (nRows + 1));
+    uint64_t* rowTotals = malloc(sizeof(uint64_t) * (nRows + 1));
+    ubyte* dirty = malloc(sizeof(ubyte) * (nRows + 1));
+    size_t* colIds = malloc(sizeof(size_t) * (nnz + 1));
+    double* sparseProbs = malloc(sizeof(double) * (nnz + 1));
+    uint64_t* counts = malloc(sizeof(uint64_t) * (nnz + 1));
+    if (!keys || !rowStates || !rowPtr || !rowTotals || !dirty || !colIds || !sparseProbs || !counts) {
+        LOG_ERROR("malloc failed for sorting the rows of a sparse transition matrix");
+        free(keys);
+        free(rowStates);
+        free(rowPtr);
+        free(rowTotals);
+        free(dirty);
+        free(colIds);
+        free(sparseProbs);
+        free(counts);
+        return false;
+    }
+    for (size_t r = 0; r < nRows; r++) {
+        keys[r].state = m->rowStates[r];
+        keys[r].row = r;
+    }
+    qsort(keys, nRows, sizeof(MarkovRowKey), _cmpRowKeyAsc);
+
+    rowPtr[0] = 0;
+    for (size_t r = 0; r < nRows; r++) {
+        const size_t old = keys[r].row;
+        const size_t begin = m->rowPtr[old], len = m->rowPtr[old+1] - begin;
+        rowStates[r] = keys[r].state;
+        rowTotals[r] = m->rowTotals[old];
+        dirty[r] = m->dirty[old];
+        memcpy(colIds + rowPtr[r], m->colIds + begin, sizeof(size_t) * len);
+        memcpy(sparseProbs + rowPtr[r], m->sparseProbs + begin, sizeof(double) * len);
+        memcpy(counts + rowPtr[r], m->counts + begin, sizeof(uint64_t) * len);
+        rowPtr[r+1] = rowPtr[r] + len;
+        hashMapPut(m->rowIndex, keys[r].state, r);
+    }
+    free(keys);
+
+    free(m->rowStates);
+    free(m->rowPtr);
+    free(m->rowTotals);
+    free(m->dirty);
+    free(m->colIds);
+    free(m->sparseProbs);
+    free(m->counts);
+    m->rowStates = rowStates;
+    m->rowPtr = rowPtr;
+    m->rowTotals = rowTotals;
+    m->dirty = dirty;
+    m->colIds = colIds;
+    m->sparseProbs = sparseProbs;
+    m->counts = counts;
+    m->rowCap = nRows;
+    m->entryCap = nnz;
+    markovResetSampler(m);
+    return true;
+}
+
+TransitionMatrix* markovBuildTransMatrixParallel(const int* data, const size_t n, MarkovState* state,
+                                                 const TransMatrixLayout layout, const uint nThreads) {
+    if (!data || !state)
+        return NULL;
+
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    size_t nChunks = n / MARKOV_PARALLEL_MIN_CHUNK;
+    if (nChunks > threads)
+        nChunks = threads;
+    if (nChunks < 2)
+        return (layout == TM_SPARSE) ? markovBuildSparseTransMatrix(data, n, state) : markovBuildTransMatrix(data, n, state);
+
+    TransitionMatrix** parts = calloc(nChunks, sizeof(TransitionMatrix*));
+    if (!parts) {
+        LOG_ERROR("malloc failed for the chunks in markovBuildTransMatrixParallel");
+        return NULL;
+    }
+    MarkovChunkJob job = {data, n, state, layout, nChunks, parts};
+    parallelFor(nChunks, threads, markovCountChunks, &job);
 
-        // then, the last value will be a possible value for the transition (from m->state->values)
-        uint total = 0;
-        for (size_t valID = 0; valID < m->state->nVals; valID++) {
-            stateVec[stateVecSize-1] = m->state->vals[valID];
-            uint count = countSubsetIn_i(data, n, stateVec, stateVecSize);
-            m->probs[stateID][valID] = count;
-            total += count;
+    // Add every chunk to the first one
+    TransitionMatrix* m = parts[0];
+    bool ok = (m != NULL);
+    for (size_t c = 1; c < nChunks; c++) {
+        ok = ok && parts[c] && markovMergeCounts(m, parts[c]);
+        markovFreeTransMatrix(&parts[c]);
+    }
+    free(parts);
+    ok = ok && (layout == TM_DENSE || markovSortRows(m));
+    if (!ok) {
+        LOG_ERROR("Unable to count the chunks in markovBuildTransMatrixParallel");
+        markovFreeTransMatrix(&m);
+        return NULL;
+    }
+
+    markovSetWindow(m, data, n);
+    markovPrepareSampler(m);
+    return m;
+}
+
+// Entry of the transition (stateID -> valID) in a sparse matrix, with its row in *rowOut, or -1 if
+// it isn't in the matrix (nothing is inserted)
+static lli markovFindEntry(const TransitionMatrix* m, const size_t stateID, const size_t valID, size_t* rowOut) {
+    const lli row = markovSparseRow(m, stateID);
+    if (row == -1)
+        return -1;
+    *rowOut = (size_t)row;
+    for (size_t e = m->rowPtr[row]; e < m->rowPtr[row+1] && m->colIds[e] <= valID; e++) {
+        if (m->colIds[e] == valID)
+            return (lli)e;
+    }
+    return -1;
+}
+
+// Insert the transitions 'codes' (sorted, not in m yet, and maybe repeated) into the rows of the sparse
+// matrix m with a count of 0. Rows are merged from the last one, moving every entry at most once, instead
+// of shifting the entries after each insertion. Returns false if the matrix can't grow
+static bool markovInsertSparse(TransitionMatrix* m, const size_t* codes, const size_t nCodes) {
+    const size_t nVals = m->state->nVals;
+    const size_t nnz = m->rowPtr[m->nRows];
+
+    // states without a row get an empty one at the end
+    size_t nRows = m->nRows, nNew = 0;
+    for (size_t i = 0; i < nCodes; i++) {
+        if ((i == 0 || codes[i] / nVals != codes[i-1] / nVals) && markovSparseRow(m, codes[i] / nVals) == -1)
+            nRows++;
+        if (i == 0 || codes[i] != codes[i-1])
+            nNew++;
+    }
+    if (!markovReserveSparse(m, nRows, nnz + nNew))
+        return false;
+    // codes [first, past) of 'codes' are inserted in each row
+    size_t* first = calloc(nRows, sizeof(size_t));
+    size_t* past = calloc(nRows, sizeof(size_t));
+    if (!first || !past) {
+        free(first);
+        free(past);
+        return false;
+    }
+    for (size_t i = 0; i < nCodes; i++) {
+        const size_t stateID = codes[i] / nVals;
+        lli row = markovSparseRow(m, stateID);
+        if (row == -1) {
+            row = (lli)m->nRows;
+            m->rowStates[row] = stateID;
+            m->rowPtr[row+1] = m->rowPtr[row];
+            m->rowTotals[row] = 0;
+            m->dirty[row] = 0;
+            m->nRows++;
+            hashMapPut(m->rowIndex, stateID, (size_t)row);
         }
+        if (past[row] == 0)
+            first[row] = i;
+        past[row] = i + 1;
+    }
 
-        // finally, normalize the probabilities
-        if (total > 0) {
-            for (size_t valID = 0; valID < m->state->nVals; valID++)
-                m->probs[stateID][valID] /= total;
+    // merge backwards: 'end' is the new end of the row and 'oldEnd' its current one. The rows before
+    // the first one with insertions don't move
+    size_t end = nnz + nNew, oldEnd = nnz, left = nNew;
+    for (size_t r = nRows; r-- > 0 && left > 0;) {
+        const size_t start = m->rowPtr[r];
+        size_t e = oldEnd, c = past[r], w = end;
+        while (c > first[r]) {
+            if (c - 1 > first[r] && codes[c-1] == codes[c-2]) {
+                c--;
+                continue;
+            }
+            w--;
+            if (e > start && m->colIds[e-1] > codes[c-1] % nVals) {
+                e--;
+                m->colIds[w] = m->colIds[e];
+                m->sparseProbs[w] = m->sparseProbs[e];
+                m->counts[w] = m->counts[e];
+            }
+            else {
+                c--;
+                m->colIds[w] = codes[c] % nVals;
+                m->sparseProbs[w] = 0.0;
+                m->counts[w] = 0;
+                left--;
+            }
         }
+        memmove(m->colIds + w - (e - start), m->colIds + start, sizeof(size_t) * (e - start));
+        memmove(m->sparseProbs + w - (e - start), m->sparseProbs + start, sizeof(double) * (e - start));
+        memmove(m->counts + w - (e - start), m->counts + start, sizeof(uint64_t) * (e - start));
+        m->rowPtr[r+1] = end;
+        end = w - (e - start);
+        oldEnd = start;
     }
+    free(first);
+    free(past);
 
-    free(stateVec);
+    // the sampling cache is sized by the number of rows and entries
+    markovResetSampler(m);
+    return true;
+}
+
+// Entry of the transition code in m, which must be there (a sparse matrix has every code inserted)
+static inline size_t markovCodeEntry(const TransitionMatrix* m, const size_t code, size_t* row) {
+    const size_t nVals = m->state->nVals;
+    if (m->layout == TM_DENSE) {
+        *row = code / nVals;
+        return code;
+    }
+    return (size_t)markovFindEntry(m, code / nVals, code % nVals, row);
+}
+
+// Add 'weights[i]' occurrences (1 if NULL) of every code of 'added' and remove one of every code of 'removed'.
+// Nothing is counted unless every change can be: codes are checked and new sparse transitions are inserted
+// first, and removals are undone if one of them has no transition left. Only a failed removal leaves the new
+// sparse entries in m, with a count of 0. The cumulative probabilities of the rows are built again
+static bool markovApplyCounts(TransitionMatrix* m, const size_t* added, const uint64_t* weights, const size_t nAdded,
+                              const size_t* removed, const size_t nRemoved) {
+    const size_t nVals = m->state->nVals, nCodes = m->state->nStates * nVals;
+    for (size_t i = 0; i < nAdded; i++) {
+        if (added[i] >= nCodes)
+            return false;
+    }
+    for (size_t i = 0; i < nRemoved; i++) {
+        if (removed[i] >= nCodes)
+            return false;
+    }
+    if (m->layout == TM_DENSE && !markovAllocDense(m))
+        return false;
+
+    // sparse: the transitions not in m yet are inserted all at once, with a count of 0
+    size_t row = 0;
+    if (m->layout == TM_SPARSE && nAdded > 0) {
+        size_t* missing = malloc(sizeof(size_t) * nAdded);
+        if (!missing)
+            return false;
+        size_t nMissing = 0;
+        for (size_t i = 0; i < nAdded; i++) {
+            if (markovFindEntry(m, added[i] / nVals, added[i] % nVals, &row) == -1)
+                missing[nMissing++] = added[i];
+        }
+        qsort(missing, nMissing, sizeof(size_t), _cmpCodeAsc);
+        const bool inserted = (nMissing == 0) || markovInsertSparse(m, missing, nMissing);
+        free(missing);
+        if (!inserted)
+            return false;
+    }
+
+    for (size_t i = 0; i < nAdded; i++) {
+        const size_t e = markovCodeEntry(m, added[i], &row);
+        const uint64_t w = (weights) ? weights[i] : 1;
+        m->counts[e] += w;
+        m->rowTotals[row] += w;
+    }
+    size_t done = 0;
+    for (; done < nRemoved; done++) {
+        lli e = (lli)removed[done];
+        row = removed[done] / nVals;
+        if (m->layout == TM_SPARSE)
+            e = markovFindEntry(m, removed[done] / nVals, removed[done] % nVals, &row);
+        // the entry stays (with a count of 0) even when it has no transitions left
+        if (e == -1 || m->counts[e] == 0)
+            break;
+        m->counts[e]--;
+        m->rowTotals[row]--;
+    }
+    if (done < nRemoved) {
+        for (size_t i = 0; i < done; i++) {
+            const size_t e = markovCodeEntry(m, removed[i], &row);
+            m->counts[e]++;
+            m->rowTotals[row]++;
+        }
+        for (size_t i = 0; i < nAdded; i++) {
+            const size_t e = markovCodeEntry(m, added[i], &row);
+            const uint64_t w = (weights) ? weights[i] : 1;
+            m->counts[e] -= w;
+            m->rowTotals[row] -= w;
+        }
+        return false;
+    }
+
+    // only the rows touched are normalized again, unless the cache was dropped by new sparse entries
+    for (size_t i = 0; i < nAdded + nRemoved; i++) {
+        const size_t code = (i < nAdded) ? added[i] : removed[i - nAdded];
+        markovCodeEntry(m, code, &row);
+        m->dirty[row] = 1;
+    }
+    if (!m->sampler->ready || m->sampler->mapped) {
+        markovPrepareSampler(m);
+        return true;
+    }
+    for (size_t i = 0; i < nAdded + nRemoved; i++) {
+        const size_t code = (i < nAdded) ? added[i] : removed[i - nAdded];
+        markovCodeEntry(m, code, &row);
+        if (m->dirty[row])
+            markovFillRow(m, row);
+    }
+    return true;
+}
+
+bool markovAdjustCounts(TransitionMatrix* m, const size_t* added, const size_t nAdded, const size_t* removed,
+                        const size_t nRemoved) {
+    if (!m || !m->state || (nAdded > 0 && !added) || (nRemoved > 0 && !removed))
+        return false;
+    if (m->readOnly) {
+        LOG_ERROR("Unable to adjust the counts of a read-only transition matrix, copy it first");
+        return false;
+    }
+    return markovApplyCounts(m, added, NULL, nAdded, removed, nRemoved);
+}
+
+// Normalize again the probabilities of a row that got new counts
+static void markovRefreshRow(const TransitionMatrix* m, const size_t row) {
+    if (!m->dirty || !m->dirty[row])
+        return;
+
+    size_t offset = 0, len = 0;
+    double* probs = NULL;
+    if (m->layout == TM_SPARSE) {
+        offset = m->rowPtr[row];
+        len = m->rowPtr[row+1] - offset;
+        probs = m->sparseProbs + offset;
+    }
+    else {
+        offset = row * m->state->nVals;
+        len = m->state->nVals;
+        probs = m->probs + offset;
+    }
+
+    const uint64_t total = m->rowTotals[row];
+    for (size_t e = 0; e < len; e++)
+        probs[e] = (total > 0) ? (double)m->counts[offset + e] / (double)total : 0.0;
+    m->dirty[row] = 0;
+}
+
+double* markovRowProbs(const TransitionMatrix* m, const size_t stateID) {
+    markovRefreshRow(m, stateID);
+    return m->probs + stateID * m->state->nVals;
+}
+
+// Copy 'n' elements of 'src' into a new block (NULL stays NULL)
+static void* markovDupBlock(const void* src, const size_t size, const size_t n, bool* ok) {
+    if (!src)
+        return NULL;
+    void* dst = alignedAlloc(size * (n + 1));
+    if (!dst) {
+        *ok = false;
+        return NULL;
+    }
+    memcpy(dst, src, size * n);
+    return dst;
+}
+
+TransitionMatrix* markovCopyTransMatrix(const TransitionMatrix* m) {
+    if (!m)
+        return NULL;
+
+    TransitionMatrix* copy = markovInitTransMatrix(m->probs, m->state);
+    if (!copy)
+        return NULL;
+    copy->layout = m->layout;
+    copy->sampler->precision = m->sampler->precision;
+    copy->lastStateID = m->lastStateID;
+    copy->lastFilled = m->lastFilled;
+
+    // Every block is copied with a single memcpy
+    bool ok = true;
+    if (m->layout == TM_DENSE) {
+        copy->counts = markovDupBlock(m->counts, sizeof(uint64_t), m->state->nStates * m->state->nVals, &ok);
+        copy->rowTotals = markovDupBlock(m->rowTotals, sizeof(uint64_t), m->state->nStates, &ok);
+        copy->dirty = markovDupBlock(m->dirty, sizeof(ubyte), m->state->nStates, &ok);
+    }
+    else if (m->rowPtr) {
+        // Sparse matrices also rebuild the row index
+        const size_t nnz = m->rowPtr[m->nRows];
+        copy->nRows = m->nRows;
+        copy->rowCap = m->nRows;
+        copy->entryCap = nnz;
+        copy->rowStates = markovDupBlock(m->rowStates, sizeof(size_t), m->nRows, &ok);
+        copy->rowPtr = markovDupBlock(m->rowPtr, sizeof(size_t), m->nRows + 1, &ok);
+        copy->rowTotals = markovDupBlock(m->rowTotals, sizeof(uint64_t), m->nRows, &ok);
+        copy->dirty = markovDupBlock(m->dirty, sizeof(ubyte), m->nRows, &ok);
+        copy->colIds = markovDupBlock(m->colIds, sizeof(size_t), nnz, &ok);
+        copy->sparseProbs = markovDupBlock(m->sparseProbs, sizeof(double), nnz, &ok);
+        copy->counts = markovDupBlock(m->counts, sizeof(uint64_t), nnz, &ok);
+        copy->rowIndex = hashMapInit(m->nRows);
+        ok = ok && copy->rowIndex;
+        for (size_t r = 0; ok && r < m->nRows; r++)
+            hashMapPut(copy->rowIndex, m->rowStates[r], r);
+    }
+
+    // and the sampling cache, so the copy can be sampled by threads right away too
+    const MarkovSampler* sampler = m->sampler;
+    if (ok && sampler->ready) {
+        const size_t size = (m->layout == TM_SPARSE) ? m->rowPtr[m->nRows] : m->state->nStates * m->state->nVals;
+        copy->sampler->cdf = markovDupBlock(sampler->cdf, sizeof(double), size, &ok);
+        copy->sampler->cdf32 = markovDupBlock(sampler->cdf32, sizeof(float), size, &ok);
+        copy->sampler->cdfQ16 = markovDupBlock(sampler->cdfQ16, sizeof(uint16_t), size, &ok);
+        copy->sampler->ready = markovDupBlock(sampler->ready, sizeof(ubyte), markovNumRows(m), &ok);
+    }
+
+    if (!ok) {
+        LOG_ERROR("malloc failed for copying transition matrix");
+        markovFreeTransMatrix(&copy);
+        return NULL;
+    }
+    return copy;
+}
+
+lli markovSparseRow(const TransitionMatrix* m, const size_t stateID) {
+    if (!m || m->layout != TM_SPARSE)
+        return -1;
+    if (m->rowIndex)
+        return hashMapGet(m->rowIndex, stateID);
+
+    // rows sorted by state (mapped matrices)
+    size_t lo = 0, hi = m->nRows;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (m->rowStates[mid] < stateID)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < m->nRows && m->rowStates[lo] == stateID) ? (lli)lo : -1;
+}
+
+double markovTransProb(const TransitionMatrix* m, const size_t stateID, const size_t valID) {
+    if (!m)
+        return 0.0;
+
+    if (m->layout == TM_DENSE)
+        return (m->probs) ? markovRowProbs(m, stateID)[valID] : 0.0;
+
+    const lli row = markovSparseRow(m, stateID);
+    if (row == -1)
+        return 0.0;
+    markovRefreshRow(m, (size_t)row);
+    // the transitions in a row are sorted by value id
+    for (size_t e = m->rowPtr[row]; e < m->rowPtr[row+1] && m->colIds[e] <= valID; e++) {
+        if (m->colIds[e] == valID)
+            return m->sparseProbs[e];
+    }
+    return 0.0;
+}
+
+size_t markovNumRows(const TransitionMatrix* m) {
+    if (!m)
+        return 0;
+    return (m->layout == TM_SPARSE) ? m->nRows : m->state->nStates;
+}
+
+size_t markovRowState(const TransitionMatrix* m, const size_t row) {
+    return (m->layout == TM_SPARSE) ? m->rowStates[row] : row;
+}
+
+bool markovRowObserved(const TransitionMatrix* m, const size_t row) {
+    if (m->layout == TM_SPARSE)
+        return true;
+    if (!m->probs)
+        return false;
+    if (m->rowTotals)
+        return m->rowTotals[row] > 0;
+
+    // custom probabilities, without counts
+    const double* probs = m->probs + row * m->state->nVals;
+    for (size_t v = 0; v < m->state->nVals; v++) {
+        if (probs[v] > 0.0)
+            return true;
+    }
+    return false;
+}
+
+size_t markovRowEntries(const TransitionMatrix* m, const size_t row, const size_t** cols, const double** probs) {
+    if (m->layout == TM_DENSE && !m->probs)
+        return 0;
+
+    markovRefreshRow(m, row);
+    if (m->layout == TM_SPARSE) {
+        *cols = m->colIds + m->rowPtr[row];
+        *probs = m->sparseProbs + m->rowPtr[row];
+        return m->rowPtr[row+1] - m->rowPtr[row];
+    }
+    *cols = NULL;
+    *probs = m->probs + row * m->state->nVals;
+    return m->state->nVals;
+}
+
+void markovResetSampler(TransitionMatrix* m) {
+    if (!m || !m->sampler)
+        return;
+    if (!m->sampler->mapped) {
+        free(m->sampler->cdf);
+        free(m->sampler->cdf32);
+        free(m->sampler->cdfQ16);
+        free(m->sampler->ready);
+    }
+    m->sampler->mapped = false;
+    m->sampler->cdf = NULL;
+    m->sampler->cdf32 = NULL;
+    m->sampler->cdfQ16 = NULL;
+    m->sampler->ready = NULL;
+}
+
+void markovSetPrecision(TransitionMatrix* m, const TransMatrixPrecision precision) {
+    if (!m || !m->sampler)
+        return;
+    if (m->sampler->ready && m->sampler->precision == precision)
+        return;
+
+    markovResetSampler(m);
+    m->sampler->precision = precision;
+    if (precision != TM_PREC_DOUBLE && precision != TM_PREC_FLOAT && precision != TM_PREC_Q16) {
+        LOG_WARNING("Unknown sampling precision, using double");
+        m->sampler->precision = TM_PREC_DOUBLE;
+    }
+    else if (precision == TM_PREC_Q16 && m->state->nVals > MARKOV_Q16_SCALE) {
+        LOG_WARNING("Too many values for 16-bit sampling, using float32 instead");
+        m->sampler->precision = TM_PREC_FLOAT;
+    }
+    markovPrepareSampler(m);
+}
+
+// Write the cumulative probabilities of a row in the sampler's precision
+static void markovFillRowCdf(MarkovSampler* sampler, const double* probs, const size_t offset, const size_t len) {
+    // sum in the same order as a linear walk, so both choose exactly the same value (with doubles)
+    double cumProb = 0.0;
+    if (sampler->precision == TM_PREC_DOUBLE) {
+        double* cdf = sampler->cdf + offset;
+        for (size_t i = 0; i < len; i++) {
+            cumProb += probs[i];
+            cdf[i] = cumProb;
+        }
+    }
+    else if (sampler->precision == TM_PREC_FLOAT) {
+        float* cdf = sampler->cdf32 + offset;
+        size_t last = 0;
+        for (size_t i = 0; i < len; i++) {
+            cumProb += probs[i];
+            cdf[i] = (float)cumProb;
+            if (probs[i] > 0.0)
+                last = i;
+        }
+        // a full row must still end at 1 after rounding, or r close to 1 would choose nothing
+        if (fabs(cumProb - 1.0) < 1e-9) {
+            for (size_t i = last; i < len; i++)
+                cdf[i] = 1.0f;
+        }
+    }
+    else {
+        // every non-zero entry gets one step, and the remaining steps are shared by probability
+        uint16_t* cdf = sampler->cdfQ16 + offset;
+        size_t nonZero = 0;
+        for (size_t i = 0; i < len; i++)
+            nonZero += (probs[i] > 0.0);
+        const double shared = (double)(MARKOV_Q16_SCALE - nonZero);
+
+        size_t seen = 0;
+        for (size_t i = 0; i < len; i++) {
+            cumProb += probs[i];
+            seen += (probs[i] > 0.0);
+            cdf[i] = (uint16_t)(seen + (size_t)round(((cumProb < 1.0) ? cumProb : 1.0) * shared));
+        }
+    }
+}
+
+// Allocate the sampling cache in the sampler's precision, with no row built yet
+static bool markovAllocSampler(TransitionMatrix* m) {
+    MarkovSampler* sampler = m->sampler;
+    const size_t nRows = markovNumRows(m);
+    const size_t size = (m->layout == TM_SPARSE) ? m->rowPtr[m->nRows] : m->state->nStates * m->state->nVals;
+    void* block = NULL;
+    if (sampler->precision == TM_PREC_FLOAT)
+        block = sampler->cdf32 = malloc(sizeof(float) * (size + 1));
+    else if (sampler->precision == TM_PREC_Q16)
+        block = sampler->cdfQ16 = malloc(sizeof(uint16_t) * (size + 1));
+    else
+        block = sampler->cdf = malloc(sizeof(double) * (size + 1));
+    sampler->ready = calloc(nRows + 1, sizeof(ubyte));
+    if (!block || !sampler->ready) {
+        LOG_WARNING("Unable to allocate sampling cache, sampling rows linearly");
+        markovResetSampler(m);
+        return false;
+    }
+    return true;
+}
+
+// Normalize the row again if it's dirty and build its cumulative probabilities (the cache must exist)
+static void markovFillRow(TransitionMatrix* m, const size_t row) {
+    markovRefreshRow(m, row);
+    const size_t offset = (m->layout == TM_SPARSE) ? m->rowPtr[row] : row * m->state->nVals;
+    const size_t len = (m->layout == TM_SPARSE) ? m->rowPtr[row+1] - offset : m->state->nVals;
+    const double* probs = (m->layout == TM_SPARSE) ? m->sparseProbs + offset : m->probs + offset;
+    markovFillRowCdf(m->sampler, probs, offset, len);
+    m->sampler->ready[row] = 1;
+}
+
+// Whether the cumulative probabilities of the row are cached. Sampling never builds them, so
+// reading a matrix doesn't write anything
+static inline bool markovRowCdf(const TransitionMatrix* m, const size_t row) {
+    const MarkovSampler* sampler = m->sampler;
+    return sampler && sampler->ready && sampler->ready[row];
+}
+
+bool markovPrepareSampler(TransitionMatrix* m) {
+    if (!m || !m->sampler || (m->layout == TM_DENSE && !m->probs) || (m->layout == TM_SPARSE && !m->rowPtr))
+        return false;
+
+    const size_t nRows = markovNumRows(m);
+    for (size_t r = 0; r < nRows; r++)
+        markovRefreshRow(m, r);
+    if (m->sampler->mapped)
+        return true;
+    if (!m->sampler->ready && !markovAllocSampler(m))
+        return false;
+    for (size_t r = 0; r < nRows; r++) {
+        if (!m->sampler->ready[r])
+            markovFillRow(m, r);
+    }
+    return true;
+}
+
+bool markovSamplerReady(const TransitionMatrix* m) {
+    return m && m->sampler && m->sampler->ready;
+}
+
+// Find the entries of the state's row: its row, offset and length, with its value ids (NULL for dense rows)
+// and probabilities. The row is refreshed if dirty. Returns false if the state has no row
+static bool markovLocateRow(const TransitionMatrix* m, const size_t stateID, size_t* row, size_t* offset,
+                            size_t* len, const size_t** cols, const double** probs) {
+    if (m->layout == TM_DENSE) {
+        if (!m->probs || stateID >= m->state->nStates)
+            return false;
+        *row = stateID;
+        *offset = stateID * m->state->nVals;
+        *len = m->state->nVals;
+        *cols = NULL;
+        *probs = m->probs + *offset;
+    }
+    else {
+        const lli sparseRow = markovSparseRow(m, stateID);
+        if (sparseRow == -1)
+            return false;
+        *row = (size_t)sparseRow;
+        *offset = m->rowPtr[*row];
+        *len = m->rowPtr[*row + 1] - *offset;
+        *cols = m->colIds + *offset;
+        *probs = m->sparseProbs + *offset;
+    }
+    if (*len == 0)
+        return false;
+
+    markovRefreshRow(m, *row);
+    return true;
+}
+
+// Number of entries of a cumulative row below r, which is the lower bound (first entry with r <= cdf)
+// since the row never decreases. Counting has no branches, so the loop vectorizes for short rows
+static inline size_t markovCountBelow(const double* cdf, const size_t len, const double r) {
+    size_t below = 0;
+    for (size_t i = 0; i < len; i++)
+        below += (cdf[i] < r);
+    return below;
+}
+
+// Lower bound of r in a cumulative row: counting for short rows, binary search for long ones
+static inline size_t markovLowerBound(const double* cdf, const size_t len, const double r) {
+    if (len <= MARKOV_BATCH_SCAN)
+        return markovCountBelow(cdf, len, r);
+
+    size_t lo = 0, hi = len;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < r)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Same lower bound over float32 entries
+static inline size_t markovLowerBound_f(const float* cdf, const size_t len, const float r) {
+    size_t lo = 0, hi = len;
+    if (len <= MARKOV_BATCH_SCAN) {
+        for (size_t i = 0; i < len; i++)
+            lo += (cdf[i] < r);
+        return lo;
+    }
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < r)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Same lower bound over 16-bit fixed-point entries
+static inline size_t markovLowerBound_q16(const uint16_t* cdf, const size_t len, const uint16_t r) {
+    size_t lo = 0, hi = len;
+    if (len <= MARKOV_BATCH_SCAN) {
+        for (size_t i = 0; i < len; i++)
+            lo += (cdf[i] < r);
+        return lo;
+    }
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < r)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Choose the entry of a located row for the uniform number r (see markovSampleNext), reading the
+// cumulative probabilities in the sampler's precision. Returns len if no entry was chosen
+static size_t markovSampleRow(const TransitionMatrix* m, const size_t row, const size_t offset, const size_t len,
+                              const double* probs, const double r, double* cumOut) {
+    const MarkovSampler* sampler = m->sampler;
+    size_t chosen = 0;
+    if (!markovRowCdf(m, row)) {
+        double cumProb = 0.0;
+        for (chosen = 0; chosen < len; chosen++) {
+            cumProb += probs[chosen];
+            if (r <= cumProb)
+                break;
+        }
+        *cumOut = cumProb;
+        return chosen;
+    }
+
+    // first entry with r <= cdf
+    if (sampler->precision == TM_PREC_FLOAT) {
+        const float* cdf = sampler->cdf32 + offset;
+        chosen = markovLowerBound_f(cdf, len, (float)r);
+        *cumOut = (double)cdf[(chosen < len) ? chosen : len - 1];
+    }
+    else if (sampler->precision == TM_PREC_Q16) {
+        // r*scale <= cdf is the same as ceil(r*scale) <= cdf for integer entries
+        const double scaled = r * MARKOV_Q16_SCALE;
+        uint32_t target = (uint32_t)scaled;
+        target += ((double)target < scaled);
+        const uint16_t* cdf = sampler->cdfQ16 + offset;
+        chosen = markovLowerBound_q16(cdf, len, (uint16_t)target);
+        *cumOut = (double)cdf[(chosen < len) ? chosen : len - 1] / MARKOV_Q16_SCALE;
+    }
+    else {
+        const double* cdf = sampler->cdf + offset;
+        chosen = markovLowerBound(cdf, len, r);
+        *cumOut = cdf[(chosen < len) ? chosen : len - 1];
+    }
+    return chosen;
+}
+
+lli markovSampleNext(const TransitionMatrix* m, const size_t stateID, const double r, double* cumOut) {
+    if (cumOut)
+        *cumOut = 0.0;
+
+    size_t row = 0, offset = 0, len = 0;
+    const size_t* cols = NULL;
+    const double* probs = NULL;
+    if (!markovLocateRow(m, stateID, &row, &offset, &len, &cols, &probs))
+        return -1;
+
+    double cumProb = 0.0;
+    const size_t chosen = markovSampleRow(m, row, offset, len, probs, r, &cumProb);
+    if (cumOut)
+        *cumOut = cumProb;
+    if (chosen >= len)
+        return -1;
+    return (cols) ? (lli)cols[chosen] : (lli)chosen;
 }
 
 void markovPrintTransMatrix(const TransitionMatrix* m) {
@@ -236,72 +1498,70 @@ void markovPrintTransMatrix(const TransitionMatrix* m) {
     putchar('\n');
 
     // Now print state, p1, p2...
-    for (size_t s = 0; s < m->state->nStates; s++) {
+    // (only the observed states for the sparse layout or lazy states, there may be too many states to show)
+    const size_t nRows = markovNumRows(m);
+    const bool observedOnly = (m->layout == TM_SPARSE || !m->state->states);
+    int* stateVec = malloc(sizeof(int) * (m->state->order + 1));
+    if (!stateVec) {
+        LOG_ERROR("malloc failed for state vector in markovPrintTransMatrix");
+        return;
+    }
+    for (size_t r = 0; r < nRows; r++) {
+        if (observedOnly && !markovRowObserved(m, r))
+            continue;
+        const size_t s = markovRowState(m, r);
+        markovDecodeState(m->state, s, stateVec);
         for (size_t o = 0; o < m->state->order; o++)
-            printf("%d", m->state->states[s][o]);
+            printf("%d", stateVec[o]);
         putchar('\t');
         for (size_t v = 0; v < m->state->nVals; v++)
-            printf("%lf\t", m->probs[s][v]);
+            printf("%lf\t", markovTransProb(m, s, v));
         putchar('\n');
     }
+    free(stateVec);
 }
 
-void markovPredict(const TransitionMatrix* m, const uint steps, const int* data, const size_t n, int* predOut, double* confOut) {
-    if (!m || !data || !m->state || !predOut)
+void markovPredict(const TransitionMatrix* m, const uint steps, const int* data, const size_t n, Rng* rng,
+                   int* predOut, double* confOut) {
+    if (!m || !data || !m->state || !rng || !predOut)
         return;
     if (m->state->order > n)
         return;
 
     // The last state will be the slice [n-order:]
-    int* lastState = malloc(sizeof(int)*m->state->order);
-    if (!lastState) {
-        LOG_ERROR("malloc failed for vector of last state");
-        return;
-    }
-    for (size_t i = n-m->state->order; i < n; i++)
-        lastState[i-n+m->state->order] = data[i];
-    memcpy(lastState, data + n - m->state->order, sizeof(int) * m->state->order);
-
-    lli stateID = markovIdState(m->state, lastState);
+    lli stateID = markovIdState(m->state, data + n - m->state->order);
     if (stateID == -1) {
         LOG_ERROR("Unable to identify state by id: ");
         printf("%lld\n", stateID);
-        free(lastState);
         return;
     }
 
-    // Update 'lastState' with every step
+    // Shift the state id with every step
     int prediction = m->state->vals[0];
+    size_t predID = 0;
     for (uint i = 0; i < steps; i++) {
         // predict the next value with the given state
         // to do that, generate random number between 0 and 1
         // then the next value will have the probability between p(s) <= r < p(s+1)
-        double r = rand01_d();
-        stateID = markovIdState(m->state, lastState);
+        double r = rngUnit_d(rng);
 
         double cumProb = 0.0;
-        for (size_t v = 0; v < m->state->nVals; v++) {
-            cumProb += m->probs[stateID][v];
-            if (r <= cumProb) {
-                prediction = m->state->vals[v];
-                if (confOut)
-                    confOut[i] = cumProb;
-                break;
-            }
+        const lli v = markovSampleNext(m, (size_t)stateID, r, &cumProb);
+        if (v != -1) {
+            prediction = m->state->vals[v];
+            predID = (size_t)v;
+            if (confOut)
+                confOut[i] = cumProb;
         }
 
         // Then update the last state to include this new value
-        for (size_t j = 0; j < m->state->order-1; j++)
-            lastState[j] = lastState[j+1];
-        lastState[m->state->order - 1] = prediction;
+        stateID = (lli)markovNextStateId(m->state, (size_t)stateID, predID);
         predOut[i] = prediction;
     }
-
-    free(lastState);
 }
 
-int markovPredictNext(const TransitionMatrix* m, const int* data, const size_t n, double* outConf) {
-    if (!m || !data)
+int markovPredictNext(const TransitionMatrix* m, const int* data, const size_t n, Rng* rng, double* outConf) {
+    if (!m || !data || !rng)
         return INT_MAX;
 
     int prediction = INT_MAX;
@@ -313,19 +1573,335 @@ int markovPredictNext(const TransitionMatrix* m, const int* data, const size_t n
         return INT_MAX;
     }
 
-    double r = rand01_d();
+    double r = rngUnit_d(rng);
     double cumProb = 0.0;
-    for (size_t v = 0; v < m->state->nVals; v++) {
-        cumProb += m->probs[stateID][v];
-        if (r <= cumProb) {
-            prediction = m->state->vals[v];
-            break;
-        }
-    }
+    const lli v = markovSampleNext(m, (size_t)stateID, r, &cumProb);
+    if (v != -1)
+        prediction = m->state->vals[v];
     if (outConf)
         *outConf = cumProb;
     // if probability is 0, choose random
     if (cumProb < 1e-2)
-        prediction = m->state->vals[ rand() % m->state->nVals ];
+        prediction = m->state->vals[ rngBelow(rng, m->state->nVals) ];
     return prediction;
 }
+
+uint64_t markovRowTotal(const TransitionMatrix* m, const size_t stateID) {
+    if (!m || !m->rowTotals)
+        return 0;
+    if (m->layout == TM_DENSE)
+        return m->rowTotals[stateID];
+
+    const lli row = markovSparseRow(m, stateID);
+    return (row == -1) ? 0 : m->rowTotals[row];
+}
+
+MarkovMultiOrder* markovBuildMultiOrder(const int* data, const size_t n, const int* vals, const size_t nVals,
+                                        const uint maxOrder, const TransMatrixLayout layout) {
+    if (!data || !vals || nVals == 0 || maxOrder == 0)
+        return NULL;
+
+    MarkovMultiOrder* mo = calloc(1, sizeof(MarkovMultiOrder));
+    if (!mo) {
+        LOG_ERROR("malloc failed for MarkovMultiOrder");
+        return NULL;
+    }
+    mo->maxOrder = maxOrder;
+    mo->states = calloc(maxOrder, sizeof(MarkovState*));
+    mo->matrices = calloc(maxOrder, sizeof(TransitionMatrix*));
+    if (!mo->states || !mo->matrices) {
+        LOG_ERROR("malloc failed for the orders of MarkovMultiOrder");
+        markovFreeMultiOrder(&mo);
+        return NULL;
+    }
+    bool anySparse = false;
+    for (uint k = 1; k <= maxOrder; k++) {
+        mo->states[k-1] = markovBuildLazyStates(k, vals, nVals);
+        if (!mo->states[k-1]) {
+            if (k == 1) {
+                markovFreeMultiOrder(&mo);
+                return NULL;
+            }
+            // too many states for this order, keep the lower ones
+            LOG_WARNING("Stopping markovBuildMultiOrder at the highest order that fits");
+            fprintf(stderr, "\tmaximum order %u instead of %u\n", k - 1, maxOrder);
+            mo->maxOrder = k - 1;
+            break;
+        }
+        TransMatrixLayout orderLayout = layout;
+        if (layout == TM_DENSE && markovDenseBytes(mo->states[k-1]) > MARKOV_DENSE_MAX_BYTES) {
+            LOG_INFO("Dense transition matrix over the memory budget in markovBuildMultiOrder, using sparse");
+            fprintf(stderr, "\torder %u\n", k);
+            orderLayout = TM_SPARSE;
+        }
+        mo->matrices[k-1] = (orderLayout == TM_SPARSE) ? markovInitSparseTransMatrix(mo->states[k-1])
+                                                       : markovInitTransMatrix(NULL, mo->states[k-1]);
+        if (!mo->matrices[k-1] || (orderLayout == TM_DENSE && !markovAllocDense(mo->matrices[k-1]))) {
+            LOG_ERROR("Unable to initialize transition matrix in markovBuildMultiOrder");
+            markovFreeMultiOrder(&mo);
+            return NULL;
+        }
+        anySparse = anySparse || orderLayout == TM_SPARSE;
+    }
+
+    // Single pass through the data with the rolling state of maxOrder, keeping the transition code
+    // of every position and how many values its state has (fewer than maxOrder after a reset)
+    const uint topOrder = mo->maxOrder;
+    const MarkovState* top = mo->states[topOrder-1];
+    size_t* codes = malloc(sizeof(size_t) * (n + 1));
+    uint* filled = malloc(sizeof(uint) * (n + 1));
+    size_t* work = (anySparse) ? malloc(sizeof(size_t) * (n + 1)) : NULL;
+    if (!codes || !filled || (anySparse && !work)) {
+        LOG_ERROR("malloc failed for transition codes in markovBuildMultiOrder");
+        free(codes);
+        free(filled);
+        free(work);
+        markovFreeMultiOrder(&mo);
+        return NULL;
+    }
+
+    size_t stateID = 0;
+    uint window = 0;
+    for (size_t i = 0; i < n; i++) {
+        const lli valID = markovIdValState(top, data[i]);
+        if (valID == -1) {
+            stateID = 0;
+            window = 0;
+            filled[i] = 0;
+            continue;
+        }
+        codes[i] = stateID * nVals + (size_t)valID;
+        filled[i] = window;
+        if (window < topOrder)
+            window++;
+        stateID = markovNextStateId(top, stateID, (size_t)valID);
+    }
+
+    // The state of order k is the last k values of the rolling state,
+    // so its transition code is the code of the position modulo nVals^(k+1)
+    size_t radix = nVals;
+    for (uint k = 1; k <= topOrder; k++) {
+        TransitionMatrix* m = mo->matrices[k-1];
+        radix *= nVals;
+        markovResetSampler(m);
+
+        if (m->layout == TM_SPARSE) {
+            size_t nCodes = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (filled[i] >= k)
+                    work[nCodes++] = codes[i] % radix;
+            }
+            markovFillSparseCodes(m, work, nCodes);
+        }
+        else {
+            for (size_t i = 0; i < n; i++) {
+                if (filled[i] >= k)
+                    m->counts[codes[i] % radix]++;
+            }
+            markovNormalizeDense(m);
+        }
+        markovSetWindow(m, data, n);
+        markovPrepareSampler(m);
+    }
+
+    free(codes);
+    free(filled);
+    free(work);
+    return mo;
+}
+
+void markovFreeMultiOrder(MarkovMultiOrder** mo) {
+    if (!mo || !(*mo))
+        return;
+
+    for (uint k = 0; k < (*mo)->maxOrder; k++) {
+        if ((*mo)->matrices)
+            markovFreeTransMatrix(&(*mo)->matrices[k]);
+        if ((*mo)->states)
+            markovFreeState(&(*mo)->states[k]);
+    }
+    free((*mo)->matrices);
+    free((*mo)->states);
+
+    free(*mo);
+    *mo = NULL;
+}
+
+lli markovBackoffOrder(const MarkovMultiOrder* mo, const int* data, const size_t n, const uint64_t minSupport,
+                       size_t* stateOut) {
+    if (!mo || !data)
+        return -1;
+
+    // From the highest order down, the first state seen at least minSupport times wins.
+    // Otherwise, use the highest order that has seen its state at all
+    lli best = -1;
+    for (uint k = mo->maxOrder; k >= 1; k--) {
+        if (k > n)
+            continue;
+        const lli stateID = markovEncodeState(mo->states[k-1], data + n - k);
+        if (stateID == -1)
+            continue;
+        const uint64_t support = markovRowTotal(mo->matrices[k-1], (size_t)stateID);
+        if (support == 0)
+            continue;
+        if (support >= minSupport) {
+            if (stateOut)
+                *stateOut = (size_t)stateID;
+            return (lli)k;
+        }
+        if (best == -1) {
+            best = (lli)k;
+            if (stateOut)
+                *stateOut = (size_t)stateID;
+        }
+    }
+    return best;
+}
+
+int markovBackoffPredictNext(const MarkovMultiOrder* mo, const int* data, const size_t n, const uint64_t minSupport,
+                             Rng* rng, double* outConf) {
+    if (!mo || !data || !rng)
+        return INT_MAX;
+
+    const MarkovState* state = mo->states[0];
+    size_t stateID = 0;
+    const lli k = markovBackoffOrder(mo, data, n, minSupport, &stateID);
+    if (outConf)
+        *outConf = 0.0;
+    // no order has seen the last values, choose random
+    if (k == -1)
+        return state->vals[ rngBelow(rng, state->nVals) ];
+
+    double cumProb = 0.0;
+    const lli v = markovSampleNext(mo->matrices[k-1], stateID, rngUnit_d(rng), &cumProb);
+    if (outConf)
+        *outConf = cumProb;
+    if (v == -1)
+        return state->vals[ rngBelow(rng, state->nVals) ];
+    return state->vals[v];
+}
+
+void markovBackoffPredict(const MarkovMultiOrder* mo, const uint steps, const int* data, const size_t n,
+                          const uint64_t minSupport, Rng* rng, int* predOut, double* confOut) {
+    if (!mo || !data || !rng || !predOut)
+        return;
+
+    // Only the last maxOrder values can be a state, keep them in a window
+    const size_t order = mo->maxOrder;
+    int* window = malloc(sizeof(int) * (order + 1));
+    if (!window) {
+        LOG_ERROR("malloc failed for the window in markovBackoffPredict");
+        return;
+    }
+    size_t len = (n < order) ? n : order;
+    memcpy(window, data + n - len, sizeof(int) * len);
+
+    for (uint i = 0; i < steps; i++) {
+        double conf = 0.0;
+        predOut[i] = markovBackoffPredictNext(mo, window, len, minSupport, rng, &conf);
+        if (confOut)
+            confOut[i] = conf;
+
+        // Then update the window to include this new value
+        if (len == order) {
+            memmove(window, window + 1, sizeof(int) * (order - 1));
+            len--;
+        }
+        window[len++] = predOut[i];
+    }
+
+    free(window);
+}
+
+// Predict a block of states (ok[j] == 0 marks contexts that couldn't be encoded)
+static void markovPredictBlock(const TransitionMatrix* m, const size_t* stateIDs, const ubyte* ok, const size_t count,
+                               const uint64_t seed, const size_t base, int* predOut, double* confOut) {
+    const MarkovState* state = m->state;
+
+    // uniform numbers of the whole block first, from the position of each context
+    double r[MARKOV_BATCH_BLOCK];
+    for (size_t j = 0; j < count; j++)
+        r[j] = hashUnit_d(seed, base + j);
+
+    for (size_t j = 0; j < count; j++) {
+        int prediction = INT_MAX;
+        double cumProb = 0.0;
+
+        size_t row = 0, offset = 0, len = 0;
+        const size_t* cols = NULL;
+        const double* probs = NULL;
+        if (ok[j] && markovLocateRow(m, stateIDs[j], &row, &offset, &len, &cols, &probs)) {
+            const size_t chosen = markovSampleRow(m, row, offset, len, probs, r[j], &cumProb);
+            if (chosen < len)
+                prediction = state->vals[(cols) ? cols[chosen] : chosen];
+        }
+
+        // like markovPredictNext, unobserved states get a random value (from the next counter of the seed)
+        if (ok[j] && prediction == INT_MAX)
+            prediction = state->vals[ splitmix64(seed ^ splitmix64(~(uint64_t)(base + j))) % state->nVals ];
+
+        predOut[base + j] = prediction;
+        if (confOut)
+            confOut[base + j] = cumProb;
+    }
+}
+
+void markovPredictBatchIds(const TransitionMatrix* m, const size_t* stateIDs, const size_t count, const uint64_t seed,
+                           int* predOut, double* confOut) {
+    if (!m || !m->state || !stateIDs || !predOut)
+        return;
+
+    ubyte ok[MARKOV_BATCH_BLOCK];
+    memset(ok, 1, sizeof(ok));
+    for (size_t start = 0; start < count; start += MARKOV_BATCH_BLOCK) {
+        const size_t len = (count - start < MARKOV_BATCH_BLOCK) ? count - start : MARKOV_BATCH_BLOCK;
+        markovPredictBlock(m, stateIDs + start, ok, len, seed, start, predOut, confOut);
+    }
+}
+
+void markovPredictBatch(const TransitionMatrix* m, const int* contexts, const size_t count, const uint64_t seed,
+                        int* predOut, double* confOut) {
+    if (!m || !m->state || !contexts || !predOut)
+        return;
+
+    const MarkovState* state = m->state;
+    const uint order = state->order;
+    size_t ids[MARKOV_BATCH_BLOCK];
+    ubyte ok[MARKOV_BATCH_BLOCK];
+    for (size_t start = 0; start < count; start += MARKOV_BATCH_BLOCK) {
+        const size_t len = (count - start < MARKOV_BATCH_BLOCK) ? count - start : MARKOV_BATCH_BLOCK;
+        const int* ctx = contexts + start * order;
+
+        // Encode the contexts one value position at a time, across the whole block
+        for (size_t j = 0; j < len; j++) {
+            ids[j] = 0;
+            ok[j] = 1;
+        }
+        for (uint o = 0; o < order; o++) {
+            if (state->valIndex) {
+                const lli* valIndex = state->valIndex;
+                const lli minVal = state->minVal;
+                const lli range = (lli)state->valRange;
+                const size_t nVals = state->nVals;
+                for (size_t j = 0; j < len; j++) {
+                    // out of range values read the first entry, and are marked by 'inRange'
+                    const lli offset = (lli)ctx[j * order + o] - minVal;
+                    const lli inRange = (offset >= 0) & (offset < range);
+                    const lli valID = valIndex[(inRange) ? offset : 0];
+                    const lli found = inRange & (valID >= 0);
+                    ok[j] &= (ubyte)found;
+                    ids[j] = ids[j] * nVals + (size_t)(valID & -found);
+                }
+            }
+            else {
+                for (size_t j = 0; j < len; j++) {
+                    const lli valID = markovIdValState(state, ctx[j * order + o]);
+                    ok[j] &= (valID != -1);
+                    ids[j] = ids[j] * state->nVals + (size_t)((valID != -1) ? valID : 0);
+                }
+            }
+        }
+
+        markovPredictBlock(m, ids, ok, len, seed, start, predOut, confOut);
+    }
+}
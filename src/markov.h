@@ -2,43 +2,236 @@
 #define MARKOV_H
 
 #include "typedefs.h"
+#include "hashmap.h"
+#include "rng.h"
+
+// Values spread over at most this range get a dense value -> id dictionary
+#define MARKOV_MAX_DICT_RANGE 65536
 
 // Markov State
 // Keeps the states vectors like [0],[1] for order 1, or [0,0],[1,0]... for order 2 and so on
+// All states are stored in a single row-major block: state i is states[i*order .. (i+1)*order)
+// (see markovStateVec)
+// Lazy states (markovBuildLazyStates) don't store that block ('states' is NULL): a state is
+// decoded from its id when needed, so only the alphabet is kept whatever the order is
 typedef struct {
     uint order;
-    int** states;
+    int* states;
     size_t nStates;
     int* vals;
     size_t nVals;
+
+    // Dense dictionary from a value to its id: valIndex[val - minVal] (-1 if not in vals).
+    // NULL when the values are too spread out, then ids are found in valMap (keyed by the value as unsigned)
+    lli* valIndex;
+    int minVal;
+    size_t valRange;
+    HashMap* valMap;
 } MarkovState;
 
 MarkovState* markovBuildStates(const uint order, const int* vals, size_t nVals);
+// Same states, without materializing the nVals^order combinations
+MarkovState* markovBuildLazyStates(const uint order, const int* vals, size_t nVals);
 void markovFreeState(MarkovState** state);
 lli markovIdState(const MarkovState* state, const int* stateVec);
 lli markovIdValState(const MarkovState* state, const int val);
+// Pointer to the 'order' values of the state 'stateID' (NULL for lazy states, use markovDecodeState)
+int* markovStateVec(const MarkovState* state, const size_t stateID);
+
+// State codec: a state is its value ids read as a base-nVals number (first value is the
+// most significant), which is also its position in 'states'. Both directions cost O(order)
+// Returns -1 if some value of stateVec is not in the alphabet
+lli markovEncodeState(const MarkovState* state, const int* stateVec);
+void markovDecodeState(const MarkovState* state, size_t stateID, int* outVec);
+// Id of the state reached from 'stateID' after observing the value 'valID'
+size_t markovNextStateId(const MarkovState* state, size_t stateID, size_t valID);
 
 // Markov Transition Matrix
 // each row of 'probs' represents a current state.
 // each column represents the next value.
-// So probs[s][ID] is the probability of the next value being ID given the current state s
+// So probs[s*nVals + ID] is the probability of the next value being ID given the current state s.
+// The rows are stored in a single aligned block with stride nVals (see markovRowProbs)
+//
+// With the sparse layout, only states observed in the data have a row, and each row only keeps
+// its non-zero transitions (CSR format): row r belongs to the state rowStates[r] and its
+// transitions are colIds[rowPtr[r]..rowPtr[r+1]) with probabilities sparseProbs[rowPtr[r]..rowPtr[r+1]).
+// Memory then grows with the distinct n-grams of the data instead of nVals^(order+1).
+// Use markovTransProb/markovSampleNext to read a matrix without caring about its layout
+typedef enum {
+    TM_DENSE = 0,
+    TM_SPARSE = 1,
+} TransMatrixLayout;
+// Memory budget of a dense matrix (probabilities, counts and row totals): above it the dense blocks are
+// not allocated, use the sparse layout instead
+#define MARKOV_DENSE_MAX_BYTES ((size_t)1 << 30)
+
+// Precision of the cumulative probabilities used for sampling. Sampling reads a whole row, so smaller
+// entries mean less memory traffic in the prediction loops (the probabilities and counts stay exact):
+// TM_PREC_FLOAT keeps them as float32, TM_PREC_Q16 as 16-bit fixed point over MARKOV_Q16_SCALE
+// (every non-zero transition keeps at least one step, so it can still be chosen)
+typedef enum {
+    TM_PREC_DOUBLE = 0,
+    TM_PREC_FLOAT = 1,
+    TM_PREC_Q16 = 2,
+} TransMatrixPrecision;
+#define MARKOV_Q16_SCALE 65535
+
+// Sampling cache of a TransitionMatrix: the cumulative probabilities of its rows, so the
+// next value can be found by binary search. It's built whenever the matrix is filled or its counts
+// change (see markovPrepareSampler), never while sampling: rows without it are walked linearly.
+// Only the block of the sampler's precision is allocated (cdf, cdf32 or cdfQ16), with the same
+// shape as the probabilities, and 'ready' has one flag per row
+typedef struct {
+    TransMatrixPrecision precision;
+    double* cdf;
+    float* cdf32;
+    uint16_t* cdfQ16;
+    ubyte* ready;
+    bool mapped; // the blocks are in a model file mapping (not freed)
+} MarkovSampler;
+
 typedef struct {
     MarkovState* state;
-    double** probs;
+    TransMatrixLayout layout;
+    MarkovSampler* sampler;
+
+    // Dense layout
+    double* probs;
+
+    // Sparse layout
+    size_t nRows;
+    size_t* rowStates;
+    size_t* rowPtr;
+    size_t* colIds;
+    double* sparseProbs;
+    HashMap* rowIndex; // state id -> row
+    size_t rowCap;
+    size_t entryCap;
+
+    // Raw transition counts (64-bit), with the same shape as the probabilities, and the total of each row.
+    // Rows marked 'dirty' got new counts (see markovAppend) and are normalized again when read
+    uint64_t* counts;
+    uint64_t* rowTotals;
+    ubyte* dirty;
+
+    // Rolling window over the last values of the series: id of the last state and how many
+    // values it holds (it's a full state when lastFilled == order)
+    size_t lastStateID;
+    uint lastFilled;
+
+    // The blocks point into a read-only model file mapping (see modelio.h): the matrix can be read,
+    // sampled and copied, but not changed, and freeing it leaves the blocks alone.
+    // Sparse rows are sorted by state then, and found by binary search when there's no rowIndex
+    bool readOnly;
 } TransitionMatrix;
 
-// Initialize transition matrix with custom probabilities and states
-TransitionMatrix* markovInitTransMatrix(const double** probs, MarkovState* state);
+// Initialize transition matrix with custom probabilities (nStates*nVals row-major block) and states
+TransitionMatrix* markovInitTransMatrix(const double* probs, MarkovState* state);
+// Initialize an empty transition matrix with the sparse layout (filled by markovFillProbabilities)
+TransitionMatrix* markovInitSparseTransMatrix(MarkovState* state);
 
 // Build transition matrix based on time series from the data
 // If 'stateVals' is NULL, the values (ids) are set from 0 to nVals
 TransitionMatrix* markovBuildTransMatrix(const int* data, const size_t n, MarkovState* state);
+// Same as markovBuildTransMatrix, but only storing the observed states and transitions
+TransitionMatrix* markovBuildSparseTransMatrix(const int* data, const size_t n, MarkovState* state);
+// Same matrix, counted over 'nThreads' threads (0 uses every core): each thread counts a chunk of the data
+// (from 'order' values before it, so no transition is lost at the cuts), then the chunks are added up with
+// markovMergeCounts. Chunks have at least MARKOV_PARALLEL_MIN_CHUNK values, shorter data is counted serially
+#define MARKOV_PARALLEL_MIN_CHUNK ((size_t)1 << 16)
+TransitionMatrix* markovBuildTransMatrixParallel(const int* data, const size_t n, MarkovState* state,
+                                                 const TransMatrixLayout layout, const uint nThreads);
 
 // Free the allocated memory for *m and set *m to NULLs
 void markovFreeTransMatrix(TransitionMatrix** m);
+// Deep copy of a transition matrix (sharing the same MarkovState).
+// Dense probabilities are copied with a single memcpy
+TransitionMatrix* markovCopyTransMatrix(const TransitionMatrix* m);
 
+// Count the transitions of the series in a single pass, with a rolling state id.
+// 'counts' must have nStates*nVals entries: counts[stateID*nVals + valID] is the number
+// of times the state 'stateID' was followed by the value 'valID'. Counts are accumulated,
+// so the table must be zeroed by the caller.
+void markovCountTransitions(const MarkovState* state, const int* data, const size_t n, uint64_t* counts);
+// Same single pass, but writing every transition found as the code stateID*nVals + valID.
+// 'codesOut' must have room for n codes. Returns the number of transitions written
+size_t markovCollectTransitions(const MarkovState* state, const int* data, const size_t n, size_t* codesOut);
+
+// Fill (or overwrite) the probabilities of m with the transitions counted in the data
 void markovFillProbabilities(TransitionMatrix* m, const int* data, const size_t n);
 
+// Online update: append new values to the end of the series the matrix was built from.
+// Their transitions are counted all at once (new sparse transitions are inserted in a single pass),
+// and only the rows they touch are normalized again. Rows touched in a matrix initialized from
+// probabilities (no counts) are replaced by the appended counts. Nothing changes if the matrix can't grow
+void markovAppend(TransitionMatrix* m, const int* vals, const size_t k);
+
+// Add every count of 'src' into 'dst' (any layouts, same states), as if 'dst' had also been
+// trained with the data of 'src'. Used to combine models of different chunks or time ranges.
+// Transitions across the border of the two data sets aren't counted, and the window of the last
+// values of 'dst' doesn't change. Returns false, with 'dst' unchanged, if the matrices can't be merged
+bool markovMergeCounts(TransitionMatrix* dst, const TransitionMatrix* src);
+
+// Add one occurrence of every transition code (stateID*nVals + valID) in 'added' to the counts of m,
+// and remove one of every code in 'removed'. New transitions of a sparse matrix are inserted all at once,
+// and the rows touched are normalized again with their cumulative probabilities. Returns false, with
+// the counts unchanged, if the matrix can't grow or if it doesn't have a transition to remove
+bool markovAdjustCounts(TransitionMatrix* m, const size_t* added, const size_t nAdded, const size_t* removed,
+                        const size_t nRemoved);
+
+// Row of probabilities (nVals values) of the state in a dense matrix
+double* markovRowProbs(const TransitionMatrix* m, const size_t stateID);
+// Row of the state in a sparse matrix, or -1 if the state wasn't observed
+lli markovSparseRow(const TransitionMatrix* m, const size_t stateID);
+// Probability of the next value being 'valID' given the state 'stateID'
+double markovTransProb(const TransitionMatrix* m, const size_t stateID, const size_t valID);
+// Choose the next value id of 'stateID' from the uniform number r: the chosen value is the first
+// one with r <= cumulative probability of the row, found by binary search in O(log nVals)
+// (or a branch-free count for rows up to MARKOV_BATCH_SCAN values).
+// 'cumOut' receives the cumulative probability at the chosen value (or the row total if none).
+// Returns -1 if no value was chosen (r is past the row total, like in unobserved states)
+lli markovSampleNext(const TransitionMatrix* m, const size_t stateID, const double r, double* cumOut);
+// Rows of a matrix, whatever its layout: nStates rows for dense matrices (row == state id)
+// and one row per observed state for sparse ones
+size_t markovNumRows(const TransitionMatrix* m);
+// State id of a row
+size_t markovRowState(const TransitionMatrix* m, const size_t row);
+// Whether the row has any transition (always true for sparse rows)
+bool markovRowObserved(const TransitionMatrix* m, const size_t row);
+// Transitions of a row: returns their number, with their probabilities in *probs and their value
+// ids in *cols. Dense rows have every value (entry i is the value id i) and set *cols to NULL
+size_t markovRowEntries(const TransitionMatrix* m, const size_t row, const size_t** cols, const double** probs);
+// Normalize every dirty row and build the cumulative probabilities of every row up front. After it,
+// sampling and reading the matrix don't write anything, so threads can share it (until it changes).
+// Filling, appending, merging, adjusting counts, copying and setting the precision already call it.
+// Returns false if the cache couldn't be built
+bool markovPrepareSampler(TransitionMatrix* m);
+// Whether the cache of every row is built (see markovPrepareSampler)
+bool markovSamplerReady(const TransitionMatrix* m);
+// Drop the cached cumulative probabilities (must be called when the probabilities change)
+void markovResetSampler(TransitionMatrix* m);
+// Set the precision of the sampling cache (building it again). Copies keep the precision of the original.
+// TM_PREC_Q16 falls back to TM_PREC_FLOAT when there are more values than steps in the scale
+void markovSetPrecision(TransitionMatrix* m, const TransMatrixPrecision precision);
+
+// Number of transitions counted from the state (0 if it wasn't observed or the matrix has no counts)
+uint64_t markovRowTotal(const TransitionMatrix* m, const size_t stateID);
+
+// Batched prediction of the next value of 'count' independent contexts, without allocating or writing
+// anything (rows are searched in the sampling cache, or walked linearly if it couldn't be built):
+// every context is processed in blocks of MARKOV_BATCH_BLOCK, its random number coming from
+// hashUnit_d(seed, i) so results don't depend on how the batch is split. Rows up to MARKOV_BATCH_SCAN
+// values are searched by a branch-free count. Contexts that can't be encoded give INT_MAX (confidence 0),
+// and unobserved states a random value.
+// From contexts: count*order values, context i is contexts[i*order .. (i+1)*order)
+#define MARKOV_BATCH_BLOCK 256
+#define MARKOV_BATCH_SCAN 32
+void markovPredictBatch(const TransitionMatrix* m, const int* contexts, const size_t count, const uint64_t seed,
+                        int* predOut, double* confOut);
+// From encoded state ids
+void markovPredictBatchIds(const TransitionMatrix* m, const size_t* stateIDs, const size_t count, const uint64_t seed,
+                           int* predOut, double* confOut);
+
 // Print transition matrix in a matrix format, like:
 /*     ID0 ID1
  * ID0 P00 P01
@@ -47,10 +240,38 @@ void markovFillProbabilities(TransitionMatrix* m, const int* data, const size_t
 void markovPrintTransMatrix(const TransitionMatrix* m);
 
 // Predicts the next 'steps' time steps based on the probabilities in the TransitionMatrix
-// given the last state
-void markovPredict(const TransitionMatrix* m, const uint steps, const int* data, const size_t n, int* predOut, double* confOut);
+// given the last state, sampling with 'rng'
+void markovPredict(const TransitionMatrix* m, const uint steps, const int* data, const size_t n, Rng* rng,
+                   int* predOut, double* confOut);
 
 // Predict next step
-int markovPredictNext(const TransitionMatrix* m, const int* data, const size_t n, double* outConf);
+int markovPredictNext(const TransitionMatrix* m, const int* data, const size_t n, Rng* rng, double* outConf);
+
+// Transition matrices of every order from 1 to maxOrder, counted from a single pass over the data:
+// matrices[k-1] has order k, over the lazy states states[k-1]. The state of order k is made of the
+// last k values of the rolling state of maxOrder, so every order shares the same pass.
+// Dense orders over MARKOV_DENSE_MAX_BYTES are counted with the sparse layout, and maxOrder stops at
+// the highest order whose transition codes fit in a size_t
+typedef struct {
+    uint maxOrder;
+    MarkovState** states;
+    TransitionMatrix** matrices;
+} MarkovMultiOrder;
+
+MarkovMultiOrder* markovBuildMultiOrder(const int* data, const size_t n, const int* vals, const size_t nVals,
+                                        const uint maxOrder, const TransMatrixLayout layout);
+void markovFreeMultiOrder(MarkovMultiOrder** mo);
+
+// Backoff: the highest order whose state (the last k values of the data) was seen at least 'minSupport'
+// times, or else the highest order that has seen its state at all. The state id goes to stateOut.
+// Returns -1 if no order has seen the last values
+lli markovBackoffOrder(const MarkovMultiOrder* mo, const int* data, const size_t n, const uint64_t minSupport,
+                       size_t* stateOut);
+// Predict the next value with the order chosen by markovBackoffOrder
+int markovBackoffPredictNext(const MarkovMultiOrder* mo, const int* data, const size_t n, const uint64_t minSupport,
+                             Rng* rng, double* outConf);
+// Predicts the next 'steps' values with backoff, extending the data with every predicted value
+void markovBackoffPredict(const MarkovMultiOrder* mo, const uint steps, const int* data, const size_t n,
+                          const uint64_t minSupport, Rng* rng, int* predOut, double* confOut);
 
 #endif // MARKOV_H
\ No newline at end of file
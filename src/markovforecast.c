@@ -0,0 +1,929 @@
+#include "markovforecast.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+#include "logging.h"
+#include "parallel.h"
+#include "utils.h"
+
+static MarkovForecast* markovForecastInit(const MarkovState* state, const uint steps, const double* quantiles,
+                                          const size_t nQuantiles) {
+    MarkovForecast* f = calloc(1, sizeof(MarkovForecast));
+    if (!f) {
+        LOG_ERROR("malloc failed for MarkovForecast");
+        return NULL;
+    }
+    f->state = state;
+    f->steps = steps;
+    f->nQuantiles = (quantiles) ? nQuantiles : 0;
+    f->marginals = calloc((size_t)steps * state->nVals + 1, sizeof(double));
+    f->modes = malloc(sizeof(int) * (steps + 1));
+    f->quantiles = malloc(sizeof(double) * (f->nQuantiles + 1));
+    f->percentiles = malloc(sizeof(int) * ((size_t)steps * f->nQuantiles + 1));
+    if (!f->marginals || !f->modes || !f->quantiles || !f->percentiles) {
+        LOG_ERROR("malloc failed for forecast distributions");
+        markovFreeForecast(&f);
+        return NULL;
+    }
+    if (f->nQuantiles > 0)
+        memcpy(f->quantiles, quantiles, sizeof(double) * f->nQuantiles);
+    return f;
+}
+
+void markovFreeForecast(MarkovForecast** f) {
+    if (!f || !(*f))
+        return;
+
+    free((*f)->marginals);
+    free((*f)->modes);
+    free((*f)->quantiles);
+    free((*f)->percentiles);
+
+    free(*f);
+    *f = NULL;
+}
+
+typedef struct {
+    int val;
+    size_t id;
+} ValueId;
+
+static int _cmpValueIdAsc(const void* a, const void* b) {
+    const int x = ((const ValueId*)a)->val, y = ((const ValueId*)b)->val;
+    return (x > y) - (x < y);
+}
+
+// Fill the modes and percentiles from the marginals
+static bool markovForecastSummarize(MarkovForecast* f) {
+    const size_t nVals = f->state->nVals;
+
+    // value ids in ascending order of their values, for the percentiles
+    ValueId* sorted = malloc(sizeof(ValueId) * nVals);
+    if (!sorted) {
+        LOG_ERROR("malloc failed for sorting values in markovForecastSummarize");
+        return false;
+    }
+    for (size_t v = 0; v < nVals; v++) {
+        sorted[v].val = f->state->vals[v];
+        sorted[v].id = v;
+    }
+    qsort(sorted, nVals, sizeof(ValueId), _cmpValueIdAsc);
+
+    for (uint s = 0; s < f->steps; s++) {
+        const double* dist = f->marginals + (size_t)s * nVals;
+        size_t mode = 0;
+        for (size_t v = 1; v < nVals; v++) {
+            if (dist[v] > dist[mode])
+                mode = v;
+        }
+        f->modes[s] = f->state->vals[mode];
+
+        for (size_t q = 0; q < f->nQuantiles; q++) {
+            double cum = 0.0;
+            size_t i = 0;
+            for (; i < nVals - 1; i++) {
+                cum += dist[sorted[i].id];
+                if (cum >= f->quantiles[q])
+                    break;
+            }
+            f->percentiles[(size_t)s * f->nQuantiles + q] = sorted[i].val;
+        }
+    }
+
+    free(sorted);
+    return true;
+}
+
+MarkovForecast* markovForecastFromMarginals(const MarkovState* state, const uint steps, const double* marginals,
+                                           const size_t nPaths, const double* quantiles, const size_t nQuantiles) {
+    if (!state || !marginals)
+        return NULL;
+
+    MarkovForecast* f = markovForecastInit(state, steps, quantiles, nQuantiles);
+    if (!f)
+        return NULL;
+    f->nPaths = nPaths;
+    memcpy(f->marginals, marginals, sizeof(double) * (size_t)steps * state->nVals);
+
+    if (!markovForecastSummarize(f)) {
+        markovFreeForecast(&f);
+        return NULL;
+    }
+    return f;
+}
+
+// Id of the last state of data[0..n), or -1 (logged) if there isn't one
+static lli markovLastState(const MarkovState* state, const int* data, const size_t n) {
+    if (n < state->order) {
+        LOG_ERROR("Not enough data for the last state of the forecast");
+        return -1;
+    }
+    const lli stateID = markovEncodeState(state, data + n - state->order);
+    if (stateID == -1)
+        LOG_ERROR("Unable to identify the last state of the forecast");
+    return stateID;
+}
+
+typedef struct {
+    const TransitionMatrix* m;
+    size_t startState;
+    uint steps;
+    uint64_t seed;
+    // one counts block (steps*nVals) per thread
+    uint64_t* counts;
+} MonteCarloJob;
+
+static void markovMonteCarloPaths(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    const MonteCarloJob* job = (const MonteCarloJob*)ctx;
+    const MarkovState* state = job->m->state;
+    const size_t nVals = state->nVals;
+    uint64_t* counts = job->counts + (size_t)thread * job->steps * nVals;
+
+    for (size_t p = begin; p < end; p++) {
+        const uint64_t pathSeed = splitmix64(job->seed ^ splitmix64(p));
+        size_t stateID = job->startState;
+        for (uint s = 0; s < job->steps; s++) {
+            const double r = hashUnit_d(pathSeed, s);
+            lli v = markovSampleNext(job->m, stateID, r, NULL);
+            if (v == -1) {
+                v = (lli)(r * (double)nVals);
+                if ((size_t)v >= nVals)
+                    v = (lli)nVals - 1;
+            }
+            counts[(size_t)s * nVals + (size_t)v]++;
+            stateID = markovNextStateId(state, stateID, (size_t)v);
+        }
+    }
+}
+
+MarkovForecast* markovMonteCarlo(const TransitionMatrix* m, const int* data, const size_t n, const uint steps,
+                                 const size_t nPaths, const uint64_t seed, const uint nThreads,
+                                 const double* quantiles, const size_t nQuantiles) {
+    if (!m || !m->state || !data || nPaths == 0)
+        return NULL;
+
+    const MarkovState* state = m->state;
+    const lli startState = markovLastState(state, data, n);
+    if (startState == -1)
+        return NULL;
+
+    // Threads share the matrix, so it must not have anything left to build
+    if (!markovSamplerReady(m)) {
+        LOG_ERROR("markovMonteCarlo needs a prepared sampler (see markovPrepareSampler)");
+        return NULL;
+    }
+
+    MarkovForecast* f = markovForecastInit(state, steps, quantiles, nQuantiles);
+    if (!f)
+        return NULL;
+    f->nPaths = nPaths;
+
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    const size_t block = (size_t)steps * state->nVals;
+    MonteCarloJob job = {m, (size_t)startState, steps, seed, calloc(block * threads + 1, sizeof(uint64_t))};
+    if (!job.counts) {
+        LOG_ERROR("malloc failed for path counts in markovMonteCarlo");
+        markovFreeForecast(&f);
+        return NULL;
+    }
+
+    const uint used = parallelFor(nPaths, threads, markovMonteCarloPaths, &job);
+    if (used == 0) {
+        free(job.counts);
+        markovFreeForecast(&f);
+        return NULL;
+    }
+
+    // Merge the counts of every thread into the marginals
+    for (uint t = 0; t < used; t++) {
+        const uint64_t* counts = job.counts + t * block;
+        for (size_t i = 0; i < block; i++)
+            f->marginals[i] += (double)counts[i];
+    }
+    for (size_t i = 0; i < block; i++)
+        f->marginals[i] /= (double)nPaths;
+    free(job.counts);
+
+    if (!markovForecastSummarize(f)) {
+        markovFreeForecast(&f);
+        return NULL;
+    }
+    return f;
+}
+
+// Transitions of a state: their value ids in *cols (NULL when every value is there, in order) and
+// probabilities in *probs. States never observed get 'uniform', every value with 1/nVals
+static size_t markovStateEntries(const TransitionMatrix* m, const size_t stateID, const double* uniform,
+                                 const size_t** cols, const double** probs) {
+    if (m->layout == TM_SPARSE) {
+        const lli row = markovSparseRow(m, stateID);
+        if (row != -1)
+            return markovRowEntries(m, (size_t)row, cols, probs);
+    }
+    else if (markovRowObserved(m, stateID))
+        return markovRowEntries(m, stateID, cols, probs);
+
+    *cols = NULL;
+    *probs = uniform;
+    return m->state->nVals;
+}
+
+// Propagate a dense state vector. The next states of s are the contiguous block (s*nVals mod nStates) + v,
+// so every row is added to a block of the next vector. The distribution of each step goes to
+// marginals + t*nVals, or always to 'marginals' (only the last step is kept) if !keepAll
+static bool markovPropagateDense(const TransitionMatrix* m, const size_t start, const size_t steps,
+                                 const double* uniform, double* marginals, const bool keepAll) {
+    const size_t nStates = m->state->nStates;
+    const size_t nVals = m->state->nVals;
+    double* p = calloc(nStates, sizeof(double));
+    double* q = malloc(sizeof(double) * nStates);
+    if (!p || !q) {
+        LOG_ERROR("malloc failed for the state vectors of the exact forecast");
+        free(p);
+        free(q);
+        return false;
+    }
+    p[start] = 1.0;
+
+    for (size_t t = 0; t < steps; t++) {
+        double* marg = (keepAll) ? marginals + t * nVals : marginals;
+        if (!keepAll)
+            memset(marg, 0, sizeof(double) * nVals);
+        memset(q, 0, sizeof(double) * nStates);
+
+        for (size_t s = 0; s < nStates; s++) {
+            const double ps = p[s];
+            if (ps == 0.0)
+                continue;
+
+            const size_t* cols = NULL;
+            const double* probs = NULL;
+            const size_t len = markovStateEntries(m, s, uniform, &cols, &probs);
+            double* block = q + (s * nVals) % nStates;
+            if (!cols) {
+                for (size_t v = 0; v < len; v++) {
+                    block[v] += ps * probs[v];
+                    marg[v] += ps * probs[v];
+                }
+            }
+            else {
+                for (size_t e = 0; e < len; e++) {
+                    block[cols[e]] += ps * probs[e];
+                    marg[cols[e]] += ps * probs[e];
+                }
+            }
+        }
+
+        double* temp = p;
+        p = q;
+        q = temp;
+    }
+
+    free(p);
+    free(q);
+    return true;
+}
+
+// Propagate a vector with only the reachable states (ids[i] has probability probs[i]), for state spaces
+// too large to be dense. Fails if more than MARKOV_EXACT_MAX_SUPPORT states become reachable
+static bool markovPropagateSparse(const TransitionMatrix* m, const size_t start, const size_t steps,
+                                  const double* uniform, double* marginals, const bool keepAll) {
+    const MarkovState* state = m->state;
+    const size_t nVals = state->nVals;
+    size_t cap = 64, nextCap = 64, count = 1;
+    size_t* ids = malloc(sizeof(size_t) * cap);
+    double* probs = malloc(sizeof(double) * cap);
+    size_t* nextIds = malloc(sizeof(size_t) * nextCap);
+    double* nextProbs = malloc(sizeof(double) * nextCap);
+    bool ok = (ids && probs && nextIds && nextProbs);
+    if (ok) {
+        ids[0] = start;
+        probs[0] = 1.0;
+    }
+
+    for (size_t t = 0; ok && t < steps; t++) {
+        double* marg = (keepAll) ? marginals + t * nVals : marginals;
+        if (!keepAll)
+            memset(marg, 0, sizeof(double) * nVals);
+
+        // position of every next state in nextIds
+        HashMap* index = hashMapInit(count * 2);
+        size_t nextCount = 0;
+        ok = (index != NULL);
+        for (size_t i = 0; ok && i < count; i++) {
+            const size_t* cols = NULL;
+            const double* rowProbs = NULL;
+            const size_t len = markovStateEntries(m, ids[i], uniform, &cols, &rowProbs);
+            for (size_t e = 0; ok && e < len; e++) {
+                const size_t valID = (cols) ? cols[e] : e;
+                const double w = probs[i] * rowProbs[e];
+                marg[valID] += w;
+
+                const size_t next = markovNextStateId(state, ids[i], valID);
+                const lli at = hashMapGet(index, next);
+                if (at != -1) {
+                    nextProbs[at] += w;
+                    continue;
+                }
+                if (nextCount == MARKOV_EXACT_MAX_SUPPORT) {
+                    LOG_ERROR("Too many reachable states for an exact forecast, use the Monte Carlo forecast");
+                    ok = false;
+                    break;
+                }
+                if (nextCount == nextCap) {
+                    size_t* grownIds = realloc(nextIds, sizeof(size_t) * nextCap * 2);
+                    if (grownIds)
+                        nextIds = grownIds;
+                    double* grownProbs = realloc(nextProbs, sizeof(double) * nextCap * 2);
+                    if (grownProbs)
+                        nextProbs = grownProbs;
+                    ok = (grownIds && grownProbs);
+                    if (!ok)
+                        break;
+                    nextCap *= 2;
+                }
+                nextIds[nextCount] = next;
+                nextProbs[nextCount] = w;
+                ok = hashMapPut(index, next, nextCount);
+                nextCount++;
+            }
+        }
+        hashMapFree(&index);
+
+        // the next vector becomes the current one
+        size_t* tempIds = ids;
+        double* tempProbs = probs;
+        ids = nextIds;
+        probs = nextProbs;
+        nextIds = tempIds;
+        nextProbs = tempProbs;
+        const size_t tempCap = cap;
+        cap = nextCap;
+        nextCap = tempCap;
+        count = nextCount;
+    }
+    if (!ok)
+        LOG_ERROR("Unable to propagate the state vector of the exact forecast");
+
+    free(ids);
+    free(probs);
+    free(nextIds);
+    free(nextProbs);
+    return ok;
+}
+
+static bool markovPropagate(const TransitionMatrix* m, const size_t start, const size_t steps, double* marginals,
+                            const bool keepAll) {
+    const size_t nVals = m->state->nVals;
+    double* uniform = malloc(sizeof(double) * nVals);
+    if (!uniform) {
+        LOG_ERROR("malloc failed for uniform row in markovPropagate");
+        return false;
+    }
+    for (size_t v = 0; v < nVals; v++)
+        uniform[v] = 1.0 / (double)nVals;
+
+    const bool ok = (m->state->nStates <= MARKOV_EXACT_DENSE_STATES)
+                        ? markovPropagateDense(m, start, steps, uniform, marginals, keepAll)
+                        : markovPropagateSparse(m, start, steps, uniform, marginals, keepAll);
+    free(uniform);
+    return ok;
+}
+
+MarkovForecast* markovExactForecast(const TransitionMatrix* m, const int* data, const size_t n, const uint steps,
+                                    const double* quantiles, const size_t nQuantiles) {
+    if (!m || !m->state || !data)
+        return NULL;
+
+    const lli startState = markovLastState(m->state, data, n);
+    if (startState == -1)
+        return NULL;
+
+    MarkovForecast* f = markovForecastInit(m->state, steps, quantiles, nQuantiles);
+    if (!f)
+        return NULL;
+    if (!markovPropagate(m, (size_t)startState, steps, f->marginals, true) || !markovForecastSummarize(f)) {
+        markovFreeForecast(&f);
+        return NULL;
+    }
+    return f;
+}
+
+// out = a * b, for S x S matrices (i-l-j order, so the inner loop runs over contiguous rows)
+static void markovMatMul(const double* a, const double* b, double* out, const size_t S) {
+    memset(out, 0, sizeof(double) * S * S);
+    for (size_t i = 0; i < S; i++) {
+        for (size_t l = 0; l < S; l++) {
+            const double ail = a[i * S + l];
+            if (ail == 0.0)
+                continue;
+            const double* bl = b + l * S;
+            double* oi = out + i * S;
+            for (size_t j = 0; j < S; j++)
+                oi[j] += ail * bl[j];
+        }
+    }
+}
+
+bool markovExactMarginalAt(const TransitionMatrix* m, const int* data, const size_t n, const size_t k,
+                           double* distOut) {
+    if (!m || !m->state || !data || !distOut || k == 0)
+        return false;
+
+    const lli startState = markovLastState(m->state, data, n);
+    if (startState == -1)
+        return false;
+
+    // Squaring only pays off when log(k) products of S x S matrices cost less than k sparse steps
+    const size_t S = m->state->nStates;
+    const size_t nVals = m->state->nVals;
+    double squarings = 0.0;
+    for (size_t e = k - 1; e > 0; e >>= 1)
+        squarings += 2.0;
+    const double costSquaring = (double)S * (double)S * (double)S * squarings;
+    const double costSteps = (double)k * (double)S * (double)nVals;
+    if (S > MARKOV_SQUARING_MAX_STATES || k == 1 || costSquaring >= costSteps)
+        return markovPropagate(m, (size_t)startState, k, distOut, false);
+
+    double* uniform = malloc(sizeof(double) * nVals);
+    double* T = calloc(S * S, sizeof(double));
+    double* base = malloc(sizeof(double) * S * S);
+    double* temp = malloc(sizeof(double) * S * S);
+    double* x = calloc(S, sizeof(double));
+    double* y = malloc(sizeof(double) * S);
+    if (!uniform || !T || !base || !temp || !x || !y) {
+        LOG_ERROR("malloc failed for repeated squaring in markovExactMarginalAt");
+        free(uniform);
+        free(T);
+        free(base);
+        free(temp);
+        free(x);
+        free(y);
+        return false;
+    }
+    for (size_t v = 0; v < nVals; v++)
+        uniform[v] = 1.0 / (double)nVals;
+
+    // State transition matrix: T[s][next(s, v)] = P(v | s)
+    for (size_t s = 0; s < S; s++) {
+        const size_t* cols = NULL;
+        const double* probs = NULL;
+        const size_t len = markovStateEntries(m, s, uniform, &cols, &probs);
+        for (size_t e = 0; e < len; e++)
+            T[s * S + markovNextStateId(m->state, s, (cols) ? cols[e] : e)] += probs[e];
+    }
+
+    // x = onehot(start) * T^(k-1), squaring T for every bit of k-1
+    x[startState] = 1.0;
+    memcpy(base, T, sizeof(double) * S * S);
+    for (size_t e = k - 1; e > 0; e >>= 1) {
+        if (e & 1) {
+            memset(y, 0, sizeof(double) * S);
+            for (size_t i = 0; i < S; i++) {
+                if (x[i] == 0.0)
+                    continue;
+                for (size_t j = 0; j < S; j++)
+                    y[j] += x[i] * base[i * S + j];
+            }
+            memcpy(x, y, sizeof(double) * S);
+        }
+        if (e > 1) {
+            markovMatMul(base, base, temp, S);
+            double* swap = base;
+            base = temp;
+            temp = swap;
+        }
+    }
+
+    // and the distribution of the next value from the states of step k-1
+    memset(distOut, 0, sizeof(double) * nVals);
+    for (size_t s = 0; s < S; s++) {
+        if (x[s] == 0.0)
+            continue;
+        const size_t* cols = NULL;
+        const double* probs = NULL;
+        const size_t len = markovStateEntries(m, s, uniform, &cols, &probs);
+        for (size_t e = 0; e < len; e++)
+            distOut[(cols) ? cols[e] : e] += x[s] * probs[e];
+    }
+
+    free(uniform);
+    free(T);
+    free(base);
+    free(temp);
+    free(x);
+    free(y);
+    return true;
+}
+
+void markovPrintForecast(const MarkovForecast* f) {
+    if (!f)
+        return;
+
+    const size_t nVals = f->state->nVals;
+    for (uint s = 0; s < f->steps; s++) {
+        const double* dist = f->marginals + (size_t)s * nVals;
+        double modeProb = 0.0;
+        for (size_t v = 0; v < nVals; v++) {
+            if (f->state->vals[v] == f->modes[s] && dist[v] > modeProb)
+                modeProb = dist[v];
+        }
+
+        printf("STEP %u: MODE %d (%lf)", s + 1, f->modes[s], modeProb);
+        for (size_t q = 0; q < f->nQuantiles; q++)
+            printf(", P%g: %d", f->quantiles[q] * 100.0, f->percentiles[(size_t)s * f->nQuantiles + q]);
+        putchar('\n');
+    }
+}
+
+/* ----------------------------------- STATIONARY DISTRIBUTION ----------------------------------- */
+// Below this many states, a single thread iterates faster than waking the workers every iteration
+static const size_t STATIONARY_MIN_PARALLEL_STATES = (size_t)1 << 16;
+
+// Row of every state (-1 if it was never observed). Every row is normalized here, so threads can read
+// the matrix afterwards without writing to it
+static lli* markovStateRows(const TransitionMatrix* m) {
+    const size_t nStates = m->state->nStates;
+    lli* rows = malloc(sizeof(lli) * nStates);
+    if (!rows) {
+        LOG_ERROR("malloc failed for the rows of the states");
+        return NULL;
+    }
+    for (size_t s = 0; s < nStates; s++)
+        rows[s] = -1;
+
+    const size_t nRows = markovNumRows(m);
+    for (size_t r = 0; r < nRows; r++) {
+        if (!markovRowObserved(m, r))
+            continue;
+        const size_t* cols = NULL;
+        const double* probs = NULL;
+        markovRowEntries(m, r, &cols, &probs);
+        rows[markovRowState(m, r)] = (lli)r;
+    }
+    return rows;
+}
+
+// Next probabilities of the block b (the states b*nVals + v) into out: the previous states of the block
+// are b + k*nStates/nVals, and each one adds its row (or a uniform row if never observed) to the block
+static void markovPullBlock(const TransitionMatrix* m, const lli* rows, const double* p, const size_t b,
+                            double* out) {
+    const size_t nVals = m->state->nVals;
+    const size_t stride = m->state->nStates / nVals;
+    double unobserved = 0.0;
+    memset(out, 0, sizeof(double) * nVals);
+    for (size_t k = 0; k < nVals; k++) {
+        const size_t s = b + k * stride;
+        const double x = p[s];
+        if (x == 0.0)
+            continue;
+        if (rows[s] == -1) {
+            unobserved += x;
+            continue;
+        }
+
+        const size_t* cols = NULL;
+        const double* probs = NULL;
+        const size_t len = markovRowEntries(m, (size_t)rows[s], &cols, &probs);
+        if (!cols) {
+            // contiguous rows, vectorized
+            for (size_t v = 0; v < len; v++)
+                out[v] += x * probs[v];
+        }
+        else {
+            for (size_t e = 0; e < len; e++)
+                out[cols[e]] += x * probs[e];
+        }
+    }
+
+    const double u = unobserved / (double)nVals;
+    for (size_t v = 0; v < nVals; v++)
+        out[v] += u;
+}
+
+typedef struct {
+    const TransitionMatrix* m;
+    const lli* rows;
+    const double* p;
+    double* q;
+    // L1 distance from q to 'ref' of the blocks of every thread
+    const double* ref;
+    double* dist;
+    // q = (p + p P) / 2 instead: the lazy chain has the same stationary distribution and is aperiodic.
+    // The distance is still the one of p P, so it measures how far p is from stationary in both cases
+    bool lazy;
+} StationaryJob;
+
+static void markovPullBlocks(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    const StationaryJob* job = (const StationaryJob*)ctx;
+    const size_t nVals = job->m->state->nVals;
+    double dist = 0.0;
+    for (size_t b = begin; b < end; b++) {
+        double* qb = job->q + b * nVals;
+        const double* rb = job->ref + b * nVals;
+        markovPullBlock(job->m, job->rows, job->p, b, qb);
+        for (size_t v = 0; v < nVals; v++)
+            dist += fabs(qb[v] - rb[v]);
+        if (job->lazy) {
+            const double* pb = job->p + b * nVals;
+            for (size_t v = 0; v < nVals; v++)
+                qb[v] = 0.5 * (qb[v] + pb[v]);
+        }
+    }
+    job->dist[thread] = dist;
+}
+
+// One step q = p P over the threads. Returns the L1 distance from q to 'ref' (-1 on error)
+static double markovPullStep(StationaryJob* job, const uint nThreads) {
+    const MarkovState* state = job->m->state;
+    const uint threads = (state->nStates < STATIONARY_MIN_PARALLEL_STATES) ? 1 : nThreads;
+    const uint used = parallelFor(state->nStates / state->nVals, threads, markovPullBlocks, job);
+    if (used == 0)
+        return -1.0;
+
+    double dist = 0.0;
+    for (uint t = 0; t < used; t++)
+        dist += job->dist[t];
+    return dist;
+}
+
+// In place Gauss-Seidel sweep, in ascending order of the states, with the self transitions taken out
+// (pi_t = sum of the others / (1 - P(t, t))). A state is a previous state of its own block when it goes to
+// itself, and then its new probability is also added to the later states of the block. 'block' has nVals values
+static void markovGaussSeidelSweep(const TransitionMatrix* m, const lli* rows, double* p, double* block) {
+    const MarkovState* state = m->state;
+    const size_t nVals = state->nVals;
+    const size_t stride = state->nStates / nVals;
+    for (size_t b = 0; b < stride; b++) {
+        markovPullBlock(m, rows, p, b, block);
+
+        for (size_t v = 0; v < nVals; v++) {
+            const size_t t = b * nVals + v;
+            if (t % stride != b) {
+                p[t] = block[v];
+                continue;
+            }
+
+            const size_t* cols = NULL;
+            const double* probs = NULL;
+            const size_t len = (rows[t] == -1) ? 0 : markovRowEntries(m, (size_t)rows[t], &cols, &probs);
+            double self = (rows[t] == -1) ? 1.0 / (double)nVals : 0.0;
+            for (size_t e = 0; e < len; e++) {
+                if (((cols) ? cols[e] : e) == v)
+                    self = probs[e];
+            }
+            const double next = (self < 1.0) ? (block[v] - p[t] * self) / (1.0 - self) : p[t];
+
+            // the later states of the block were pulled with the old probability of t
+            const double delta = next - p[t];
+            if (rows[t] == -1) {
+                for (size_t w = v + 1; w < nVals; w++)
+                    block[w] += delta / (double)nVals;
+            }
+            for (size_t e = 0; e < len; e++) {
+                const size_t w = (cols) ? cols[e] : e;
+                if (w > v)
+                    block[w] += delta * probs[e];
+            }
+            p[t] = next;
+        }
+    }
+}
+
+MarkovStationary* markovStationary(const TransitionMatrix* m, const StationaryMethod method, const double tol,
+                                   const size_t maxIter, const uint nThreads) {
+    if (!m || !m->state || m->state->order == 0)
+        return NULL;
+    if (method != STATIONARY_POWER && method != STATIONARY_GAUSS_SEIDEL) {
+        LOG_ERROR("Invalid method for the stationary distribution");
+        return NULL;
+    }
+
+    const MarkovState* state = m->state;
+    const size_t nStates = state->nStates;
+    const size_t nVals = state->nVals;
+    if (nStates > MARKOV_STATIONARY_MAX_STATES) {
+        LOG_ERROR("Too many states for the stationary distribution");
+        return NULL;
+    }
+
+    MarkovStationary* st = calloc(1, sizeof(MarkovStationary));
+    if (!st) {
+        LOG_ERROR("malloc failed for MarkovStationary");
+        return NULL;
+    }
+    st->state = state;
+    st->method = method;
+    st->probs = malloc(sizeof(double) * nStates);
+    st->marginal = calloc(nVals, sizeof(double));
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    double* q = malloc(sizeof(double) * nStates);
+    double* dist = malloc(sizeof(double) * threads);
+    double* block = malloc(sizeof(double) * nVals);
+    lli* rows = markovStateRows(m);
+    if (!st->probs || !st->marginal || !q || !dist || !block || !rows) {
+        LOG_ERROR("malloc failed for the state vectors of the stationary distribution");
+        free(q);
+        free(dist);
+        free(block);
+        free(rows);
+        markovFreeStationary(&st);
+        return NULL;
+    }
+
+    double* p = st->probs;
+    for (size_t s = 0; s < nStates; s++)
+        p[s] = 1.0 / (double)nStates;
+
+    bool ok = true;
+    double prevResidual = 0.0;
+    StationaryJob job = {m, rows, NULL, NULL, NULL, dist, true};
+    for (size_t it = 0; it < maxIter; it++) {
+        double residual = 0.0;
+        if (method == STATIONARY_POWER) {
+            job.p = p;
+            job.q = q;
+            job.ref = p;
+            residual = markovPullStep(&job, threads);
+            if (residual < 0.0) {
+                ok = false;
+                break;
+            }
+            double* temp = p;
+            p = q;
+            q = temp;
+        }
+        else {
+            // the sweep doesn't keep the total, so it's normalized every time
+            memcpy(q, p, sizeof(double) * nStates);
+            markovGaussSeidelSweep(m, rows, p, block);
+            double total = 0.0;
+            for (size_t s = 0; s < nStates; s++)
+                total += p[s];
+            for (size_t s = 0; s < nStates; s++) {
+                p[s] /= total;
+                residual += fabs(p[s] - q[s]);
+            }
+        }
+
+        st->iterations = it + 1;
+        st->residual = residual;
+        if (prevResidual > 0.0 && residual > 0.0)
+            st->rate = residual / prevResidual;
+        prevResidual = residual;
+        if (residual < tol) {
+            st->converged = true;
+            break;
+        }
+    }
+
+    // the last iterate may be in the other vector
+    if (p != st->probs) {
+        memcpy(st->probs, p, sizeof(double) * nStates);
+        q = p;
+    }
+    free(q);
+    free(dist);
+    free(block);
+    free(rows);
+    if (!ok) {
+        LOG_ERROR("Unable to iterate the stationary distribution");
+        markovFreeStationary(&st);
+        return NULL;
+    }
+
+    // the value of the next state b*nVals + v is v
+    for (size_t s = 0; s < nStates; s++)
+        st->marginal[s % nVals] += st->probs[s];
+    if (method == STATIONARY_POWER && st->rate > 0.0 && st->rate < 1.0)
+        st->relaxation = 1.0 / (1.0 - st->rate);
+    if (!st->converged)
+        LOG_WARNING("The stationary distribution didn't converge");
+    return st;
+}
+
+void markovFreeStationary(MarkovStationary** st) {
+    if (!st || !(*st))
+        return;
+
+    free((*st)->probs);
+    free((*st)->marginal);
+    free(*st);
+    *st = NULL;
+}
+
+// Whether the stationary distribution was computed for the states of the matrix
+static bool markovStationaryMatches(const TransitionMatrix* m, const MarkovStationary* st) {
+    if (st->state == m->state ||
+        (st->state->nStates == m->state->nStates && st->state->nVals == m->state->nVals))
+        return true;
+    LOG_ERROR("The stationary distribution has other states than the matrix");
+    return false;
+}
+
+lli markovMixingTime(const TransitionMatrix* m, const MarkovStationary* st, const int* data, const size_t n,
+                     const double eps, const size_t maxSteps, const uint nThreads) {
+    if (!m || !m->state || !st || !data || !markovStationaryMatches(m, st))
+        return -1;
+
+    const lli startState = markovLastState(m->state, data, n);
+    if (startState == -1)
+        return -1;
+
+    const size_t nStates = m->state->nStates;
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    double* p = calloc(nStates, sizeof(double));
+    double* q = malloc(sizeof(double) * nStates);
+    double* dist = malloc(sizeof(double) * threads);
+    lli* rows = markovStateRows(m);
+    if (!p || !q || !dist || !rows) {
+        LOG_ERROR("malloc failed for the state vectors in markovMixingTime");
+        free(p);
+        free(q);
+        free(dist);
+        free(rows);
+        return -1;
+    }
+
+    // total variation distance at step 0, from the last state alone
+    double tv = 1.0 - st->probs[startState];
+    p[startState] = 1.0;
+    lli mixing = (tv <= eps) ? 0 : -1;
+
+    StationaryJob job = {m, rows, NULL, NULL, st->probs, dist, false};
+    for (size_t t = 1; mixing == -1 && t <= maxSteps; t++) {
+        job.p = p;
+        job.q = q;
+        const double l1 = markovPullStep(&job, threads);
+        if (l1 < 0.0)
+            break;
+        if (l1 / 2.0 <= eps)
+            mixing = (lli)t;
+        double* temp = p;
+        p = q;
+        q = temp;
+    }
+
+    free(p);
+    free(q);
+    free(dist);
+    free(rows);
+    return mixing;
+}
+
+MarkovForecast* markovLongRunForecast(const TransitionMatrix* m, const MarkovStationary* st,
+                                      const size_t mixingSteps, const int* data, const size_t n,
+                                      const uint steps, const double* quantiles, const size_t nQuantiles) {
+    if (!m || !m->state || !st || !data || !markovStationaryMatches(m, st))
+        return NULL;
+
+    const lli startState = markovLastState(m->state, data, n);
+    if (startState == -1)
+        return NULL;
+
+    // The value of step s comes with the state s+1, so steps from mixingSteps on are within the distance
+    // of the mixing time (only if the stationary distribution converged)
+    const size_t nVals = m->state->nVals;
+    const size_t exact = (!st->converged || mixingSteps > steps) ? steps : mixingSteps;
+    MarkovForecast* f = markovForecastInit(m->state, steps, quantiles, nQuantiles);
+    if (!f)
+        return NULL;
+    if (exact > 0 && !markovPropagate(m, (size_t)startState, exact, f->marginals, true)) {
+        markovFreeForecast(&f);
+        return NULL;
+    }
+    for (size_t s = exact; s < steps; s++)
+        memcpy(f->marginals + s * nVals, st->marginal, sizeof(double) * nVals);
+
+    if (!markovForecastSummarize(f)) {
+        markovFreeForecast(&f);
+        return NULL;
+    }
+    return f;
+}
+
+void markovPrintStationary(const MarkovStationary* st) {
+    if (!st)
+        return;
+
+    const size_t nVals = st->state->nVals;
+    printf("METHOD: %s, ITERATIONS: %lu, RESIDUAL: %g%s\n",
+           (st->method == STATIONARY_POWER) ? "POWER ITERATION" : "GAUSS-SEIDEL", st->iterations, st->residual,
+           (st->converged) ? "" : " (NOT CONVERGED)");
+    if (st->relaxation > 0.0)
+        printf("RELAXATION TIME (LAZY CHAIN): %lf steps\n", st->relaxation);
+
+    size_t mode = 0;
+    for (size_t v = 1; v < nVals; v++) {
+        if (st->marginal[v] > st->marginal[mode])
+            mode = v;
+    }
+    printf("MODE %d (%lf), LONG RUN PROBABILITIES: ", st->state->vals[mode], st->marginal[mode]);
+    for (size_t v = 0; v < nVals; v++)
+        printf((v + 1 < nVals) ? "%d: %lf, " : "%d: %lf\n", st->state->vals[v], st->marginal[v]);
+}
+/* ----------------------------------------------------------------------------------------------- */
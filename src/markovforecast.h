@@ -0,0 +1,108 @@
+#ifndef MARKOVFORECAST_H
+#define MARKOVFORECAST_H
+
+#include "markov.h"
+
+/// Forecast distributions of the next values of a series
+
+// Distribution of the value at every step ahead: marginals[s*nVals + v] is the probability of the value
+// vals[v] at step s (0 is the next value). From it, 'modes' has the most likely value of each step, and
+// percentiles[s*nQuantiles + q] the smallest value whose cumulative probability (values in ascending
+// order) reaches quantiles[q] at step s.
+// Monte Carlo forecasts estimate the marginals from nPaths trajectories (nPaths is 0 for exact ones)
+typedef struct {
+    const MarkovState* state;
+    uint steps;
+    size_t nPaths;
+    double* marginals;
+    int* modes;
+    size_t nQuantiles;
+    double* quantiles;
+    int* percentiles;
+} MarkovForecast;
+
+// Monte Carlo forecast: samples 'nPaths' independent trajectories of 'steps' values, starting from the last
+// state of data[0..n), split across 'nThreads' threads (0 uses every core). Each trajectory has its own
+// counter-based random stream (seed, path), so the result doesn't depend on the number of threads.
+// States never observed continue with a uniformly chosen value. The matrix must have its sampler built
+// (markovSamplerReady), as every filled matrix does. Returns NULL on error
+MarkovForecast* markovMonteCarlo(const TransitionMatrix* m, const int* data, const size_t n, const uint steps,
+                                 const size_t nPaths, const uint64_t seed, const uint nThreads,
+                                 const double* quantiles, const size_t nQuantiles);
+// Exact forecast: propagates the probability of every state, starting from the last state of data[0..n)
+// with probability 1, through the matrix for 'steps' steps, and keeps the distribution of the value of
+// each step. States never observed go to every value with the same probability (like in Monte Carlo).
+// The state vector is dense (contiguous blocks of nVals next states) when there are up to
+// MARKOV_EXACT_DENSE_STATES states, and only has the reachable states otherwise, up to
+// MARKOV_EXACT_MAX_SUPPORT of them. Returns NULL on error or if the reachable states exceed that limit
+#define MARKOV_EXACT_DENSE_STATES ((size_t)1 << 22)
+#define MARKOV_EXACT_MAX_SUPPORT ((size_t)1 << 22)
+MarkovForecast* markovExactForecast(const TransitionMatrix* m, const int* data, const size_t n, const uint steps,
+                                    const double* quantiles, const size_t nQuantiles);
+// Distribution of the value 'k' steps ahead only (k >= 1), in distOut (nVals values). Up to
+// MARKOV_SQUARING_MAX_STATES states, long horizons raise the state transition matrix to the power k-1
+// by repeated squaring (O(nStates^3 log k) instead of O(k nStates nVals)). Returns false on error
+#define MARKOV_SQUARING_MAX_STATES 512
+bool markovExactMarginalAt(const TransitionMatrix* m, const int* data, const size_t n, const size_t k,
+                           double* distOut);
+
+// Forecast from marginals (steps*nVals, copied) estimated elsewhere from nPaths trajectories, like the
+// walks of a Markov Graph over the same alphabet. Returns NULL on error
+MarkovForecast* markovForecastFromMarginals(const MarkovState* state, const uint steps, const double* marginals,
+                                           const size_t nPaths, const double* quantiles, const size_t nQuantiles);
+void markovFreeForecast(MarkovForecast** f);
+
+// Long-run behaviour of the chain: probs[s] is the stationary probability of the state s (pi = pi P over
+// the states), and marginal[v] the probability of the value vals[v] in the long run. States never observed
+// go to every value with the same probability, like in the forecasts.
+// 'rate' is the ratio between the last residuals (L1 distance between two iterates): with power iteration
+// it estimates the modulus of the second eigenvalue of the lazy chain (P + I) / 2 it iterates, so
+// relaxation = 1 / (1 - rate) is the number of lazy steps that shrink the distance to the stationary
+// distribution by e (0 if it couldn't be estimated, and with Gauss-Seidel, whose rate isn't an eigenvalue).
+// A periodic chain still has a lazy relaxation time, but its mixing time is never reached
+typedef enum {
+    STATIONARY_POWER = 0,        // pi <- pi (P + I) / 2, over the threads (converges on periodic chains too)
+    STATIONARY_GAUSS_SEIDEL = 1, // in place sweeps, in a single thread (fewer iterations on slowly mixing chains)
+} StationaryMethod;
+
+#define MARKOV_STATIONARY_MAX_STATES ((size_t)1 << 26)
+#define MARKOV_STATIONARY_TOLERANCE 1e-12
+#define MARKOV_STATIONARY_MAX_ITERATIONS 100000
+typedef struct {
+    const MarkovState* state;
+    StationaryMethod method;
+    double* probs;
+    double* marginal;
+    size_t iterations;
+    double residual;
+    bool converged;
+    double rate;
+    double relaxation;
+} MarkovStationary;
+
+// Stationary distribution, iterating from the uniform distribution until the residual is below 'tol' or
+// after 'maxIter' iterations (converged is false then). The states are pulled in blocks: the next states
+// b*nVals + v of every v have the same previous states b + k*nStates/nVals, so each block is computed from
+// nVals contiguous rows without writing to other blocks, and the blocks are split across 'nThreads'
+// threads (0 uses every core). Needs up to MARKOV_STATIONARY_MAX_STATES states. Returns NULL on error
+MarkovStationary* markovStationary(const TransitionMatrix* m, const StationaryMethod method, const double tol,
+                                   const size_t maxIter, const uint nThreads);
+void markovFreeStationary(MarkovStationary** st);
+
+// Mixing time from the last state of data[0..n): the first step whose state distribution is within
+// total variation distance 'eps' of the stationary one. Returns -1 if it isn't reached in 'maxSteps'
+lli markovMixingTime(const TransitionMatrix* m, const MarkovStationary* st, const int* data, const size_t n,
+                     const double eps, const size_t maxSteps, const uint nThreads);
+
+// Exact forecast that stops propagating after 'mixingSteps' steps (from markovMixingTime): the later
+// steps get the stationary marginal, so long horizons cost the same as the mixing time
+MarkovForecast* markovLongRunForecast(const TransitionMatrix* m, const MarkovStationary* st,
+                                      const size_t mixingSteps, const int* data, const size_t n,
+                                      const uint steps, const double* quantiles, const size_t nQuantiles);
+
+// Print the mode (and its probability) and the percentiles of every step
+void markovPrintForecast(const MarkovForecast* f);
+// Print the stationary marginal of every value, with the iterations and the relaxation time
+void markovPrintStationary(const MarkovStationary* st);
+
+#endif // MARKOVFORECAST_H
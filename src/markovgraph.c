@@ -1,33 +1,13 @@
 #include "markovgraph.h"
 
+#include <math.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "parallel.h"
 #include "utils.h"
 
 /* ----------------------------- MARKOV NODE ----------------------------- */
-MarkovNode* mkNodeInit(const size_t id, const uint order, int* state) {
-    MarkovNode* node = malloc(sizeof(MarkovNode));
-    if (!node) {
-        LOG_ERROR("malloc error for node in mkNodeInit");
-        return NULL;
-    }
-
-    node->id = id;
-    node->order = order;
-    // don't copy state
-    node->state = state;
-
-    return node;
-}
-
-void mkNodeFree(MarkovNode** node) {
-    if (!node || !(*node))
-        return;
-
-    free(*node);
-    *node = NULL;
-}
-
 size_t mkNodeId(const MarkovNode* node) {
     if (!node)
         return 0;
@@ -41,350 +21,1056 @@ int* mkNodeState(const MarkovNode* node) {
 }
 /* ----------------------------------------------------------------------- */
 
-/* ----------------------------- MARKOV EDGE ----------------------------- */
-MarkovGraphEdge* mkEdgeInit(MarkovNode* orig, MarkovNode* dest, double weight) {
-    MarkovGraphEdge* edge = malloc(sizeof(MarkovGraphEdge));
-    if (!edge) {
-        LOG_ERROR("malloc failed for MarkovGraphEdge* edge");
-        return NULL;
-    }
-
-    edge->orig = orig;
-    edge->dest = dest;
-    edge->weight = weight;
-    edge->next = NULL;
-
-    return edge;
-}
-
-void mkEdgeFree(MarkovGraphEdge** edge) {
-    if (!edge || !(*edge))
-        return;
-
-    // Dont free nodes because it may be shared
-    free(*edge);
-    *edge = NULL;
-}
-
-void mkEdgeEnds(const MarkovGraphEdge* edge, MarkovNode** orig, MarkovNode** dest) {
-    if (!edge)
-        return;
-    if (orig) *orig = edge->orig;
-    if (dest) *dest = edge->dest;
-}
-
-double mkEdgeWeight(const MarkovGraphEdge* edge) {
-    if (!edge)
-        return 0.0;
-    return edge->weight;
-}
-/* ----------------------------------------------------------------------- */
-
 /* ----------------------------- MARKOV GRAPH ----------------------------- */
 MarkovGraph* mkGraphInit(const MarkovState* states) {
     if (!states)
         return NULL;
 
-    MarkovGraph* graph = malloc(sizeof(MarkovGraph));
+    MarkovGraph* graph = calloc(1, sizeof(MarkovGraph));
     if (!graph) {
         LOG_ERROR("malloc failed for graph");
         return NULL;
     }
 
+    graph->states = states;
     graph->order = states->order;
     graph->vals = states->vals;
     graph->nVals = states->nVals;
 
-    // The number of nodes is the amount of states
-    graph->nNodes = states->nStates;
-    graph->edges = malloc(sizeof(MarkovGraphEdge*) * graph->nNodes);
-    if (!graph->edges) {
-        LOG_ERROR("malloc failed for graph->edges");
-        free(graph);
-        return NULL;
-    }
-
-    // initialize the nodes in the order of the states
-    for (size_t i = 0; i < states->nStates; i++) {
-        MarkovNode* stateNode = mkNodeInit(i, graph->order, states->states[i]);
-        if (!stateNode) {
-            LOG_ERROR("mkNodeInit failed for stateNode");
-            // Cleanup already allocated edges
-            for (size_t j = 0; j < i; j++) {
-                mkNodeFree(&(graph->edges[j]->orig));
-                mkEdgeFree(&(graph->edges[j]));
-            }
-            mkNodeFree(&stateNode);
-            free(graph->edges);
+    // Lazy states start empty, their nodes are added by mkGraphBuildTransitions
+    if (states->states == NULL) {
+        graph->nodeIndex = hashMapInit(GRAPH_BUCKET_SIZE);
+        if (!graph->nodeIndex) {
+            LOG_ERROR("malloc failed for graph->nodeIndex");
             free(graph);
             return NULL;
         }
+        return graph;
+    }
 
-        graph->edges[i] = mkEdgeInit(stateNode, NULL, 0.0);
-        if (!graph->edges[i]) {
-            LOG_ERROR("mkEdgeInit failed for edge");
-            mkNodeFree(&stateNode);
-            for (size_t j = 0; j < i; j++) {
-                mkNodeFree(&(graph->edges[i]->orig));
-                mkEdgeFree(&(graph->edges[j]));
-            }
-            free(graph->edges);
-            free(graph);
-            return NULL;
-        }
+    // The number of nodes is the amount of states, initialized in the order of the states
+    graph->nNodes = states->nStates;
+    graph->nodes = malloc(sizeof(MarkovNode) * graph->nNodes);
+    if (!graph->nodes) {
+        LOG_ERROR("malloc failed for graph->nodes");
+        free(graph);
+        return NULL;
+    }
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        graph->nodes[i].id = i;
+        graph->nodes[i].order = graph->order;
+        // don't copy state
+        graph->nodes[i].state = markovStateVec(states, i);
     }
-    graph->nEdges = 0;
     return graph;
 }
 
+// Free the edges of the graph (it's left without edges)
+static void mkGraphFreeEdges(MarkovGraph* graph) {
+    free(graph->offsets);
+    free(graph->dests);
+    free(graph->weights);
+    free(graph->cdf);
+    graph->offsets = NULL;
+    graph->dests = NULL;
+    graph->weights = NULL;
+    graph->cdf = NULL;
+    graph->nEdges = 0;
+}
+
+// Free the nodes and edges of the graph (not the graph itself)
+static void mkGraphFreeParts(MarkovGraph* graph) {
+    mkGraphFreeEdges(graph);
+    free(graph->nodes);
+    free(graph->nodeVals);
+    free(graph->nodeStates);
+    hashMapFree(&graph->nodeIndex);
+    graph->nodes = NULL;
+    graph->nodeVals = NULL;
+    graph->nodeStates = NULL;
+}
+
 void mkGraphFree(MarkovGraph** graph) {
     if (!graph || !(*graph))
         return;
 
-    if ((*graph)->edges) {
-        // First free every node
-        // the nodes are the origin of every edges[i]
-        for (size_t e = 0; e < (*graph)->nNodes; e++) {
-            if ((*graph)->edges[e] && (*graph)->edges[e]->orig)
-                mkNodeFree(&(*graph)->edges[e]->orig);
-
-            // Deep free every edge of this node
-            MarkovGraphEdge* curr = (*graph)->edges[e];
-            while (curr) {
-                MarkovGraphEdge* temp = curr->next;
-                mkEdgeFree(&curr);
-                curr = temp;
+    mkGraphFreeParts(*graph);
+
+    // finally free the graph pointer
+    free(*graph);
+    *graph = NULL;
+}
+
+// Allocate the CSR arrays for 'nNodes' nodes and up to 'maxEdges' edges
+static bool mkGraphAllocEdges(MarkovGraph* graph, const size_t nNodes, const size_t maxEdges) {
+    mkGraphFreeEdges(graph);
+    graph->offsets = malloc(sizeof(size_t) * (nNodes + 1));
+    graph->dests = malloc(sizeof(size_t) * (maxEdges + 1));
+    graph->weights = malloc(sizeof(double) * (maxEdges + 1));
+    graph->cdf = malloc(sizeof(double) * (maxEdges + 1));
+    if (!graph->offsets || !graph->dests || !graph->weights || !graph->cdf) {
+        LOG_ERROR("malloc failed for the edges of the graph");
+        mkGraphFreeEdges(graph);
+        return false;
+    }
+    graph->offsets[0] = 0;
+    return true;
+}
+
+// Append an edge from the last node whose edges are being added
+static void mkGraphPushEdge(MarkovGraph* graph, const size_t origID, const size_t destID, const double weight) {
+    const size_t e = graph->nEdges;
+    const double prev = (e > graph->offsets[origID]) ? graph->cdf[e - 1] : 0.0;
+    graph->dests[e] = destID;
+    graph->weights[e] = weight;
+    graph->cdf[e] = prev + weight;
+    graph->nEdges++;
+}
+
+// Node id of the state in a lazy graph, added (with no edges) if the graph doesn't have it yet.
+// stateIds has the state of every node, growing by buckets. Returns -1 on error
+static lli mkGraphLazyNode(MarkovGraph* graph, const size_t stateID, size_t** stateIds, size_t* cap) {
+    const lli id = hashMapGet(graph->nodeIndex, stateID);
+    if (id != -1)
+        return id;
+
+    if (graph->nNodes == *cap) {
+        const size_t grown = *cap + GRAPH_BUCKET_SIZE * (1 + *cap / GRAPH_BUCKET_SIZE);
+        size_t* temp = realloc(*stateIds, sizeof(size_t) * grown);
+        if (!temp)
+            return -1;
+        *stateIds = temp;
+        *cap = grown;
+    }
+    if (!hashMapPut(graph->nodeIndex, stateID, graph->nNodes))
+        return -1;
+    (*stateIds)[graph->nNodes] = stateID;
+    graph->nNodes++;
+    return (lli)(graph->nNodes - 1);
+}
+
+// Drop every node and edge of a lazy graph (a failed build leaves it empty)
+static void mkGraphClearLazy(MarkovGraph* graph) {
+    hashMapFree(&graph->nodeIndex);
+    graph->nodeIndex = hashMapInit(GRAPH_BUCKET_SIZE);
+    free(graph->nodes);
+    free(graph->nodeVals);
+    free(graph->nodeStates);
+    graph->nodes = NULL;
+    graph->nodeVals = NULL;
+    graph->nodeStates = NULL;
+    graph->nNodes = 0;
+    mkGraphFreeEdges(graph);
+}
+
+// Lazy graphs only get the observed states of the matrix and their non-zero transitions.
+// The observed states get the first node ids (in the order of the rows), so the edges of each row
+// go straight after the ones of the previous row, and the states they go to are added after them
+static void mkGraphBuildLazyTransitions(MarkovGraph* graph, const TransitionMatrix* tm) {
+    // forget any node of a previous build
+    hashMapFree(&graph->nodeIndex);
+    free(graph->nodes);
+    free(graph->nodeVals);
+    free(graph->nodeStates);
+    graph->nodes = NULL;
+    graph->nodeVals = NULL;
+    graph->nodeStates = NULL;
+    graph->nNodes = 0;
+    mkGraphFreeEdges(graph);
+
+    const size_t nRows = markovNumRows(tm);
+    size_t nObserved = 0, maxEdges = 0;
+    for (size_t r = 0; r < nRows; r++) {
+        if (!markovRowObserved(tm, r))
+            continue;
+        const size_t* cols = NULL;
+        const double* probs = NULL;
+        maxEdges += markovRowEntries(tm, r, &cols, &probs);
+        nObserved++;
+    }
+
+    size_t cap = nObserved + GRAPH_BUCKET_SIZE;
+    size_t* stateIds = malloc(sizeof(size_t) * cap);
+    graph->nodeIndex = hashMapInit(cap);
+    if (!stateIds || !graph->nodeIndex || !mkGraphAllocEdges(graph, nObserved, maxEdges)) {
+        LOG_ERROR("Unable to allocate the nodes in mkGraphBuildTransitions");
+        free(stateIds);
+        mkGraphClearLazy(graph);
+        return;
+    }
+    bool ok = true;
+    for (size_t r = 0; ok && r < nRows; r++) {
+        if (markovRowObserved(tm, r) && mkGraphLazyNode(graph, markovRowState(tm, r), &stateIds, &cap) == -1) {
+            LOG_ERROR("Unable to add node for state in mkGraphBuildTransitions");
+            ok = false;
+        }
+    }
+
+    size_t origID = 0;
+    for (size_t r = 0; ok && r < nRows; r++) {
+        if (!markovRowObserved(tm, r))
+            continue;
+
+        const size_t stateID = markovRowState(tm, r);
+        const size_t* cols = NULL;
+        const double* probs = NULL;
+        const size_t len = markovRowEntries(tm, r, &cols, &probs);
+        for (size_t e = 0; e < len; e++) {
+            if (probs[e] <= 0.0)
+                continue;
+            const size_t valID = (cols) ? cols[e] : e;
+            const size_t nextID = markovNextStateId(graph->states, stateID, valID);
+            const lli destID = mkGraphLazyNode(graph, nextID, &stateIds, &cap);
+            if (destID == -1) {
+                LOG_ERROR("Unable to add node for state in mkGraphBuildTransitions");
+                ok = false;
+                break;
             }
+            mkGraphPushEdge(graph, origID, (size_t)destID, probs[e]);
         }
+        origID++;
+        graph->offsets[origID] = graph->nEdges;
+    }
 
-        free((*graph)->edges);
+    // The states only reached have no edges
+    size_t* offsets = (ok) ? realloc(graph->offsets, sizeof(size_t) * (graph->nNodes + 1)) : NULL;
+    graph->nodes = (ok) ? malloc(sizeof(MarkovNode) * (graph->nNodes + 1)) : NULL;
+    graph->nodeVals = (ok) ? malloc(sizeof(int) * (graph->nNodes * graph->order + 1)) : NULL;
+    if (offsets)
+        graph->offsets = offsets;
+    if (!offsets || !graph->nodes || !graph->nodeVals) {
+        LOG_ERROR("Unable to build the transitions in mkGraphBuildTransitions");
+        free(stateIds);
+        mkGraphClearLazy(graph);
+        return;
     }
+    for (size_t i = origID + 1; i <= graph->nNodes; i++)
+        graph->offsets[i] = graph->nEdges;
 
-    // finally free the graph pointer
-    free(*graph);
-    *graph = NULL;
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        graph->nodes[i].id = i;
+        graph->nodes[i].order = graph->order;
+        graph->nodes[i].state = graph->nodeVals + i * graph->order;
+        markovDecodeState(graph->states, stateIds[i], graph->nodes[i].state);
+    }
+    graph->nodeStates = stateIds;
 }
 
 void mkGraphBuildTransitions(MarkovGraph* graph, const TransitionMatrix* tm) {
     if (!graph || !tm)
         return;
 
-    // For every state, we have the probability of the next value being 1 or 0
-    // so the next state is the current state with the last value replaced by this new one
-    // and the past values translated to the left
-    int* nextState = malloc(sizeof(int) * graph->order);
-    if (!nextState) {
-        LOG_ERROR("malloc failed for tempState, unable to initialize graph probabilities.");
+    if (graph->nodeIndex) {
+        mkGraphBuildLazyTransitions(graph, tm);
         return;
     }
-    for (size_t stateID = 0; stateID < graph->nNodes; stateID++) {
-        MarkovNode* stateNode = graph->edges[stateID]->orig;
 
-        // copy only last two values of state
-        memcpy(nextState, stateNode->state+1, sizeof(int) * (graph->order - 1));
+    // For every state, we have the probability of the next value being each of the values
+    // so the next state is the current state with the last value replaced by this new one
+    // and the past values translated to the left. Every node has an edge per value
+    if (!mkGraphAllocEdges(graph, graph->nNodes, graph->nNodes * graph->nVals))
+        return;
+    for (size_t stateID = 0; stateID < graph->nNodes; stateID++) {
+        const size_t begin = graph->nEdges;
         for (size_t valID = 0; valID < graph->nVals; valID++) {
-            // set next value for next state
-            nextState[graph->order - 1] = graph->vals[valID];
-            const lli nextID = mkGraphIdState(graph, nextState);
-            if (nextID == -1) {
-                LOG_ERROR("Unidentified state: ");
-                printArr_i(nextState, graph->order);
-                continue;
-            }
-            MarkovNode* nextNode = mkGraphGetNode(graph, nextID);
+            // node ids follow the state ids, so the next node comes straight from the encoding
+            graph->dests[begin + valID] = markovNextStateId(graph->states, stateID, valID);
+            graph->weights[begin + valID] = 0.0;
+        }
 
-            // Then add an edge for this transition with the probability from the matrix
-            MarkovGraphEdge* edge = mkGraphAddEdge(graph, stateNode, nextNode, tm->probs[stateID][valID]);
-            if (!edge) {
-                LOG_ERROR("Unable to add edge for state transition");
-                fprintf(stderr, "From ID %ld to ID %ld\n", stateID, nextNode->id);
-            }
+        // Then the weight of every transition is its probability in the matrix
+        const lli row = (tm->layout == TM_SPARSE) ? markovSparseRow(tm, stateID) : (lli)stateID;
+        if (row != -1) {
+            const size_t* cols = NULL;
+            const double* probs = NULL;
+            const size_t len = markovRowEntries(tm, (size_t)row, &cols, &probs);
+            for (size_t e = 0; e < len; e++)
+                graph->weights[begin + ((cols) ? cols[e] : e)] = probs[e];
         }
+
+        double cumProb = 0.0;
+        for (size_t valID = 0; valID < graph->nVals; valID++) {
+            cumProb += graph->weights[begin + valID];
+            graph->cdf[begin + valID] = cumProb;
+        }
+        graph->nEdges += graph->nVals;
+        graph->offsets[stateID + 1] = graph->nEdges;
     }
-    free(nextState);
 }
 
 MarkovNode* mkGraphGetNode(const MarkovGraph* graph, size_t id) {
     if (!graph || id >= graph->nNodes)
         return NULL;
-    return graph->edges[id]->orig;
+    return &graph->nodes[id];
 }
 
 bool mkGraphHasNode(const MarkovGraph* graph, const MarkovNode* node) {
-    return (graph != NULL && node->id <= graph->nNodes);
+    return (graph != NULL && node != NULL && node->id < graph->nNodes);
 }
 
 lli mkGraphIdState(const MarkovGraph* graph, const int* state) {
     if (!graph || !state)
         return -1;
 
-    for (size_t id = 0; id < graph->nNodes; id++) {
-        const MarkovNode* stateNode = graph->edges[id]->orig;
-        if (memcmp(stateNode->state, state, sizeof(int) * graph->order) == 0)
-            return id;
-    }
+    // Nodes are initialized in the order of the states, so the node id is the state id
+    // (lazy graphs look the state up in their index)
+    const lli id = markovEncodeState(graph->states, state);
+    if (id < 0)
+        return -1;
+    if (graph->nodeIndex)
+        return hashMapGet(graph->nodeIndex, (size_t)id);
+    if ((size_t)id >= graph->nNodes)
+        return -1;
+    return id;
+}
+
+void mkGraphNodes(const MarkovGraph* graph, MarkovNode** outNodes) {
+    if (!graph || !graph->nodes || !outNodes)
+        return;
+
+    for (size_t i = 0; i < graph->nNodes; i++)
+        outNodes[i] = &graph->nodes[i];
+}
+
+size_t mkGraphOutEdges(const MarkovGraph* graph, const size_t nodeID, const size_t** dests, const double** weights) {
+    if (!graph || !graph->offsets || nodeID >= graph->nNodes)
+        return 0;
 
-    return -1;
+    const size_t begin = graph->offsets[nodeID];
+    if (dests)
+        *dests = graph->dests + begin;
+    if (weights)
+        *weights = graph->weights + begin;
+    return graph->offsets[nodeID + 1] - begin;
 }
 
-MarkovGraphEdge* mkGraphAddEdge(MarkovGraph* graph, MarkovNode* orig, MarkovNode* dest, double weight) {
-    if (!graph)
+size_t* mkGraphFindDisconnected(const MarkovGraph* graph, size_t* count) {
+    if (!graph || !count)
         return NULL;
 
-    if (!mkGraphHasNode(graph, orig) || !mkGraphHasNode(graph, dest))
+    *count = 0;
+    bool* visited = calloc(graph->nNodes + 1, sizeof(bool));
+    if (!visited) {
+        LOG_ERROR("calloc failed for visited nodes in mkGraphFindDisconnected");
         return NULL;
+    }
+    // Only mark as visited those nodes that are destinies from other states,
+    // and whose paths probabilities (weights) are bigger than 0.0
+    for (size_t e = 0; e < graph->nEdges; e++) {
+        if (graph->weights[e] > 1e-3)
+            visited[graph->dests[e]] = true;
+    }
 
-    graph->nEdges++;
-    size_t origID = mkNodeId(orig);
-    // walk through orig edges list to get to the last one
-    MarkovGraphEdge* edge = graph->edges[origID];
-    // Replace if this is the first one (edge->dest is NULL)
-    if (!edge->dest) {
-        edge->dest = dest;
-        edge->weight = weight;
-        return edge;
+    // In the end, the disconnected nodes will be those that weren't visited
+    size_t* disconnected = malloc(graph->nNodes * sizeof(size_t) + 1);
+    if (!disconnected) {
+        LOG_ERROR("malloc failed for disconnected nodes in mkGraphFindDisconnected");
+        free(visited);
+        return NULL;
+    }
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        if (!visited[i]) {
+            disconnected[*count] = i;
+            (*count)++;
+        }
+    }
+
+    if (*count == 0) {
+        free(disconnected);
+        free(visited);
+        return NULL;
     }
 
-    while (edge->next)
-        edge = edge->next;
-    edge->next = mkEdgeInit(orig, dest, weight);
-    return edge->next;
+    // shrink memory if possible
+    if (*count < graph->nNodes) {
+        size_t* temp = realloc(disconnected, sizeof(size_t) * (*count));
+        if (!temp)
+            LOG_WARNING("Couldn't resize disconnected array with less memory in mkGraphFindDisconnected");
+        else
+            disconnected = temp;
+    }
+
+    free(visited);
+    return disconnected;
 }
 
-void mkGraphNodes(const MarkovGraph* graph, MarkovNode** outNodes) {
-    if (!graph || !graph->edges || !outNodes)
-        return;
+// BFS from the nodes 'starts' through the edges with weight > 0 and >= minWeight: every node enters the
+// queue once, and every edge is read once. Returns the number of nodes reached, 0 on error
+static size_t mkGraphReach(const MarkovGraph* graph, const size_t* starts, const size_t nStarts,
+                           const double minWeight, bool* reachedOut) {
+    size_t* queue = malloc(sizeof(size_t) * (graph->nNodes + 1));
+    if (!queue) {
+        LOG_ERROR("malloc failed for the queue of the graph search");
+        return 0;
+    }
+    memset(reachedOut, 0, sizeof(bool) * graph->nNodes);
 
-    for (size_t i = 0; i < graph->nNodes; i++)
-        outNodes[i] = graph->edges[i]->orig;
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < nStarts; i++) {
+        if (starts[i] < graph->nNodes && !reachedOut[starts[i]]) {
+            reachedOut[starts[i]] = true;
+            queue[tail++] = starts[i];
+        }
+    }
+    while (head < tail) {
+        const size_t node = queue[head++];
+        for (size_t e = graph->offsets[node]; e < graph->offsets[node + 1]; e++) {
+            const size_t dest = graph->dests[e];
+            if (graph->weights[e] > 0.0 && graph->weights[e] >= minWeight && !reachedOut[dest]) {
+                reachedOut[dest] = true;
+                queue[tail++] = dest;
+            }
+        }
+    }
+
+    free(queue);
+    return tail;
 }
 
-void mkGraphEdges(const MarkovGraph* graph, MarkovGraphEdge** outEdges) {
-    if (!graph || !graph->edges || !outEdges)
-        return;
+size_t mkGraphReachable(const MarkovGraph* graph, const size_t start, bool* reachedOut) {
+    if (!graph || !graph->offsets || !reachedOut || start >= graph->nNodes)
+        return 0;
+    return mkGraphReach(graph, &start, 1, 0.0, reachedOut);
+}
 
-    size_t count = 0;
-    for (size_t i = 0; i < graph->nNodes; i++) {
-        MarkovGraphEdge* edge = graph->edges[i];
-        while (edge) {
-            outEdges[count] = edge;
-            count++;
-            edge = edge->next;
+lli mkGraphNodeStateId(const MarkovGraph* graph, const size_t nodeID) {
+    if (!graph || nodeID >= graph->nNodes)
+        return -1;
+    return (graph->nodeStates) ? (lli)graph->nodeStates[nodeID] : (lli)nodeID;
+}
+
+bool mkGraphCompact(MarkovGraph* graph, const double minWeight, const size_t* starts, const size_t nStarts) {
+    if (!graph || !graph->offsets)
+        return false;
+
+    const size_t nNodes = graph->nNodes;
+    bool* alive = malloc(sizeof(bool) * (nNodes + 1));
+    size_t* newIds = malloc(sizeof(size_t) * (nNodes + 1));
+    if (!alive || !newIds) {
+        LOG_ERROR("malloc failed for the live nodes in mkGraphCompact");
+        free(alive);
+        free(newIds);
+        return false;
+    }
+    if (nStarts == 0) {
+        for (size_t i = 0; i < nNodes; i++)
+            alive[i] = true;
+    }
+    else if (mkGraphReach(graph, starts, nStarts, minWeight, alive) == 0) {
+        free(alive);
+        free(newIds);
+        return false;
+    }
+
+    // Survivors keep their relative order, and their edges the order of the values
+    size_t nAlive = 0, nLive = 0;
+    for (size_t i = 0; i < nNodes; i++) {
+        if (!alive[i])
+            continue;
+        newIds[i] = nAlive++;
+        for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; e++) {
+            if (graph->weights[e] > 0.0 && graph->weights[e] >= minWeight)
+                nLive++;
+        }
+    }
+
+    MarkovGraph compact = {0};
+    compact.nodes = malloc(sizeof(MarkovNode) * (nAlive + 1));
+    compact.nodeStates = malloc(sizeof(size_t) * (nAlive + 1));
+    compact.nodeVals = (graph->nodeVals) ? malloc(sizeof(int) * (nAlive * graph->order + 1)) : NULL;
+    compact.nodeIndex = hashMapInit(nAlive + 1);
+    if (!compact.nodes || !compact.nodeStates || (graph->nodeVals && !compact.nodeVals) || !compact.nodeIndex ||
+        !mkGraphAllocEdges(&compact, nAlive, nLive)) {
+        LOG_ERROR("Unable to allocate the compacted graph in mkGraphCompact");
+        free(alive);
+        free(newIds);
+        mkGraphFreeParts(&compact);
+        return false;
+    }
+
+    for (size_t i = 0; i < nNodes; i++) {
+        if (!alive[i])
+            continue;
+
+        const size_t id = newIds[i];
+        const size_t stateID = (size_t)mkGraphNodeStateId(graph, i);
+        compact.nodeStates[id] = stateID;
+        compact.nodes[id].id = id;
+        compact.nodes[id].order = graph->order;
+        compact.nodes[id].state = graph->nodes[i].state;
+        if (compact.nodeVals) {
+            compact.nodes[id].state = compact.nodeVals + id * graph->order;
+            memcpy(compact.nodes[id].state, graph->nodes[i].state, sizeof(int) * graph->order);
+        }
+        if (!hashMapPut(compact.nodeIndex, stateID, id)) {
+            LOG_ERROR("Unable to index the nodes in mkGraphCompact");
+            free(alive);
+            free(newIds);
+            mkGraphFreeParts(&compact);
+            return false;
+        }
+
+        // The edges left are renormalized, so every node with edges is still a distribution
+        double total = 0.0;
+        for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; e++) {
+            if (graph->weights[e] > 0.0 && graph->weights[e] >= minWeight)
+                total += graph->weights[e];
+        }
+        for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; e++) {
+            if (graph->weights[e] > 0.0 && graph->weights[e] >= minWeight)
+                mkGraphPushEdge(&compact, id, newIds[graph->dests[e]], graph->weights[e] / total);
         }
+        compact.offsets[id + 1] = compact.nEdges;
     }
+    free(alive);
+    free(newIds);
+
+    LOG_INFO("Graph compacted from ");
+    fprintf(stderr, "%lu nodes and %lu edges to %lu nodes and %lu edges\n", nNodes, graph->nEdges, nAlive,
+            compact.nEdges);
+
+    // The graph takes the compacted nodes and edges
+    mkGraphFreeParts(graph);
+    graph->nodes = compact.nodes;
+    graph->nNodes = nAlive;
+    graph->offsets = compact.offsets;
+    graph->dests = compact.dests;
+    graph->weights = compact.weights;
+    graph->cdf = compact.cdf;
+    graph->nEdges = compact.nEdges;
+    graph->nodeIndex = compact.nodeIndex;
+    graph->nodeVals = compact.nodeVals;
+    graph->nodeStates = compact.nodeStates;
+    return true;
 }
 
-MarkovGraphEdge** mkGraphNodePaths(const MarkovGraph* graph, const MarkovNode* node, size_t* count) {
-    if (!graph || !node || !count)
+MarkovGraphSCC* mkGraphSCC(const MarkovGraph* graph) {
+    if (!graph || !graph->offsets)
         return NULL;
 
-    // Pre-allocate the maximum number of edges
-    MarkovGraphEdge** paths = calloc(graph->nEdges, sizeof(MarkovGraphEdge*));
-    if (!paths) {
-        LOG_ERROR("Failed to allocate memory for node paths in mkGraphNodePaths, nEdges=");
-        printf("%lu\n", graph->nEdges);
+    const size_t nNodes = graph->nNodes;
+    MarkovGraphSCC* scc = calloc(1, sizeof(MarkovGraphSCC));
+    if (!scc) {
+        LOG_ERROR("malloc failed for MarkovGraphSCC");
+        return NULL;
+    }
+    scc->component = malloc(sizeof(size_t) * (nNodes + 1));
+    // Tarjan's algorithm, with an explicit call stack (node and next edge to follow) instead of recursion.
+    // A node with an index and without a component yet is on the node stack
+    size_t* index = malloc(sizeof(size_t) * (nNodes + 1));
+    size_t* low = malloc(sizeof(size_t) * (nNodes + 1));
+    size_t* stack = malloc(sizeof(size_t) * (nNodes + 1));
+    size_t* callNode = malloc(sizeof(size_t) * (nNodes + 1));
+    size_t* callEdge = malloc(sizeof(size_t) * (nNodes + 1));
+    if (!scc->component || !index || !low || !stack || !callNode || !callEdge) {
+        LOG_ERROR("malloc failed for the arrays of mkGraphSCC");
+        free(index);
+        free(low);
+        free(stack);
+        free(callNode);
+        free(callEdge);
+        mkGraphFreeSCC(&scc);
         return NULL;
     }
+    for (size_t i = 0; i < nNodes; i++) {
+        index[i] = SIZE_MAX;
+        scc->component[i] = SIZE_MAX;
+    }
 
-    *count = 0;
-    MarkovGraphEdge* edge = graph->edges[node->id];
-    while (edge) {
-        paths[*count] = edge;
-        (*count)++;
-        edge = edge->next;
+    size_t counter = 0, top = 0;
+    for (size_t root = 0; root < nNodes; root++) {
+        if (index[root] != SIZE_MAX)
+            continue;
+
+        size_t calls = 0;
+        index[root] = low[root] = counter++;
+        stack[top++] = root;
+        callNode[calls] = root;
+        callEdge[calls++] = graph->offsets[root];
+        while (calls > 0) {
+            const size_t node = callNode[calls - 1];
+            bool descended = false;
+            for (size_t e = callEdge[calls - 1]; e < graph->offsets[node + 1]; e++) {
+                const size_t dest = graph->dests[e];
+                if (graph->weights[e] <= 0.0)
+                    continue;
+                if (index[dest] == SIZE_MAX) {
+                    callEdge[calls - 1] = e + 1;
+                    index[dest] = low[dest] = counter++;
+                    stack[top++] = dest;
+                    callNode[calls] = dest;
+                    callEdge[calls++] = graph->offsets[dest];
+                    descended = true;
+                    break;
+                }
+                if (scc->component[dest] == SIZE_MAX && index[dest] < low[node])
+                    low[node] = index[dest];
+            }
+            if (descended)
+                continue;
+
+            // Every edge of the node was followed: it's the root of a component if nothing below reached higher
+            if (low[node] == index[node]) {
+                size_t member;
+                do {
+                    member = stack[--top];
+                    scc->component[member] = scc->nComponents;
+                } while (member != node);
+                scc->nComponents++;
+            }
+            calls--;
+            if (calls > 0 && low[node] < low[callNode[calls - 1]])
+                low[callNode[calls - 1]] = low[node];
+        }
+    }
+    free(index);
+    free(low);
+    free(stack);
+    free(callNode);
+    free(callEdge);
+
+    // A class is closed if no edge leaves it
+    scc->sizes = calloc(scc->nComponents + 1, sizeof(size_t));
+    scc->closed = malloc(sizeof(bool) * (scc->nComponents + 1));
+    if (!scc->sizes || !scc->closed) {
+        LOG_ERROR("malloc failed for the classes of mkGraphSCC");
+        mkGraphFreeSCC(&scc);
+        return NULL;
+    }
+    for (size_t c = 0; c < scc->nComponents; c++)
+        scc->closed[c] = true;
+    for (size_t i = 0; i < nNodes; i++) {
+        scc->sizes[scc->component[i]]++;
+        for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; e++) {
+            if (graph->weights[e] > 0.0 && scc->component[graph->dests[e]] != scc->component[i])
+                scc->closed[scc->component[i]] = false;
+        }
+    }
+    for (size_t c = 0; c < scc->nComponents; c++) {
+        if (scc->closed[c])
+            scc->nClosed++;
     }
 
-    // Shrink memory usage if possible
-    if (*count < graph->nEdges) {
-        MarkovGraphEdge** temp = realloc(paths, sizeof(MarkovGraphEdge*) * (*count));
-        if (!temp) {
-            LOG_WARNING("Failed to reallocate graph node paths with less memory");
-            return paths;
+    return scc;
+}
+
+void mkGraphFreeSCC(MarkovGraphSCC** scc) {
+    if (!scc || !(*scc))
+        return;
+
+    free((*scc)->component);
+    free((*scc)->sizes);
+    free((*scc)->closed);
+
+    free(*scc);
+    *scc = NULL;
+}
+
+/* ------------------------------------ ITERATIVE SOLVERS ------------------------------------ */
+// Below this many nodes, a single thread iterates faster than waking the workers every iteration
+static const size_t GRAPH_SOLVER_MIN_PARALLEL_NODES = (size_t)1 << 16;
+
+// In-edges of every node (the transposed CSR of the edges with weight > 0): the edges into node i are
+// [inOffsets[i], inOffsets[i+1]) of inSrcs (their origins) and inWeights
+typedef struct {
+    size_t* inOffsets;
+    size_t* inSrcs;
+    double* inWeights;
+} GraphInEdges;
+
+static void mkGraphFreeInEdges(GraphInEdges* in) {
+    free(in->inOffsets);
+    free(in->inSrcs);
+    free(in->inWeights);
+}
+
+// Counting sort of the edges by destination, in O(nodes + edges)
+static bool mkGraphInEdges(const MarkovGraph* graph, GraphInEdges* in) {
+    in->inOffsets = calloc(graph->nNodes + 2, sizeof(size_t));
+    in->inSrcs = malloc(sizeof(size_t) * (graph->nEdges + 1));
+    in->inWeights = malloc(sizeof(double) * (graph->nEdges + 1));
+    if (!in->inOffsets || !in->inSrcs || !in->inWeights) {
+        LOG_ERROR("malloc failed for the in-edges of the graph");
+        mkGraphFreeInEdges(in);
+        return false;
+    }
+
+    for (size_t e = 0; e < graph->nEdges; e++) {
+        if (graph->weights[e] > 0.0)
+            in->inOffsets[graph->dests[e] + 2]++;
+    }
+    for (size_t i = 2; i <= graph->nNodes + 1; i++)
+        in->inOffsets[i] += in->inOffsets[i - 1];
+    // inOffsets[i+1] is where the next in-edge of node i goes, and ends as the end of its in-edges
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; e++) {
+            if (graph->weights[e] <= 0.0)
+                continue;
+            const size_t pos = in->inOffsets[graph->dests[e] + 1]++;
+            in->inSrcs[pos] = i;
+            in->inWeights[pos] = graph->weights[e];
         }
-        paths = temp;
     }
+    return true;
+}
 
-    return paths;
+typedef struct {
+    const MarkovGraph* graph;
+    const GraphInEdges* in;
+    const double* x;
+    double* y;
+    // PageRank: y = base + damping * (x P)
+    double damping;
+    double base;
+    // Hitting times: nodes whose time is known (targets and the ones never surely reaching them)
+    const bool* fixed;
+    // residual of every thread
+    double* dist;
+} GraphSolverJob;
+
+static void mkGraphPageRankNodes(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    const GraphSolverJob* job = (const GraphSolverJob*)ctx;
+    const GraphInEdges* in = job->in;
+    double dist = 0.0;
+    for (size_t i = begin; i < end; i++) {
+        double sum = 0.0;
+        for (size_t e = in->inOffsets[i]; e < in->inOffsets[i + 1]; e++)
+            sum += in->inWeights[e] * job->x[in->inSrcs[e]];
+        job->y[i] = job->base + job->damping * sum;
+        dist += fabs(job->y[i] - job->x[i]);
+    }
+    job->dist[thread] = dist;
 }
 
-MarkovNode** mkGraphNeighbors(const MarkovGraph* graph, const MarkovNode* node, size_t* count) {
-    if (!graph || !node || !count)
-        return NULL;
-    if (!mkGraphHasNode(graph, node))
-        return NULL;
+// y = (I - Q) x, with Q the edges between the nodes that aren't fixed (x is 0 on the fixed ones, and y too)
+static void mkGraphHittingNodes(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    const GraphSolverJob* job = (const GraphSolverJob*)ctx;
+    const MarkovGraph* graph = job->graph;
+    (void)thread;
+    for (size_t i = begin; i < end; i++) {
+        if (job->fixed[i]) {
+            job->y[i] = 0.0;
+            continue;
+        }
+        double sum = job->x[i];
+        for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; e++) {
+            if (graph->weights[e] > 0.0)
+                sum -= graph->weights[e] * job->x[graph->dests[e]];
+        }
+        job->y[i] = sum;
+    }
+}
 
-    // Pre-allocate the maximum number of edges
-    MarkovNode** neighbors = calloc(graph->nNodes, sizeof(MarkovNode*));
-    *count = 0;
-    MarkovGraphEdge* edge = graph->edges[node->id];
-    while (edge) {
-        neighbors[*count] = edge->dest;
-        (*count)++;
-        edge = edge->next;
+// Run 'body' over every node, returning the sum of the residuals of the threads (-1 on error)
+static double mkGraphSolverStep(GraphSolverJob* job, ParallelBody body, const uint nThreads) {
+    const uint threads = (job->graph->nNodes < GRAPH_SOLVER_MIN_PARALLEL_NODES) ? 1 : nThreads;
+    const uint used = parallelFor(job->graph->nNodes, threads, body, job);
+    if (used == 0)
+        return -1.0;
+
+    double dist = 0.0;
+    for (uint t = 0; t < used; t++)
+        dist += job->dist[t];
+    return dist;
+}
+
+static double mkGraphDot(const double* a, const double* b, const size_t n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// Solve (I - Q) x = b over the nodes that aren't fixed with BiCGSTAB, which needs far fewer passes over the
+// edges than iterating x = b + Q x when walks take long to get to the targets. 'work' has 6 vectors of
+// nNodes. Restarts from the current x if it breaks down. Returns the iterations (maxIter if it didn't
+// converge), -1 on error
+static lli mkGraphBiCGStab(GraphSolverJob* job, const double* b, const double tol, const size_t maxIter,
+                           const uint nThreads, double* x, double* work) {
+    const size_t n = job->graph->nNodes;
+    double* r = work;
+    double* rHat = work + n;
+    double* p = work + 2 * n;
+    double* v = work + 3 * n;
+    double* sv = work + 4 * n;
+    double* t = work + 5 * n;
+    const double bNorm = sqrt(mkGraphDot(b, b, n));
+    if (bNorm == 0.0) {
+        memset(x, 0, sizeof(double) * n);
+        return 0;
     }
 
-    // Shrink memory block if used size is less than allocated
-    if (*count < graph->nNodes) {
-        MarkovNode** temp = realloc(neighbors, sizeof(MarkovNode*) * (*count));
-        if (!temp) {
-            LOG_WARNING("Failed to reallocate neighbors array with less size. Sending as it is");
-            return neighbors;
+    bool restart = true;
+    double rho = 1.0, alpha = 1.0, omega = 1.0;
+    for (size_t it = 0; it < maxIter; it++) {
+        if (restart) {
+            // r = b - A x
+            job->x = x;
+            job->y = r;
+            if (mkGraphSolverStep(job, mkGraphHittingNodes, nThreads) < 0.0)
+                return -1;
+            for (size_t i = 0; i < n; i++) {
+                r[i] = b[i] - r[i];
+                rHat[i] = r[i];
+                p[i] = v[i] = 0.0;
+            }
+            rho = alpha = omega = 1.0;
+            restart = false;
+        }
+
+        const double rhoNext = mkGraphDot(rHat, r, n);
+        if (rhoNext == 0.0 || omega == 0.0) {
+            restart = true;
+            continue;
+        }
+        const double beta = (rhoNext / rho) * (alpha / omega);
+        for (size_t i = 0; i < n; i++)
+            p[i] = r[i] + beta * (p[i] - omega * v[i]);
+
+        job->x = p;
+        job->y = v;
+        if (mkGraphSolverStep(job, mkGraphHittingNodes, nThreads) < 0.0)
+            return -1;
+        const double rHatV = mkGraphDot(rHat, v, n);
+        if (rHatV == 0.0) {
+            restart = true;
+            continue;
+        }
+        alpha = rhoNext / rHatV;
+        for (size_t i = 0; i < n; i++)
+            sv[i] = r[i] - alpha * v[i];
+        if (sqrt(mkGraphDot(sv, sv, n)) <= tol * bNorm) {
+            for (size_t i = 0; i < n; i++)
+                x[i] += alpha * p[i];
+            return (lli)it + 1;
         }
-        neighbors = temp;
+
+        job->x = sv;
+        job->y = t;
+        if (mkGraphSolverStep(job, mkGraphHittingNodes, nThreads) < 0.0)
+            return -1;
+        const double tt = mkGraphDot(t, t, n);
+        omega = (tt > 0.0) ? mkGraphDot(t, sv, n) / tt : 0.0;
+        for (size_t i = 0; i < n; i++) {
+            x[i] += alpha * p[i] + omega * sv[i];
+            r[i] = sv[i] - omega * t[i];
+        }
+        rho = rhoNext;
+        if (sqrt(mkGraphDot(r, r, n)) <= tol * bNorm)
+            return (lli)it + 1;
     }
+    return (lli)maxIter;
+}
 
-    return neighbors;
+lli mkGraphPageRank(const MarkovGraph* graph, const double damping, const double tol, const size_t maxIter,
+                    const uint nThreads, double* scoresOut) {
+    if (!graph || !graph->offsets || !scoresOut || graph->nNodes == 0 || damping < 0.0 || damping > 1.0)
+        return -1;
+
+    const size_t nNodes = graph->nNodes;
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    GraphInEdges in = {0};
+    double* next = malloc(sizeof(double) * nNodes);
+    double* outSums = malloc(sizeof(double) * nNodes);
+    double* dist = calloc(threads + 1, sizeof(double));
+    if (!next || !outSums || !dist || !mkGraphInEdges(graph, &in)) {
+        LOG_ERROR("malloc failed for the vectors of mkGraphPageRank");
+        free(next);
+        free(outSums);
+        free(dist);
+        return -1;
+    }
+    for (size_t i = 0; i < nNodes; i++) {
+        scoresOut[i] = 1.0 / (double)nNodes;
+        outSums[i] = 0.0;
+        for (size_t e = graph->offsets[i]; e < graph->offsets[i + 1]; e++) {
+            if (graph->weights[e] > 0.0)
+                outSums[i] += graph->weights[e];
+        }
+    }
+
+    GraphSolverJob job = {graph, &in, scoresOut, next, damping, 0.0, NULL, dist};
+    double* x = scoresOut;
+    lli iterations = -1;
+    bool ok = true;
+    for (size_t it = 0; it < maxIter; it++) {
+        // The teleport, and the mass of the nodes without (all of their) edges, go to every node alike
+        double lost = 0.0;
+        for (size_t i = 0; i < nNodes; i++) {
+            if (outSums[i] < 1.0)
+                lost += x[i] * (1.0 - outSums[i]);
+        }
+        job.x = x;
+        job.y = (x == scoresOut) ? next : scoresOut;
+        job.base = ((1.0 - damping) + damping * lost) / (double)nNodes;
+        const double residual = mkGraphSolverStep(&job, mkGraphPageRankNodes, threads);
+        if (residual < 0.0) {
+            ok = false;
+            break;
+        }
+        x = job.y;
+        if (residual <= tol) {
+            iterations = (lli)it + 1;
+            break;
+        }
+    }
+    if (x != scoresOut)
+        memcpy(scoresOut, x, sizeof(double) * nNodes);
+    if (ok && iterations == -1) {
+        LOG_WARNING("PageRank didn't converge in mkGraphPageRank");
+        iterations = (lli)maxIter;
+    }
+
+    mkGraphFreeInEdges(&in);
+    free(next);
+    free(outSums);
+    free(dist);
+    return (ok) ? iterations : -1;
 }
 
-size_t* mkGraphFindDisconnected(const MarkovGraph* graph, size_t* count) {
-    if (!graph)
-        return NULL;
+// Mark in 'marked' every node that reaches one of the nodes already marked through the edges with weight > 0
+// (BFS over the in-edges), without going through the nodes in 'blocked' (can be NULL)
+static bool mkGraphReachBackwards(const MarkovGraph* graph, const GraphInEdges* in, const bool* blocked, bool* marked) {
+    size_t* queue = malloc(sizeof(size_t) * (graph->nNodes + 1));
+    if (!queue) {
+        LOG_ERROR("malloc failed for the queue of the graph search");
+        return false;
+    }
 
-    bool* visited = calloc(graph->nNodes, sizeof(bool));
-    // BFS in graph to find all visited nodes
-    // Only mark as visited those nodes that are destinies from other states,
-    // and whose paths probabilities (weights) are bigger than 0.0
+    size_t head = 0, tail = 0;
     for (size_t i = 0; i < graph->nNodes; i++) {
-        MarkovGraphEdge* edge = graph->edges[i];
-        while (edge) {
-            if (edge->dest && (edge->weight > 1e-3))
-                visited[edge->dest->id] = true;
-            edge = edge->next;
+        if (marked[i])
+            queue[tail++] = i;
+    }
+    while (head < tail) {
+        const size_t node = queue[head++];
+        for (size_t e = in->inOffsets[node]; e < in->inOffsets[node + 1]; e++) {
+            const size_t src = in->inSrcs[e];
+            if (!marked[src] && !(blocked && blocked[src])) {
+                marked[src] = true;
+                queue[tail++] = src;
+            }
         }
     }
+    free(queue);
+    return true;
+}
 
-    // In the end, the disconnected nodes will be those that weren't visited
-    size_t* disconnected = malloc(graph->nNodes * sizeof(size_t));
-    for (size_t i = 0; i < graph->nNodes; i++) {
-        if (!visited[i]) {
-            disconnected[*count] = i;
-            (*count)++;
+lli mkGraphHittingTimes(const MarkovGraph* graph, const size_t* targets, const size_t nTargets, const double tol,
+                        const size_t maxIter, const uint nThreads, double* timesOut) {
+    if (!graph || !graph->offsets || !targets || nTargets == 0 || !timesOut)
+        return -1;
+
+    const size_t nNodes = graph->nNodes;
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    GraphInEdges in = {0};
+    bool* isTarget = calloc(nNodes + 1, sizeof(bool));
+    bool* reaches = calloc(nNodes + 1, sizeof(bool));
+    bool* fixed = calloc(nNodes + 1, sizeof(bool));
+    double* next = malloc(sizeof(double) * (nNodes + 1));
+    double* work = malloc(sizeof(double) * (6 * nNodes + 1));
+    double* dist = calloc(threads + 1, sizeof(double));
+    bool ok = isTarget && reaches && fixed && next && work && dist && mkGraphInEdges(graph, &in);
+    if (!ok)
+        LOG_ERROR("malloc failed for the vectors of mkGraphHittingTimes");
+
+    // The time is finite only from the nodes that reach a target with probability 1: the ones that can't
+    // get (avoiding the targets) to a node from which no target can be reached
+    for (size_t t = 0; ok && t < nTargets; t++) {
+        if (targets[t] >= nNodes) {
+            LOG_ERROR("Target node out of the graph in mkGraphHittingTimes");
+            ok = false;
+            break;
         }
+        isTarget[targets[t]] = true;
+        reaches[targets[t]] = true;
+    }
+    ok = ok && mkGraphReachBackwards(graph, &in, NULL, reaches);
+    for (size_t i = 0; ok && i < nNodes; i++)
+        fixed[i] = !reaches[i];
+    ok = ok && mkGraphReachBackwards(graph, &in, isTarget, fixed);
+
+    lli iterations = -1;
+    if (ok) {
+        // Times from the other nodes solve h = 1 + Q h, with Q the edges between them
+        for (size_t i = 0; i < nNodes; i++) {
+            fixed[i] = fixed[i] || isTarget[i];
+            next[i] = (fixed[i]) ? 0.0 : 1.0;
+            timesOut[i] = 0.0;
+        }
+        GraphSolverJob job = {graph, &in, NULL, NULL, 0.0, 0.0, fixed, dist};
+        iterations = mkGraphBiCGStab(&job, next, tol, maxIter, threads, timesOut, work);
+        if (iterations == (lli)maxIter)
+            LOG_WARNING("Hitting times didn't converge in mkGraphHittingTimes");
+        for (size_t i = 0; i < nNodes; i++) {
+            if (fixed[i])
+                timesOut[i] = (isTarget[i]) ? 0.0 : INFINITY;
+        }
+        ok = (iterations != -1);
     }
 
-    if (*count == 0) {
-        free(visited);
-        return NULL;
+    mkGraphFreeInEdges(&in);
+    free(isTarget);
+    free(reaches);
+    free(fixed);
+    free(next);
+    free(work);
+    free(dist);
+    return (ok) ? iterations : -1;
+}
+
+double mkGraphReturnTime(const MarkovGraph* graph, const size_t target, const double tol, const size_t maxIter,
+                         const uint nThreads) {
+    if (!graph || !graph->offsets || target >= graph->nNodes)
+        return -1.0;
+
+    double* times = malloc(sizeof(double) * (graph->nNodes + 1));
+    if (!times) {
+        LOG_ERROR("malloc failed for the hitting times of mkGraphReturnTime");
+        return -1.0;
+    }
+    if (mkGraphHittingTimes(graph, &target, 1, tol, maxIter, nThreads, times) == -1) {
+        free(times);
+        return -1.0;
     }
 
-    // shrink memory if possible
-    if (*count < graph->nNodes) {
-        size_t* temp = realloc(disconnected, sizeof(size_t) * (*count));
-        if (!temp)
-            LOG_WARNING("Couldn't resize disconnected array with less memory in mkGraphFindDisconnected");
+    // One step out of the target, then the time to hit it again from where it went
+    double total = 0.0, mass = 0.0;
+    for (size_t e = graph->offsets[target]; e < graph->offsets[target + 1]; e++) {
+        if (graph->weights[e] > 0.0) {
+            total += graph->weights[e] * times[graph->dests[e]];
+            mass += graph->weights[e];
+        }
+    }
+    free(times);
+    return (mass > 0.0) ? 1.0 + total : INFINITY;
+}
+/* ------------------------------------------------------------------------------------------- */
+
+// Edge of the node 'pos' chosen by the number r in [0, 1): the first one whose cumulative weight reaches r
+// (by binary search), or the number of edges of the node if there's none
+static inline size_t mkGraphChooseEdge(const MarkovGraph* graph, const size_t pos, const double r) {
+    const double* cdf = graph->cdf + graph->offsets[pos];
+    size_t lo = 0, hi = graph->offsets[pos + 1] - graph->offsets[pos];
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < r)
+            lo = mid + 1;
         else
-            disconnected = temp;
+            hi = mid;
     }
-
-    free(visited);
-    return disconnected;
+    return lo;
 }
 
-void mkGraphRandWalk(const MarkovGraph* graph, const int* lastState, const size_t steps, int* stopOut,
+void mkGraphRandWalk(const MarkovGraph* graph, const int* lastState, const size_t steps, Rng* rng, int* stopOut,
                      double* probsOut) {
     // Random walk on the Markov Graph will provide a way to predict next states
-    if (!graph || !lastState || !stopOut)
+    if (!graph || !lastState || !rng || !stopOut)
+        return;
+    if (!graph->offsets) {
+        LOG_ERROR("The graph has no transitions in mkGraphRandWalk");
         return;
+    }
 
     lli lastID = mkGraphIdState(graph, lastState);
     if (lastID == -1) {
@@ -393,68 +1079,385 @@ void mkGraphRandWalk(const MarkovGraph* graph, const int* lastState, const size_
         return;
     }
 
-    MarkovNode* pos = mkGraphGetNode(graph, lastID);
+    size_t pos = (size_t)lastID;
     for (size_t step = 0; step < steps; step++) {
-        size_t nPaths = 0;
-        MarkovGraphEdge** paths = mkGraphNodePaths(graph, pos, &nPaths);
-
-        // choose path by cumulative probability
-        double r = rand01_d();
-        double cumProb = 0.0;
-        for (size_t p = 0; p < nPaths; p++) {
-            if (!paths[p]->dest)
-                continue;
-            cumProb += paths[p]->weight;
-            if (r <= cumProb) {
-                pos = paths[p]->dest;
-                if (probsOut)
-                    probsOut[step] = cumProb;
-                break;
-            }
+        // choose path by cumulative probability, walking the node's edges in place
+        const size_t edge = mkGraphChooseEdge(graph, pos, rngUnit_d(rng));
+        if (edge < graph->offsets[pos + 1] - graph->offsets[pos]) {
+            const size_t e = graph->offsets[pos] + edge;
+            pos = graph->dests[e];
+            if (probsOut)
+                probsOut[step] = graph->cdf[e];
         }
 
         // The predicted value will be the last value of the new position
-        stopOut[step] = pos->state[pos->order - 1];
+        stopOut[step] = graph->nodes[pos].state[graph->order - 1];
+    }
+}
+
+// Mixed into the seed of the walkers
+static const uint64_t GRAPH_WALKERS_SALT = 0x4D4B47524150484CULL;
+
+MarkovWalkers* mkGraphWalkersInit(const MarkovGraph* graph, const int* lastState, const size_t nWalkers,
+                                  const uint64_t seed) {
+    if (!graph || !lastState || nWalkers == 0)
+        return NULL;
+    if (!graph->offsets) {
+        LOG_ERROR("The graph has no transitions in mkGraphWalkersInit");
+        return NULL;
+    }
+
+    const lli lastID = mkGraphIdState(graph, lastState);
+    if (lastID == -1) {
+        LOG_ERROR("Couldn't id last state in mkGraphWalkersInit: ");
+        printArr_i(lastState, graph->order);
+        return NULL;
+    }
 
-        free(paths);
+    MarkovWalkers* walkers = calloc(1, sizeof(MarkovWalkers));
+    if (!walkers) {
+        LOG_ERROR("malloc failed for MarkovWalkers");
+        return NULL;
+    }
+    walkers->nWalkers = nWalkers;
+    walkers->nodes = malloc(sizeof(size_t) * nWalkers);
+    walkers->seeds = malloc(sizeof(uint64_t) * nWalkers);
+    walkers->valIds = malloc(sizeof(size_t) * (graph->nNodes + 1));
+    if (!walkers->nodes || !walkers->seeds || !walkers->valIds) {
+        LOG_ERROR("malloc failed for the walkers arrays");
+        mkGraphWalkersFree(&walkers);
+        return NULL;
+    }
+
+    // salted, so the walkers don't replay the paths markovMonteCarlo samples with the same seed
+    const uint64_t walkSeed = splitmix64(seed ^ GRAPH_WALKERS_SALT);
+    for (size_t w = 0; w < nWalkers; w++) {
+        walkers->nodes[w] = (size_t)lastID;
+        walkers->seeds[w] = splitmix64(walkSeed ^ splitmix64(w));
+    }
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        const lli valID = markovIdValState(graph->states, graph->nodes[i].state[graph->order - 1]);
+        walkers->valIds[i] = (valID == -1) ? 0 : (size_t)valID;
     }
+    return walkers;
 }
 
-void mkGraphExport(const MarkovGraph* graph, const char* file) {
-    if (!graph || !file)
+void mkGraphWalkersFree(MarkovWalkers** walkers) {
+    if (!walkers || !(*walkers))
         return;
 
-    FILE* out = fopen(file, "w");
-    if (!out) {
-        LOG_ERROR("Unable to open file to export graph");
+    free((*walkers)->nodes);
+    free((*walkers)->seeds);
+    free((*walkers)->valIds);
+
+    free(*walkers);
+    *walkers = NULL;
+}
+
+void mkGraphWalkersStep(const MarkovGraph* graph, MarkovWalkers* walkers, size_t* counts) {
+    if (!graph || !graph->offsets || !walkers)
         return;
+
+    size_t* nodes = walkers->nodes;
+    const uint64_t* seeds = walkers->seeds;
+    const uint64_t step = walkers->step;
+    for (size_t w = 0; w < walkers->nWalkers; w++) {
+        const size_t pos = nodes[w];
+        const size_t edge = mkGraphChooseEdge(graph, pos, hashUnit_d(seeds[w], step));
+        if (edge < graph->offsets[pos + 1] - graph->offsets[pos])
+            nodes[w] = graph->dests[graph->offsets[pos] + edge];
+        if (counts)
+            counts[walkers->valIds[nodes[w]]]++;
+    }
+    walkers->step++;
+}
+
+bool mkGraphWalkMarginals(const MarkovGraph* graph, const int* lastState, const size_t steps, const size_t nWalkers,
+                          const uint64_t seed, double* marginalsOut) {
+    if (!graph || !marginalsOut)
+        return false;
+
+    MarkovWalkers* walkers = mkGraphWalkersInit(graph, lastState, nWalkers, seed);
+    if (!walkers)
+        return false;
+    size_t* counts = malloc(sizeof(size_t) * (graph->nVals + 1));
+    if (!counts) {
+        LOG_ERROR("malloc failed for value counts in mkGraphWalkMarginals");
+        mkGraphWalkersFree(&walkers);
+        return false;
     }
 
-    char stateStr[256] = {'\0'};
-    char nextStr[256] = {'\0'};
+    for (size_t s = 0; s < steps; s++) {
+        memset(counts, 0, sizeof(size_t) * graph->nVals);
+        mkGraphWalkersStep(graph, walkers, counts);
+        for (size_t v = 0; v < graph->nVals; v++)
+            marginalsOut[s * graph->nVals + v] = (double)counts[v] / (double)nWalkers;
+    }
+
+    free(counts);
+    mkGraphWalkersFree(&walkers);
+    return true;
+}
 
-    fprintf(out, "digraph G {\n");
+// Buffered output of the exporters: text is formatted straight into the buffer, which is written
+// to the file when full
+#define GRAPH_EXPORT_BUFFER ((size_t)1 << 20)
+typedef struct {
+    FILE* out;
+    char* buf;
+    size_t len;
+    bool ok;
+} GraphWriter;
+
+static void mkGraphFlush(GraphWriter* w) {
+    if (w->ok && w->len > 0 && fwrite(w->buf, 1, w->len, w->out) != w->len)
+        w->ok = false;
+    w->len = 0;
+}
+
+// Make room for 'size' more bytes in the buffer
+static inline char* mkGraphReserve(GraphWriter* w, const size_t size) {
+    if (w->len + size > GRAPH_EXPORT_BUFFER)
+        mkGraphFlush(w);
+    return w->buf + w->len;
+}
+
+static void mkGraphPut(GraphWriter* w, const void* data, const size_t size) {
+    if (size > GRAPH_EXPORT_BUFFER) {
+        mkGraphFlush(w);
+        if (w->ok && fwrite(data, 1, size, w->out) != size)
+            w->ok = false;
+        return;
+    }
+    memcpy(mkGraphReserve(w, size), data, size);
+    w->len += size;
+}
+
+static inline void mkGraphPutStr(GraphWriter* w, const char* str) {
+    mkGraphPut(w, str, strlen(str));
+}
+
+static inline void mkGraphPutUint(GraphWriter* w, uint64_t x) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + x % 10);
+        x /= 10;
+    } while (x > 0);
+    char* dst = mkGraphReserve(w, n);
+    for (size_t k = 0; k < n; k++)
+        dst[k] = digits[n - 1 - k];
+    w->len += n;
+}
+
+static inline void mkGraphPutInt(GraphWriter* w, const int x) {
+    if (x < 0) {
+        mkGraphPut(w, "-", 1);
+        mkGraphPutUint(w, (uint64_t)(-(int64_t)x));
+    }
+    else
+        mkGraphPutUint(w, (uint64_t)x);
+}
+
+static inline void mkGraphPutDouble(GraphWriter* w, const char* fmt, const double x) {
+    char* dst = mkGraphReserve(w, 32);
+    const int n = snprintf(dst, 32, fmt, x);
+    if (n > 0)
+        w->len += (n < 32) ? (size_t)n : 31;
+}
+
+// Write the values of a state one after the other
+static void mkGraphWriteState(GraphWriter* w, const int* state, const uint order) {
+    for (uint s = 0; s < order; s++)
+        mkGraphPutInt(w, state[s]);
+}
+
+// Edges of a node that pass the filters of the export, in sel: the ones with weight >= minWeight (all of them
+// if minWeight <= 0), and, with topK > 0, only the topK heaviest of those (ties keep the order of the
+// edges). Selected edges keep the order they have in the graph. Returns how many there are
+static size_t mkGraphSelectEdges(const MarkovGraph* graph, const size_t node, const size_t topK, const double minWeight,
+                                 size_t* sel) {
+    size_t n = 0;
+    for (size_t e = graph->offsets[node]; e < graph->offsets[node + 1]; e++) {
+        if (minWeight <= 0.0 || graph->weights[e] >= minWeight)
+            sel[n++] = e;
+    }
+    if (topK == 0 || n <= topK)
+        return n;
+
+    // Partial selection sort: the first topK positions get the heaviest edges, then back in edge order
+    for (size_t k = 0; k < topK; k++) {
+        size_t best = k;
+        for (size_t c = k + 1; c < n; c++) {
+            const double wc = graph->weights[sel[c]], wb = graph->weights[sel[best]];
+            if (wc > wb || (wc == wb && sel[c] < sel[best]))
+                best = c;
+        }
+        const size_t tmp = sel[k];
+        sel[k] = sel[best];
+        sel[best] = tmp;
+    }
+    for (size_t k = 1; k < topK; k++) {
+        const size_t e = sel[k];
+        size_t c = k;
+        for (; c > 0 && sel[c - 1] > e; c--)
+            sel[c] = sel[c - 1];
+        sel[c] = e;
+    }
+    return topK;
+}
+
+// Most edges any node has
+static size_t mkGraphMaxDegree(const MarkovGraph* graph) {
+    size_t maxDegree = 0;
     for (size_t i = 0; i < graph->nNodes; i++) {
-        MarkovGraphEdge* edge = graph->edges[i];
-        while (edge && edge->dest) {
-            for (size_t s = 0; s < graph->order; s++) {
-                sprintf(stateStr, "%s%d", stateStr, edge->orig->state[s]);
-                sprintf(nextStr, "%s%d", nextStr, edge->dest->state[s]);
-            }
-            stateStr[graph->order] = '\0';
-            nextStr[graph->order] = '\0';
+        const size_t degree = graph->offsets[i + 1] - graph->offsets[i];
+        if (degree > maxDegree)
+            maxDegree = degree;
+    }
+    return maxDegree;
+}
 
-            fprintf(out, "    \"%s\" -> \"%s\" [label=\"%.2f\"];\n", stateStr, nextStr, edge->weight);
+static void mkGraphExportDot(const MarkovGraph* graph, GraphWriter* w, const size_t topK, const double minWeight,
+                             size_t* sel) {
+    mkGraphPutStr(w, "digraph G {\n");
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        const size_t n = mkGraphSelectEdges(graph, i, topK, minWeight, sel);
+        for (size_t k = 0; k < n; k++) {
+            const size_t e = sel[k];
+            mkGraphPutStr(w, "    \"");
+            mkGraphWriteState(w, graph->nodes[i].state, graph->order);
+            mkGraphPutStr(w, "\" -> \"");
+            mkGraphWriteState(w, graph->nodes[graph->dests[e]].state, graph->order);
+            mkGraphPutStr(w, "\" [label=\"");
+            mkGraphPutDouble(w, "%.2f", graph->weights[e]);
+            mkGraphPutStr(w, "\"];\n");
+        }
+    }
+    mkGraphPutStr(w, "}\n");
+}
+
+static void mkGraphExportCsv(const MarkovGraph* graph, GraphWriter* w, const size_t topK, const double minWeight,
+                             size_t* sel) {
+    mkGraphPutStr(w, "from,to,value,weight\n");
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        const uint64_t from = (uint64_t)mkGraphNodeStateId(graph, i);
+        const size_t n = mkGraphSelectEdges(graph, i, topK, minWeight, sel);
+        for (size_t k = 0; k < n; k++) {
+            const size_t e = sel[k];
+            const size_t dest = graph->dests[e];
+            mkGraphPutUint(w, from);
+            mkGraphPut(w, ",", 1);
+            mkGraphPutUint(w, (uint64_t)mkGraphNodeStateId(graph, dest));
+            mkGraphPut(w, ",", 1);
+            mkGraphPutInt(w, graph->nodes[dest].state[graph->order - 1]);
+            mkGraphPut(w, ",", 1);
+            mkGraphPutDouble(w, "%.17g", graph->weights[e]);
+            mkGraphPut(w, "\n", 1);
+        }
+    }
+}
 
-            edge = edge->next;
+// Edges of node i left by the filters, none if the graph has no edges
+static inline size_t mkGraphExportedEdges(const MarkovGraph* graph, const size_t i, const size_t topK,
+                                          const double minWeight, size_t* sel) {
+    return (graph->offsets) ? mkGraphSelectEdges(graph, i, topK, minWeight, sel) : 0;
+}
 
-            memset(stateStr, '\0', 256);
-            memset(nextStr, '\0', 256);
+static void mkGraphExportBinary(const MarkovGraph* graph, GraphWriter* w, const size_t topK, const double minWeight,
+                                size_t* sel) {
+    // The number of edges left by the filters goes in the header, so they are counted first
+    uint64_t nEdges = 0;
+    for (size_t i = 0; i < graph->nNodes; i++)
+        nEdges += mkGraphExportedEdges(graph, i, topK, minWeight, sel);
+
+    GraphFileHeader header = {0};
+    memcpy(header.magic, GRAPH_FILE_MAGIC, sizeof(header.magic));
+    header.version = GRAPH_FILE_VERSION;
+    header.byteOrder = GRAPH_FILE_BYTE_ORDER;
+    header.order = graph->order;
+    header.nVals = graph->nVals;
+    header.nNodes = graph->nNodes;
+    header.nEdges = nEdges;
+    mkGraphPut(w, &header, sizeof(header));
+
+    for (size_t v = 0; v < graph->nVals; v++) {
+        const int32_t val = graph->vals[v];
+        mkGraphPut(w, &val, sizeof(val));
+    }
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        const uint64_t stateID = (uint64_t)mkGraphNodeStateId(graph, i);
+        mkGraphPut(w, &stateID, sizeof(stateID));
+    }
+    uint64_t offset = 0;
+    mkGraphPut(w, &offset, sizeof(offset));
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        offset += mkGraphExportedEdges(graph, i, topK, minWeight, sel);
+        mkGraphPut(w, &offset, sizeof(offset));
+    }
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        const size_t n = mkGraphExportedEdges(graph, i, topK, minWeight, sel);
+        for (size_t k = 0; k < n; k++) {
+            const uint64_t dest = graph->dests[sel[k]];
+            mkGraphPut(w, &dest, sizeof(dest));
         }
     }
-    fprintf(out, "}\n");
+    for (size_t i = 0; i < graph->nNodes; i++) {
+        const size_t n = mkGraphExportedEdges(graph, i, topK, minWeight, sel);
+        for (size_t k = 0; k < n; k++)
+            mkGraphPut(w, &graph->weights[sel[k]], sizeof(double));
+    }
+}
 
-    fclose(out);
+bool mkGraphExportAs(const MarkovGraph* graph, const char* file, const GraphExportFormat format, const size_t topK,
+                     const double minWeight) {
+    if (!graph || !file)
+        return false;
+
+    FILE* out = fopen(file, (format == GRAPH_EXPORT_BINARY) ? "wb" : "w");
+    if (!out) {
+        LOG_ERROR("Unable to open file to export graph");
+        return false;
+    }
+    GraphWriter w = {out, malloc(GRAPH_EXPORT_BUFFER), 0, true};
+    size_t* sel = malloc(sizeof(size_t) * (((graph->offsets) ? mkGraphMaxDegree(graph) : 0) + 1));
+    if (!w.buf || !sel) {
+        LOG_ERROR("malloc failed for the buffers of mkGraphExportAs");
+        free(w.buf);
+        free(sel);
+        fclose(out);
+        return false;
+    }
+
+    // a graph without edges still gets an empty export (binary files keep their header, nodes and offsets)
+    if (format == GRAPH_EXPORT_BINARY)
+        mkGraphExportBinary(graph, &w, topK, minWeight, sel);
+    else if (!graph->offsets) {
+        if (format == GRAPH_EXPORT_DOT)
+            mkGraphPutStr(&w, "digraph G {\n}\n");
+        else if (format == GRAPH_EXPORT_CSV)
+            mkGraphPutStr(&w, "from,to,value,weight\n");
+    }
+    else if (format == GRAPH_EXPORT_CSV)
+        mkGraphExportCsv(graph, &w, topK, minWeight, sel);
+    else
+        mkGraphExportDot(graph, &w, topK, minWeight, sel);
+    mkGraphFlush(&w);
+
+    free(w.buf);
+    free(sel);
+    if (fclose(out) != 0)
+        w.ok = false;
+    if (!w.ok) {
+        LOG_ERROR("Unable to write the graph export to ");
+        fprintf(stderr, "%s\n", file);
+        return false;
+    }
     LOG_INFO("Graph exported to ");
     fprintf(stderr, "%s\n", file);
+    return true;
+}
+
+void mkGraphExport(const MarkovGraph* graph, const char* file) {
+    mkGraphExportAs(graph, file, GRAPH_EXPORT_DOT, 0, 0.0);
 }
@@ -16,63 +16,187 @@ typedef struct {
     int* state;
 } MarkovNode;
 
-MarkovNode* mkNodeInit(const size_t id, const uint order, int* state);
-void mkNodeFree(MarkovNode** node);
 size_t mkNodeId(const MarkovNode* node);
 int* mkNodeState(const MarkovNode* node);
 /* ----------------------------------------------------------------------- */
 
-/* ----------------------------- MARKOV EDGE ----------------------------- */
-// MarkovEdge represents each directed connection in the graph (orig->dest) with an
-// associated weight. It's also a node of a linked list, so it has a pointer to a 'next' edge
-// The associated weight is the probability of the state 'orig' to go to the state 'dest'
-typedef struct edge {
-    MarkovNode* orig;
-    MarkovNode* dest;
-    double weight;
-    struct edge* next;
-} MarkovGraphEdge;
-
-MarkovGraphEdge* mkEdgeInit(MarkovNode* orig, MarkovNode* dest, double weight);
-void mkEdgeFree(MarkovGraphEdge** edge);
-void mkEdgeEnds(const MarkovGraphEdge* edge, MarkovNode** orig, MarkovNode** dest);
-double mkEdgeWeight(const MarkovGraphEdge* edge);
-/* ----------------------------------------------------------------------- */
-
 /* ----------------------------- MARKOV GRAPH ----------------------------- */
 // MarkovGraph is the graph containing all nodes with different states
 // Every node is connected to a different state, and the weight associated with
 // that edge is the probability.
+//
+// Nodes are kept in one array (node i has id i), and their out-edges in CSR layout: the edges of
+// node i are [offsets[i], offsets[i+1]) of 'dests' (node ids), 'weights' and 'cdf' (the cumulative
+// weights of the node's edges, so a walk chooses its next edge by binary search). Edges are built in
+// a single pass over the transition matrix, and every traversal is a scan of contiguous arrays.
+//
+// With lazy states, the graph only has nodes for the states observed in the transition matrix
+// (and the states they go to): 'nodeIndex' maps a state id to its node id, 'nodeStates' a node id to
+// its state id, and the states of the nodes are decoded in 'nodeVals' (order values per node).
+// A compacted graph (see mkGraphCompact) also has its own node ids, in 'nodeIndex' and 'nodeStates'.
+// Building the transitions of a graph with a 'nodeIndex' adds nodes for the observed states only
 #define GRAPH_BUCKET_SIZE 100
 typedef struct {
-    MarkovGraphEdge** edges;
+    MarkovNode* nodes;
     size_t nNodes;
+
+    size_t* offsets;
+    size_t* dests;
+    double* weights;
+    double* cdf;
     size_t nEdges;
 
     uint order;
     int* vals;
     size_t nVals;
+    // states the graph was built from, used to id states by their encoding
+    const MarkovState* states;
+
+    // Lazy states or compacted graphs only (NULL otherwise, node ids are the state ids)
+    HashMap* nodeIndex;
+    size_t* nodeStates;
+    int* nodeVals; // lazy states only
 } MarkovGraph;
 
 MarkovGraph* mkGraphInit(const MarkovState* states);
 void mkGraphFree(MarkovGraph** graph);
+// Build the edges of every node from the matrix (replacing the ones the graph had)
 void mkGraphBuildTransitions(MarkovGraph* graph, const TransitionMatrix* tm);
 MarkovNode* mkGraphGetNode(const MarkovGraph* graph, size_t id);
 bool mkGraphHasNode(const MarkovGraph* graph, const MarkovNode* node);
 lli mkGraphIdState(const MarkovGraph* graph, const int* state);
-MarkovGraphEdge* mkGraphAddEdge(MarkovGraph* graph, MarkovNode* orig, MarkovNode* dest, double weight);
 void mkGraphNodes(const MarkovGraph* graph, MarkovNode** outNodes);
-void mkGraphEdges(const MarkovGraph* graph, MarkovGraphEdge** outEdges);
-MarkovGraphEdge** mkGraphNodePaths(const MarkovGraph* graph, const MarkovNode* node, size_t* count);
-MarkovNode** mkGraphNeighbors(const MarkovGraph* graph, const MarkovNode* node, size_t* count);
+// Out-edges of a node: returns their number, with their destination node ids in *dests and their
+// weights in *weights (pointers into the graph)
+size_t mkGraphOutEdges(const MarkovGraph* graph, const size_t nodeID, const size_t** dests, const double** weights);
 
-// Use BFS to find any disconnected nodes, which can be removed to improve performance
+// Nodes that no edge goes to with a weight above 0.001 (returns NULL if there are none). For the nodes a walk
+// can actually visit, use mkGraphReachable
 size_t* mkGraphFindDisconnected(const MarkovGraph* graph, size_t* count);
 
-void mkGraphRandWalk(const MarkovGraph* graph, const int* lastState, const size_t steps, int* stopOut, double* probsOut);
+// Nodes reachable from the node 'start' through edges with weight > 0, by BFS over the CSR edges
+// (O(nodes + edges)): reachedOut[i] (nNodes) tells whether node i is reached. Returns how many are
+// (start included), 0 on error
+size_t mkGraphReachable(const MarkovGraph* graph, const size_t start, bool* reachedOut);
+
+// State id of a node (-1 if the node isn't in the graph)
+lli mkGraphNodeStateId(const MarkovGraph* graph, const size_t nodeID);
+
+// Compact the graph in place to the part a forecast can visit: drop the edges with weight 0 or below
+// minWeight (the edges left of each node are renormalized), and, with nStarts > 0, every node not
+// reachable from the nodes 'starts' through the edges left. The survivors are renumbered densely (in
+// their previous order), with nodeStates mapping them back to their state ids and nodeIndex the other
+// way, so walks, searches and exports only go through the live part of the chain. States without a
+// node anymore can't start a walk. Returns false on error (the graph is left unchanged)
+bool mkGraphCompact(MarkovGraph* graph, const double minWeight, const size_t* starts, const size_t nStarts);
+
+// Strongly connected components of the graph over the edges with weight > 0, which are the communicating
+// classes of the chain. A class is closed when no edge leaves it: once a walk enters it, it stays there
+// forever (an absorbing class; a closed class of one node is an absorbing state). Every other class is
+// transient, walks eventually leave it for good.
+// Components are numbered in reverse topological order (a class only has edges to classes with lower
+// numbers), so closed classes are found before the classes that lead to them
+typedef struct {
+    size_t nComponents;
+    size_t* component; // component of each node
+    size_t* sizes;     // nodes in each component
+    bool* closed;      // whether each component is closed (absorbing) or transient
+    size_t nClosed;
+} MarkovGraphSCC;
+
+// Tarjan's algorithm, without recursion, in O(nodes + edges). Returns NULL on error
+MarkovGraphSCC* mkGraphSCC(const MarkovGraph* graph);
+void mkGraphFreeSCC(MarkovGraphSCC** scc);
+
+// Walk 'steps' edges from the node of lastState, choosing each edge by its probability with 'rng'.
+// Nothing is allocated: each step reads the edges of the node in place
+void mkGraphRandWalk(const MarkovGraph* graph, const int* lastState, const size_t steps, Rng* rng, int* stopOut,
+                     double* probsOut);
+
+// Many walkers advanced in lockstep over structure-of-arrays state: 'nodes' has the node of every walker
+// and 'seeds' its random stream (its number of step t is hashUnit_d(seeds[w], t)), so a step is one pass
+// over contiguous arrays and a walker's path doesn't depend on how many walkers there are.
+// 'valIds' has the value id of the last value of each node. Walkers on a node without edges stay there
+typedef struct {
+    size_t nWalkers;
+    size_t* nodes;
+    uint64_t* seeds;
+    uint64_t step;
+    size_t* valIds;
+} MarkovWalkers;
+
+// nWalkers walkers on the node of lastState, walker w with the stream (seed, w), salted so it differs from
+// the paths of markovMonteCarlo with the same seed. Returns NULL on error
+MarkovWalkers* mkGraphWalkersInit(const MarkovGraph* graph, const int* lastState, const size_t nWalkers,
+                                  const uint64_t seed);
+void mkGraphWalkersFree(MarkovWalkers** walkers);
+// Move every walker one edge, adding to counts[v] (nVals counts, if not NULL) the walkers whose new
+// node ends with vals[v]
+void mkGraphWalkersStep(const MarkovGraph* graph, MarkovWalkers* walkers, size_t* counts);
+// Distribution of the next 'steps' values from nWalkers walks: marginalsOut[s*nVals + v] is the
+// fraction of walkers whose node at step s ends with vals[v]. Returns false on error
+bool mkGraphWalkMarginals(const MarkovGraph* graph, const int* lastState, const size_t steps, const size_t nWalkers,
+                          const uint64_t seed, double* marginalsOut);
+
+// Iterative solvers over the edge arrays, split across 'nThreads' threads (0 uses every core). Each
+// iteration is one or two passes over the edges; they stop when the residual is <= tol or after maxIter
+// iterations (with a warning). They return the number of iterations, or -1 on error
+#define GRAPH_SOLVER_TOLERANCE 1e-10
+#define GRAPH_SOLVER_MAX_ITERATIONS 100000
+#define GRAPH_PAGERANK_DAMPING 0.85
+
+// PageRank of every node in scoresOut (nNodes, adding up to 1): the long-run share of time of a walk that
+// follows an edge with probability 'damping' and jumps to any node otherwise (and always from the nodes
+// without edges). With damping 1 it's the stationary distribution of the walk. The residual is the L1
+// change of the scores
+lli mkGraphPageRank(const MarkovGraph* graph, const double damping, const double tol, const size_t maxIter,
+                    const uint nThreads, double* scoresOut);
+// Expected number of steps from every node until a walk first gets to one of the nodes 'targets', in timesOut
+// (nNodes, 0 for the targets). It's INFINITY from the nodes whose walks may never get there. The times of
+// the others solve the sparse system (I - Q) h = 1 (Q the edges between them) with BiCGSTAB, and the
+// residual is the norm of (I - Q) h - 1 relative to the norm of 1
+lli mkGraphHittingTimes(const MarkovGraph* graph, const size_t* targets, const size_t nTargets, const double tol,
+                        const size_t maxIter, const uint nThreads, double* timesOut);
+// Expected number of steps for a walk leaving the node 'target' to get back to it (INFINITY if it may
+// never come back or the node has no edges). Returns -1 on error
+double mkGraphReturnTime(const MarkovGraph* graph, const size_t target, const double tol, const size_t maxIter,
+                         const uint nThreads);
 
 // Export graph to DOT format (graph visualization tool)
 void mkGraphExport(const MarkovGraph* graph, const char* file);
+
+// Formats of mkGraphExportAs:
+//  - DOT: like mkGraphExport, one line per edge between the values of both states
+//  - CSV: edge list with a "from,to,value,weight" header, where from and to are state ids and value the
+//    value the edge adds
+//  - BINARY: a GraphFileHeader, then the values (nVals int32), the state id of every node (nNodes uint64),
+//    and the edges in CSR layout: offsets (nNodes + 1 uint64), dests (nEdges uint64 node ids) and
+//    weights (nEdges doubles). Numbers are in the byte order of the machine that wrote the file
+typedef enum {
+    GRAPH_EXPORT_DOT = 0,
+    GRAPH_EXPORT_CSV = 1,
+    GRAPH_EXPORT_BINARY = 2,
+} GraphExportFormat;
+
+#define GRAPH_FILE_MAGIC "MKGRAPH"
+#define GRAPH_FILE_VERSION 1
+#define GRAPH_FILE_BYTE_ORDER 0x01020304u
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t order;
+    uint32_t reserved;
+    uint64_t nVals;
+    uint64_t nNodes;
+    uint64_t nEdges;
+} GraphFileHeader;
+
+// Export the graph to 'file' in the given format, streaming it through one buffer. Only the edges with
+// weight >= minWeight are written (every edge if minWeight <= 0), and with topK > 0 only the topK heaviest
+// edges of each node. Returns false on error
+bool mkGraphExportAs(const MarkovGraph* graph, const char* file, const GraphExportFormat format, const size_t topK,
+                     const double minWeight);
 /* ------------------------------------------------------------------------ */
 
 #endif // MARKOVGRAPH_H
\ No newline at end of file
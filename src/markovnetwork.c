@@ -6,6 +6,7 @@
 #include <math.h>
 
 #include "logging.h"
+#include "parallel.h"
 #include "utils.h"
 
 /* ----------------------------- MATRIX NODE ----------------------------- */
@@ -180,7 +181,7 @@ lli mkNetOutIdVal(OutputNode* node, int val) {
 /* ------------------------------------------------------------------------------------ */
 
 /* ----------------------------- MARKOV NETWORK ----------------------------- */
-MarkovNetwork* mkNetInit(MarkovState* state, const size_t nNodes, const double* errFactors, MKErrFuncT errFunc) {
+MarkovNetwork* mkNetInit(MarkovState* state, const size_t nNodes, const double* errFactors, MKErrFuncT errFunc, const TransMatrixLayout layout) {
     if (!state)
         return NULL;
 
@@ -193,12 +194,14 @@ MarkovNetwork* mkNetInit(MarkovState* state, const size_t nNodes, const double*
     net->start = mkNetInitInput(0, NULL, 0);
     net->end = mkNetInitOutput(0, state->vals, state->nVals);
     net->markovOrder = state->order;
+    net->countNoise = false;
 
     net->nMatNodes = nNodes;
     net->input = calloc(nNodes, sizeof(InputEdge*));
     net->output = calloc(nNodes, sizeof(OutputEdge*));
     for (size_t i = 0; i < nNodes; i++) {
-        MatrixNode* mx = mxNodeInit(i, markovInitTransMatrix(NULL, state));
+        TransitionMatrix* tm = (layout == TM_SPARSE) ? markovInitSparseTransMatrix(state) : markovInitTransMatrix(NULL, state);
+        MatrixNode* mx = mxNodeInit(i, tm);
         double errFac = (errFactors) ? errFactors[i] : 0.0;
         net->input[i] = mkNetInitInEdge(net->start, mx, errFac, errFunc);
         net->output[i] = mkNetInitOutEdge(mx, net->end, 1.0);
@@ -241,31 +244,287 @@ void mkNetMatrixNodes(MarkovNetwork* net, MatrixNode** out) {
         out[i] = net->input[i]->dest;
 }
 
-void mkNetTrain(MarkovNetwork* net, int* train, const size_t trainSize, const int* valid, const size_t validSize, const double lr) {
+typedef struct {
+    MarkovNetwork* net;
+    uint64_t seed;
+    // Initial matrices: one buffer per thread (n values) for the training data with errors
+    int* buffers;
+    // Validation: predictions of every node are compared with the 'valid' set
+    const int* valid;
+    size_t validSize;
+    double lr;
+    // Initial matrices with the errors on the counts: clean matrix copied by every node, and the value
+    // ids of the training data and of its distinct values (drawn by randomSwap)
+    const TransitionMatrix* base;
+    const lli* ids;
+    const lli* distinct;
+    size_t nDistinct;
+} NetTrainJob;
+
+// Fill the matrix of the node i, applying its error to a copy of the data in 'trainCopy'. Every node has its
+// own matrix, and draws its error from its own stream (seed, node id), so nodes are built in any order or
+// thread with the same result
+static void mkNetInitNode(const NetTrainJob* job, const size_t i, int* trainCopy) {
+    const InputNode* start = job->net->start;
+    const InputEdge* inEdge = job->net->input[i];
+    // apply error if any
+    if (inEdge->errFac > 0.0) {
+        Rng nodeRng;
+        rngInit(&nodeRng, job->seed, inEdge->dest->id);
+        inEdge->errFunc(inEdge->dest->id, start->data, trainCopy, start->n, inEdge->errFac, &nodeRng);
+        markovFillProbabilities(inEdge->dest->matrix, trainCopy, start->n);
+    }
+    else
+        markovFillProbabilities(inEdge->dest->matrix, start->data, start->n);
+}
+
+// Fill the matrices of the nodes [begin, end), with the buffer of the thread for their data copies
+static void mkNetInitNodes(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    const NetTrainJob* job = (const NetTrainJob*)ctx;
+    for (size_t i = begin; i < end; i++)
+        mkNetInitNode(job, i, job->buffers + (size_t)thread * job->net->start->n);
+}
+
+// Whether the error of the edge is cheaper to apply to the counts than to a copy of the data: it must
+// touch a small enough share of the transitions (windows of order+1 values) of the matrix m
+static bool mkNetCountsCheaper(const InputEdge* inEdge, const TransitionMatrix* m) {
+    // segments change 3 values in a row
+    const double perValue = (inEdge->errFunc == binarySegmentNoise) ? 3.0 * inEdge->errFac : inEdge->errFac;
+    const double touched = (perValue >= 1.0) ? 1.0 : 1.0 - pow(1.0 - perValue, (double)(m->state->order + 1));
+    return touched <= ((m->layout == TM_SPARSE) ? MKNET_COUNT_NOISE_MAX_SPARSE : MKNET_COUNT_NOISE_MAX_DENSE);
+}
+
+// Next position from 'i' changed by an error of probability p (n if none). Every position is changed
+// with probability p, so the gap to the next one is geometric and takes a single draw
+static size_t mkNetNextError(Rng* rng, const size_t i, const size_t n, const double p) {
+    if (i >= n)
+        return n;
+    if (p >= 1.0)
+        return i;
+    const double gap = floor(log(1.0 - rngUnit_d(rng)) / log1p(-p));
+    return (gap < (double)(n - i)) ? i + (size_t)gap : n;
+}
+
+// Values of the data changed by the error of the edge, in increasing positions, with the same distribution
+// as its (built-in) error function. The new values are written as value ids (-1 if not in the alphabet).
+// Returns the number of changes, or -1 on error
+static lli mkNetDrawErrors(const InputEdge* inEdge, const NetTrainJob* job, Rng* rng, size_t** posOut, lli** idsOut) {
+    const size_t SEG_LEN = 3;
+    const MarkovState* state = job->base->state;
+    const int* data = job->net->start->data;
+    const size_t n = job->net->start->n;
+    const bool segments = (inEdge->errFunc == binarySegmentNoise);
+    size_t nChanges = 0, cap = 0;
+    size_t* pos = NULL;
+    lli* ids = NULL;
+
+    size_t i = mkNetNextError(rng, 0, n, inEdge->errFac);
+    while (i < n) {
+        // a segment can't start closer than SEG_LEN to the end
+        if (segments && i + SEG_LEN > n)
+            break;
+        const size_t len = (segments) ? SEG_LEN : 1;
+        if (nChanges + len > cap) {
+            cap = 2 * cap + len + 16;
+            size_t* newPos = realloc(pos, sizeof(size_t) * cap);
+            if (newPos) pos = newPos;
+            lli* newIds = realloc(ids, sizeof(lli) * cap);
+            if (newIds) ids = newIds;
+            if (!newPos || !newIds) {
+                free(pos);
+                free(ids);
+                return -1;
+            }
+        }
+
+        for (size_t j = i; j < i + len; j++) {
+            const lli id = (inEdge->errFunc == randomSwap) ? job->distinct[ rngBelow(rng, job->nDistinct) ]
+                                                           : markovIdValState(state, 1 - data[j]);
+            if (id == job->ids[j])
+                continue;
+            pos[nChanges] = j;
+            ids[nChanges] = id;
+            nChanges++;
+        }
+        i = mkNetNextError(rng, i + len, n, inEdge->errFac);
+    }
+
+    *posOut = pos;
+    *idsOut = ids;
+    return (lli)nChanges;
+}
+
+// Shift the value id into a rolling transition code (stateID*nVals + valID, modulo nStates*nVals),
+// like markovShiftValue: 'filled' counts the values in it, and values out of the alphabet restart it
+static inline void mkNetShiftCode(const MarkovState* state, const lli id, size_t* code, uint* filled) {
+    if (id == -1) {
+        *code = 0;
+        *filled = 0;
+        return;
+    }
+    *code = ((*code) * state->nVals + (size_t)id) % (state->nStates * state->nVals);
+    if (*filled <= state->order)
+        (*filled)++;
+}
+
+// Append a transition code to a growing list. Returns false if it can't grow
+static bool mkNetPushCode(size_t** codes, size_t* n, size_t* cap, const size_t code) {
+    if (*n == *cap) {
+        const size_t newCap = 2 * (*cap) + 64;
+        size_t* grown = realloc(*codes, sizeof(size_t) * newCap);
+        if (!grown)
+            return false;
+        *codes = grown;
+        *cap = newCap;
+    }
+    (*codes)[(*n)++] = code;
+    return true;
+}
+
+// Move the counts of m (the clean data's) of every transition whose window has a changed value from
+// the clean transition to the one with the changes, all at once. Returns false if the counts can't be updated
+static bool mkNetErrorCounts(TransitionMatrix* m, const lli* ids, const size_t n, const size_t* pos,
+                             const lli* changedIds, const size_t nChanges) {
+    const MarkovState* state = m->state;
+    const size_t order = state->order;
+    if (n <= order)
+        return true;
+
+    size_t *added = NULL, *removed = NULL;
+    size_t nAdded = 0, nRemoved = 0, capAdded = 0, capRemoved = 0;
+    bool ok = true;
+
+    // the clean and changed windows are rolled up to (not including) 'rolled', with the changes before 'c'.
+    // Windows ending before 'next' are already visited
+    size_t clean = 0, changed = 0, rolled = 0, next = order, c = 0;
+    uint cleanFilled = 0, changedFilled = 0;
+    for (size_t k = 0; k < nChanges && ok; k++) {
+        const size_t last = (pos[k] + order < n) ? pos[k] + order : n - 1;
+        for (size_t j = (pos[k] > next) ? pos[k] : next; j <= last && ok; j++) {
+            // roll the windows from their first value if the last ones rolled aren't part of them
+            if (rolled + order < j) {
+                rolled = j - order;
+                cleanFilled = changedFilled = 0;
+                while (pos[c] < rolled)
+                    c++;
+            }
+            for (; rolled <= j; rolled++) {
+                mkNetShiftCode(state, ids[rolled], &clean, &cleanFilled);
+                mkNetShiftCode(state, (c < nChanges && pos[c] == rolled) ? changedIds[c++] : ids[rolled],
+                               &changed, &changedFilled);
+            }
+
+            const bool hasClean = (cleanFilled > order), hasChanged = (changedFilled > order);
+            if (hasClean && hasChanged && clean == changed)
+                continue;
+            if (hasClean)
+                ok = mkNetPushCode(&removed, &nRemoved, &capRemoved, clean);
+            if (hasChanged && ok)
+                ok = mkNetPushCode(&added, &nAdded, &capAdded, changed);
+        }
+        if (last + 1 > next)
+            next = last + 1;
+    }
+
+    ok = ok && markovAdjustCounts(m, added, nAdded, removed, nRemoved);
+    free(added);
+    free(removed);
+    return ok;
+}
+
+// Same as mkNetInitNodes, with the errors applied to the counts: every node copies the clean matrix
+// and only moves the transitions around the values changed by its error (unless its error touches
+// too many of them, see mkNetCountsCheaper). A node whose counts can't be updated is built from a copy
+// of the data instead
+static void mkNetInitNodeCounts(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    const NetTrainJob* job = (const NetTrainJob*)ctx;
+    const InputNode* start = job->net->start;
+    // the buffers of the data copies are only there if some node was known to need them
+    int* trainCopy = (job->buffers) ? job->buffers + (size_t)thread * start->n : NULL;
+    for (size_t i = begin; i < end; i++) {
+        const InputEdge* inEdge = job->net->input[i];
+        if (!mkNetCountsCheaper(inEdge, job->base)) {
+            mkNetInitNode(job, i, trainCopy);
+            continue;
+        }
+        MatrixNode* node = inEdge->dest;
+        TransitionMatrix* m = markovCopyTransMatrix(job->base);
+        bool ok = (m != NULL);
+        if (ok)
+            markovSetPrecision(m, node->matrix->sampler->precision);
+
+        if (ok && inEdge->errFac > 0.0) {
+            Rng nodeRng;
+            rngInit(&nodeRng, job->seed, node->id);
+            size_t* pos = NULL;
+            lli* ids = NULL;
+            const lli nChanges = mkNetDrawErrors(inEdge, job, &nodeRng, &pos, &ids);
+            ok = (nChanges != -1 && mkNetErrorCounts(m, job->ids, start->n, pos, ids, (size_t)nChanges));
+            free(pos);
+            free(ids);
+        }
+        if (!ok) {
+            LOG_WARNING("Unable to apply the error of a node to its counts in mkNetInitMatrices, copying its data");
+            markovFreeTransMatrix(&m);
+            int* copy = (trainCopy) ? trainCopy : malloc(sizeof(int) * (start->n + 1));
+            if (!copy) {
+                LOG_ERROR("malloc failed for the training data copy in mkNetInitMatrices");
+                continue;
+            }
+            mkNetInitNode(job, i, copy);
+            if (!trainCopy)
+                free(copy);
+            continue;
+        }
+
+        markovFreeTransMatrix(&node->matrix);
+        node->matrix = m;
+    }
+}
+
+// Predict the 'valid' set with the nodes [begin, end), each with its own stream (seed, node id), and update
+// the weight of each node's output edge (only touched by its node)
+static void mkNetValidateNodes(void* ctx, const size_t begin, const size_t end, const uint thread) {
+    const NetTrainJob* job = (const NetTrainJob*)ctx;
+    const InputNode* start = job->net->start;
+    int* prediction = job->buffers + (size_t)thread * job->validSize;
+    for (size_t i = begin; i < end; i++) {
+        MatrixNode* currNode = job->net->output[i]->orig;
+        Rng nodeRng;
+        rngInit(&nodeRng, job->seed, currNode->id);
+
+        markovPredict(currNode->matrix, (uint)job->validSize, start->data, start->n, &nodeRng, prediction, NULL);
+        for (size_t v = 0; v < job->validSize; v++)
+            mkNetUpdateWeights(job->net, job->lr, i, job->valid[v] == prediction[v]);
+    }
+}
+
+void mkNetTrain(MarkovNetwork* net, int* train, const size_t trainSize, const int* valid, const size_t validSize,
+                const double lr, Rng* rng, const uint nThreads) {
     // The training process is:
     // 1. First, train each matrix with their respective input errors, using the 'train' set
     // 2. Forward the 'valid' set to get the output of each node separately
     // 3. Backward the results to calculate the error
     // 4. Update the weights accordingly
-    if (!net || !train || !valid)
+    if (!net || !train || !valid || !rng)
         return;
 
     // Train initial matrices
     mkNetSetInputData(net->start, train, trainSize);
-    mkNetInitMatrices(net);
+    mkNetInitMatrices(net, rng, nThreads);
 
     // Go through each value of the 'valid' set
     // and compare it with the predicted output of the node
-    // then increase its weight if ok, else decrease
-    int* prediction = malloc(sizeof(int) * validSize);
-    for (size_t i = 0; i < net->nMatNodes; i++) {
-        MatrixNode* currNode = net->output[i]->orig;
-
-        markovPredict(currNode->matrix, (uint)validSize, net->start->data, net->start->n, prediction, NULL);
-        for (size_t v = 0; v < validSize; v++)
-            mkNetUpdateWeights(net, lr, i, valid[v] == prediction[v]);
+    // then increase its weight if ok, else decrease.
+    // Nodes are independent, so they are split across the threads
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    NetTrainJob job = {net, rngNext(rng), malloc(sizeof(int) * (validSize * threads + 1)), valid, validSize, lr, NULL, NULL, NULL, 0};
+    if (!job.buffers) {
+        LOG_ERROR("malloc failed for the predictions in mkNetTrain");
+        return;
     }
-    free(prediction);
+    parallelFor(net->nMatNodes, threads, mkNetValidateNodes, &job);
+    free(job.buffers);
 
     // normalize the weights at the end
     //mkNetNormStd(net);
@@ -275,28 +534,83 @@ void mkNetTrain(MarkovNetwork* net, int* train, const size_t trainSize, const in
     mkNetSetLastState(net, &valid[validSize - net->markovOrder]);
 }
 
-void mkNetInitMatrices(MarkovNetwork* net) {
-    if (!net)
+// Count the clean data once, then build every node from a copy of its counts
+static void mkNetInitCounts(MarkovNetwork* net, NetTrainJob* job, const uint threads, const bool swaps) {
+    const TransitionMatrix* layout = net->input[0]->dest->matrix;
+    TransitionMatrix* base = (layout->layout == TM_SPARSE) ? markovInitSparseTransMatrix(layout->state)
+                                                           : markovInitTransMatrix(NULL, layout->state);
+    if (!base) {
+        LOG_ERROR("Unable to init the clean transition matrix in mkNetInitMatrices");
+        return;
+    }
+    markovFillProbabilities(base, net->start->data, net->start->n);
+
+    // value ids of the data and of its distinct values, found once for every node
+    const size_t n = net->start->n;
+    lli* ids = malloc(sizeof(lli) * (n + 1));
+    int* distinct = NULL;
+    size_t nDistinct = 0;
+    if (swaps && n > 0)
+        findDistinct_i(net->start->data, n, &distinct, &nDistinct);
+    lli* distinctIds = malloc(sizeof(lli) * (nDistinct + 1));
+    if (!ids || !distinctIds) {
+        LOG_ERROR("malloc failed for the value ids in mkNetInitMatrices");
+        free(ids);
+        free(distinct);
+        free(distinctIds);
+        markovFreeTransMatrix(&base);
         return;
+    }
+    for (size_t i = 0; i < n; i++)
+        ids[i] = markovIdValState(base->state, net->start->data[i]);
+    for (size_t i = 0; i < nDistinct; i++)
+        distinctIds[i] = markovIdValState(base->state, distinct[i]);
+
+    job->base = base;
+    job->ids = ids;
+    job->distinct = distinctIds;
+    job->nDistinct = nDistinct;
+    parallelFor(net->nMatNodes, threads, mkNetInitNodeCounts, job);
+
+    free(ids);
+    free(distinct);
+    free(distinctIds);
+    markovFreeTransMatrix(&base);
+}
 
-    // copy train data, because we may introduce some error in it
-    int* trainCopy = malloc(sizeof(int) * net->start->n);
-    memcpy(trainCopy, net->start->data, sizeof(int) * net->start->n);
+void mkNetInitMatrices(MarkovNetwork* net, Rng* rng, const uint nThreads) {
+    if (!net || !rng)
+        return;
 
-    // Train with train set, with some random error applied
-    // *****CHANGE: introduce error in matrix not data*****
-    for (size_t i = 0; i < net->nMatNodes; i++) {
+    // Train with train set, with some random error applied to the counts of the clean data, or to a copy
+    // of the data (one per thread)
+    const uint threads = (nThreads == 0) ? parallelDefaultThreads() : nThreads;
+    NetTrainJob job = {net, rngNext(rng), NULL, NULL, 0, 0.0, NULL, NULL, NULL, 0};
+    bool counts = net->countNoise && net->nMatNodes > 0, swaps = false, copies = !counts;
+    for (size_t i = 0; i < net->nMatNodes && counts; i++) {
         const InputEdge* inEdge = net->input[i];
-        // apply error if any
-        if (inEdge->errFac > 0.0) {
-            inEdge->errFunc(inEdge->dest->id, net->start->data,  trainCopy, net->start->n, inEdge->errFac);
-            markovFillProbabilities(inEdge->dest->matrix, trainCopy, net->start->n);
+        const MKErrFuncT f = inEdge->errFunc;
+        if (inEdge->errFac > 0.0 && f != randomBinarySwap && f != binarySegmentNoise && f != randomSwap) {
+            LOG_WARNING("Only the built-in error functions can be applied to the counts, applying them to the data");
+            counts = false;
+            copies = true;
         }
-        else
-            markovFillProbabilities(inEdge->dest->matrix, net->start->data, net->start->n);
+        swaps |= (f == randomSwap);
+        copies |= !mkNetCountsCheaper(inEdge, inEdge->dest->matrix);
     }
 
-    free(trainCopy);
+    if (copies) {
+        job.buffers = malloc(sizeof(int) * (net->start->n * threads + 1));
+        if (!job.buffers) {
+            LOG_ERROR("malloc failed for the training data copies in mkNetInitMatrices");
+            return;
+        }
+    }
+    if (counts)
+        mkNetInitCounts(net, &job, threads, swaps);
+    else
+        parallelFor(net->nMatNodes, threads, mkNetInitNodes, &job);
+    free(job.buffers);
 }
 
 void mkNetUpdateWeights(MarkovNetwork* net, const double lr, const size_t id, bool correct) {
@@ -345,12 +659,12 @@ void mkNetSetLastState(MarkovNetwork* net, const int* lastState) {
     mkNetSetInputData(net->start, lastState, net->markovOrder);
 }
 
-void mkNetPredict(MarkovNetwork* net, const size_t steps, int* predOut, double* confOut) {
+void mkNetPredict(MarkovNetwork* net, const size_t steps, Rng* rng, int* predOut, double* confOut) {
     // The prediction process is:
     // 1. Get the output of each node separately
     // 2. The probability of the value 0 to be the next will be the sum of the weights of every node that answered 0 (or weight*probability)
     // 3. Then set the final answer to be that with the highest sum
-    if (!net || !predOut)
+    if (!net || !rng || !predOut)
         return;
 
     // first reset output probabilities
@@ -366,7 +680,7 @@ void mkNetPredict(MarkovNetwork* net, const size_t steps, int* predOut, double*
         // Get every node's answer
         for (size_t o = 0; o < net->nMatNodes; o++) {
             double prob = 0.0;
-            int pred = markovPredictNext(net->output[o]->orig->matrix, lastState, net->markovOrder, &prob);
+            int pred = markovPredictNext(net->output[o]->orig->matrix, lastState, net->markovOrder, rng, &prob);
             lli valID = mkNetOutIdVal(net->output[o]->dest, pred);
             if (valID == -1) {
                 LOG_ERROR("Unable to identify value in mkNetPredict.");
@@ -486,23 +800,23 @@ void mkNetExport(const MarkovNetwork* net, const char* file) {
 /* -------------------------------------------------------------------------- */
 
 /* -------------------------- USEFUL ERROR FUNCTIONS -------------------------- */
-void randomBinarySwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor) {
+void randomBinarySwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor, Rng* rng) {
     for (size_t i = 0; i < n; i++) {
-        if (rand01_d() <= errFactor)
+        if (rngUnit_d(rng) <= errFactor)
             out[i] = 1 - data[i];
         else
             out[i] = data[i];
     }
 }
 
-void binarySegmentNoise(size_t nodeId, const int* data, int* out, size_t n, double errFactor) {
+void binarySegmentNoise(size_t nodeId, const int* data, int* out, size_t n, double errFactor, Rng* rng) {
     const size_t SEG_LEN = 3;
     for (size_t i = 0; i < n; i++) {
         out[i] = data[i];
         if (i + SEG_LEN > n)
             continue;
 
-        if (rand01_d() <= errFactor) {
+        if (rngUnit_d(rng) <= errFactor) {
             for (size_t j = i; j < i + SEG_LEN; j++)
                 out[j] = 1 - data[j];
             i += SEG_LEN - 1;
@@ -510,14 +824,14 @@ void binarySegmentNoise(size_t nodeId, const int* data, int* out, size_t n, doub
     }
 }
 
-void randomSwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor) {
+void randomSwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor, Rng* rng) {
     int* unique = NULL;
     size_t nUnique = 0;
     findDistinct_i(data, n, &unique, &nUnique);
 
     for (size_t i = 0; i < n; i++) {
-        if (rand01_d() <= errFactor)
-            out[i] = unique[ rand() % n ];
+        if (rngUnit_d(rng) <= errFactor)
+            out[i] = unique[ rngBelow(rng, nUnique) ];
         else
             out[i] = data[i];
     }
@@ -22,12 +22,12 @@ typedef struct {
    size_t n;
 } InputNode;
 
-typedef void(*MKErrFuncT)(size_t,const int*,int*,size_t,double);
+typedef void(*MKErrFuncT)(size_t,const int*,int*,size_t,double,Rng*);
 typedef struct {
    InputNode* orig;
    MatrixNode* dest;
    double errFac;
-   // errorFunc must be a function to take as input (dest->id, data, dest, size, errorFactor)
+   // errorFunc must be a function to take as input (dest->id, data, dest, size, errorFactor, rng)
    MKErrFuncT errFunc;
 } InputEdge;
 
@@ -79,23 +79,42 @@ typedef struct {
 
    size_t nMatNodes;
    uint markovOrder;
+   // Apply the errors of the built-in error functions to the counts of the clean data instead of
+   // to copies of it (see mkNetInitMatrices). Off by default
+   bool countNoise;
 } MarkovNetwork;
 
-MarkovNetwork* mkNetInit(MarkovState* state, const size_t nNodes, const double* errFactors, MKErrFuncT errFunc);
+// With 'countNoise', a node moves the counts of the clean data while its error is expected to touch at
+// most this share of the transitions, and counts a copy of the data with the error otherwise (cheaper then)
+#define MKNET_COUNT_NOISE_MAX_DENSE 0.2
+#define MKNET_COUNT_NOISE_MAX_SPARSE 0.5
+
+// 'layout' is the layout of every matrix node's TransitionMatrix (TM_DENSE or TM_SPARSE)
+MarkovNetwork* mkNetInit(MarkovState* state, const size_t nNodes, const double* errFactors, MKErrFuncT errFunc, const TransMatrixLayout layout);
 void mkNetFree(MarkovNetwork** net);
 void mkNetMatrixNodes(MarkovNetwork* net, MatrixNode** out);
 
-void mkNetTrain(MarkovNetwork* net, int* train, const size_t trainSize, const int* valid, const size_t validSize, const double lr);
-
-// Init transition matrices and apply their corresponding random error in the data
-void mkNetInitMatrices(MarkovNetwork* net);
+// 'rng' draws the seeds of the random errors and of the predictions on the 'valid' set. Nodes are
+// trained and validated in parallel over 'nThreads' threads (0 uses every core), node i with its own
+// streams i of those seeds, so the result only depends on the seed
+void mkNetTrain(MarkovNetwork* net, int* train, const size_t trainSize, const int* valid, const size_t validSize,
+                const double lr, Rng* rng, const uint nThreads);
+
+// Init transition matrices and apply their corresponding random error in the data, over 'nThreads' threads.
+// The error of node i comes from its own stream i of a seed drawn from 'rng'.
+// With 'countNoise', the data is counted once and every node starts from a copy of those counts,
+// then only the transitions around the values its error changes are moved (same distribution of
+// errors as the error function, not the same draws). Error functions other than the built-in ones,
+// and errors touching too many transitions (see MKNET_COUNT_NOISE_MAX_DENSE), still rewrite a copy of
+// the data. Nodes keep the window of the last values of the clean data
+void mkNetInitMatrices(MarkovNetwork* net, Rng* rng, const uint nThreads);
 
 void mkNetUpdateWeights(MarkovNetwork* net, const double lr, const size_t id, bool correct);
 void mkNetNormStd(MarkovNetwork* net);
 void mkNetNormSoftmax(MarkovNetwork* net, double temperature);
 
 void mkNetSetLastState(MarkovNetwork* net, const int* lastState);
-void mkNetPredict(MarkovNetwork* net, const size_t steps, int* predOut, double* confOut);
+void mkNetPredict(MarkovNetwork* net, const size_t steps, Rng* rng, int* predOut, double* confOut);
 
 // Returns the ID of the node whose path balances the best between minimizing the error factor and maximizing the weight
 // The "score" (s) metric is calculated by: s = alpha * w' - (1-alpha) * err',
@@ -109,10 +128,10 @@ void mkNetExport(const MarkovNetwork* net, const char* file);
 /* -------------------------------------------------------------------------- */
 
 /* -------------------------- USEFUL ERROR FUNCTIONS -------------------------- */
-void randomBinarySwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor);
-void binarySegmentNoise(size_t nodeId, const int* data, int* out, size_t n, double errFactor);
+void randomBinarySwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor, Rng* rng);
+void binarySegmentNoise(size_t nodeId, const int* data, int* out, size_t n, double errFactor, Rng* rng);
 
-void randomSwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor);
+void randomSwap(size_t nodeId, const int* data, int* out, size_t n, double errFactor, Rng* rng);
 /* ---------------------------------------------------------------------------- */
 
 #endif //MARKOVNETWORK_H
@@ -0,0 +1,380 @@
+#include "markovtree.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+#include "logging.h"
+
+// Marks a position of the series without a context in the tree
+#define MKTREE_NONE ((size_t)-1)
+
+size_t mkTreeNodeBytes(const size_t nVals) {
+    // counts + total + parent + sym + depth, and the node's key/value in the children map (load <= 0.5)
+    return sizeof(uint64_t) * (nVals + 1) + sizeof(size_t) * 2 + sizeof(uint) + sizeof(size_t) * 4;
+}
+
+// Make room for 'cap' nodes (the new counts are zeroed)
+static bool mkTreeReserve(MarkovTree* tree, const size_t cap) {
+    const size_t nVals = tree->state->nVals;
+    if (cap <= tree->nodeCap)
+        return true;
+
+    uint64_t* counts = realloc(tree->counts, sizeof(uint64_t) * cap * nVals);
+    if (!counts)
+        return false;
+    tree->counts = counts;
+    memset(tree->counts + tree->nodeCap * nVals, 0, sizeof(uint64_t) * (cap - tree->nodeCap) * nVals);
+
+    uint64_t* totals = realloc(tree->totals, sizeof(uint64_t) * cap);
+    if (!totals)
+        return false;
+    tree->totals = totals;
+    memset(tree->totals + tree->nodeCap, 0, sizeof(uint64_t) * (cap - tree->nodeCap));
+
+    size_t* parents = realloc(tree->parents, sizeof(size_t) * cap);
+    if (!parents)
+        return false;
+    tree->parents = parents;
+    size_t* syms = realloc(tree->syms, sizeof(size_t) * cap);
+    if (!syms)
+        return false;
+    tree->syms = syms;
+    uint* depths = realloc(tree->depths, sizeof(uint) * cap);
+    if (!depths)
+        return false;
+    tree->depths = depths;
+
+    tree->nodeCap = cap;
+    return true;
+}
+
+// Add the child of 'parent' through 'valID'. Returns -1 if the tree is full or can't grow
+static lli mkTreeAddNode(MarkovTree* tree, const size_t parent, const size_t valID) {
+    if (tree->nNodes >= tree->maxNodes)
+        return -1;
+    if (tree->nNodes == tree->nodeCap) {
+        size_t cap = tree->nodeCap * 2;
+        if (cap > tree->maxNodes)
+            cap = tree->maxNodes;
+        if (!mkTreeReserve(tree, cap)) {
+            LOG_ERROR("Unable to grow tree nodes in mkTreeAddNode");
+            return -1;
+        }
+    }
+
+    const size_t node = tree->nNodes;
+    if (!hashMapPut(tree->children, parent * tree->state->nVals + valID, node))
+        return -1;
+    tree->parents[node] = parent;
+    tree->syms[node] = valID;
+    tree->depths[node] = tree->depths[parent] + 1;
+    tree->nNodes++;
+    return (lli)node;
+}
+
+// Prediction gain of a node over its parent: total * KL(node || parent)
+static double mkTreeGain(const MarkovTree* tree, const size_t node) {
+    const size_t nVals = tree->state->nVals;
+    const size_t parent = tree->parents[node];
+    const uint64_t* counts = tree->counts + node * nVals;
+    const uint64_t* parentCounts = tree->counts + parent * nVals;
+    const double total = (double)tree->totals[node];
+    const double parentTotal = (double)tree->totals[parent];
+
+    // the parent context contains every occurrence of the node's one, so q > 0 whenever p > 0
+    double gain = 0.0;
+    for (size_t v = 0; v < nVals; v++) {
+        if (counts[v] == 0)
+            continue;
+        const double p = (double)counts[v] / total;
+        const double q = (double)parentCounts[v] / parentTotal;
+        gain += (double)counts[v] * log(p / q);
+    }
+    return gain;
+}
+
+// Remove the nodes that don't predict better than their parents (and have no kept children),
+// then move the kept nodes to the front of the arrays
+static bool mkTreePrune(MarkovTree* tree, const double threshold) {
+    const size_t nVals = tree->state->nVals;
+    if (threshold <= 0.0 || tree->nNodes <= 1)
+        return true;
+
+    ubyte* keep = calloc(tree->nNodes, sizeof(ubyte));
+    size_t* newIds = malloc(sizeof(size_t) * tree->nNodes);
+    if (!keep || !newIds) {
+        LOG_ERROR("malloc failed for pruning the tree in mkTreePrune");
+        free(keep);
+        free(newIds);
+        return false;
+    }
+
+    // Children are always added after their parents, so going backwards sees a node's children first
+    keep[0] = 1;
+    for (size_t node = tree->nNodes; node-- > 1;) {
+        if (!keep[node] && mkTreeGain(tree, node) >= threshold)
+            keep[node] = 1;
+        if (keep[node])
+            keep[tree->parents[node]] = 1;
+    }
+
+    // Kept nodes keep their relative order, so they can be moved forward in place
+    size_t nKept = 0;
+    for (size_t node = 0; node < tree->nNodes; node++) {
+        if (!keep[node])
+            continue;
+        newIds[node] = nKept;
+        if (nKept != node) {
+            memcpy(tree->counts + nKept * nVals, tree->counts + node * nVals, sizeof(uint64_t) * nVals);
+            tree->totals[nKept] = tree->totals[node];
+            tree->syms[nKept] = tree->syms[node];
+            tree->depths[nKept] = tree->depths[node];
+        }
+        tree->parents[nKept] = newIds[tree->parents[node]];
+        nKept++;
+    }
+
+    HashMap* children = hashMapInit(nKept);
+    bool ok = (children != NULL);
+    for (size_t node = 1; ok && node < nKept; node++)
+        ok = hashMapPut(children, tree->parents[node] * nVals + tree->syms[node], node);
+    free(keep);
+    free(newIds);
+    if (!ok) {
+        LOG_ERROR("Unable to index the pruned tree in mkTreePrune");
+        hashMapFree(&children);
+        return false;
+    }
+
+    hashMapFree(&tree->children);
+    tree->children = children;
+    tree->nNodes = nKept;
+    return true;
+}
+
+MarkovTree* mkTreeBuild(const int* data, const size_t n, const MarkovState* state, const uint maxDepth,
+                        const size_t maxNodes, const uint64_t minCount, const double pruneThreshold) {
+    if (!data || !state || state->nVals == 0 || maxNodes == 0)
+        return NULL;
+
+    const size_t nVals = state->nVals;
+    // every child key (node*nVals + valID) must fit in a size_t
+    if (maxNodes > (SIZE_MAX - 1) / nVals) {
+        LOG_ERROR("Too many nodes for the values in mkTreeBuild");
+        return NULL;
+    }
+
+    MarkovTree* tree = calloc(1, sizeof(MarkovTree));
+    if (!tree) {
+        LOG_ERROR("malloc failed for MarkovTree");
+        return NULL;
+    }
+    tree->state = state;
+    tree->maxDepth = maxDepth;
+    tree->maxNodes = maxNodes;
+
+    // ids of the values, and the node of the current context of each position
+    size_t* ids = malloc(sizeof(size_t) * (n + 1));
+    size_t* ctx = malloc(sizeof(size_t) * (n + 1));
+    tree->children = hashMapInit(1024);
+    if (!ids || !ctx || !tree->children || !mkTreeReserve(tree, (maxNodes < 1024) ? maxNodes : 1024)) {
+        LOG_ERROR("malloc failed for building the tree in mkTreeBuild");
+        free(ids);
+        free(ctx);
+        mkTreeFree(&tree);
+        return NULL;
+    }
+
+    // The root is the empty context, it counts every value
+    tree->nNodes = 1;
+    tree->parents[0] = 0;
+    tree->syms[0] = 0;
+    tree->depths[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        const lli valID = markovIdValState(state, data[i]);
+        ids[i] = (valID == -1) ? MKTREE_NONE : (size_t)valID;
+        ctx[i] = (valID == -1) ? MKTREE_NONE : 0;
+        if (valID != -1) {
+            tree->counts[valID]++;
+            tree->totals[0]++;
+        }
+    }
+
+    // Grow the contexts one depth at a time: the context of length d before the position i extends
+    // its context of length d-1 with data[i-d], and it's only added if that one is frequent enough
+    bool full = false;
+    for (uint d = 1; d <= maxDepth && d <= n; d++) {
+        bool grown = false;
+        for (size_t i = d; i < n; i++) {
+            const size_t parent = ctx[i];
+            if (parent == MKTREE_NONE)
+                continue;
+            if (tree->totals[parent] < minCount || ids[i-d] == MKTREE_NONE) {
+                ctx[i] = MKTREE_NONE;
+                continue;
+            }
+
+            lli child = hashMapGet(tree->children, parent * nVals + ids[i-d]);
+            if (child == -1) {
+                child = mkTreeAddNode(tree, parent, ids[i-d]);
+                if (child == -1) {
+                    full = true;
+                    ctx[i] = MKTREE_NONE;
+                    continue;
+                }
+            }
+
+            tree->counts[(size_t)child * nVals + ids[i]]++;
+            tree->totals[child]++;
+            ctx[i] = (size_t)child;
+            grown = true;
+        }
+        if (!grown)
+            break;
+    }
+    free(ids);
+    free(ctx);
+
+    if (full)
+        LOG_WARNING("Tree reached its maximum number of nodes, some contexts weren't added");
+
+    if (!mkTreePrune(tree, pruneThreshold)) {
+        mkTreeFree(&tree);
+        return NULL;
+    }
+    return tree;
+}
+
+void mkTreeFree(MarkovTree** tree) {
+    if (!tree || !(*tree))
+        return;
+
+    free((*tree)->counts);
+    free((*tree)->totals);
+    free((*tree)->parents);
+    free((*tree)->syms);
+    free((*tree)->depths);
+    hashMapFree(&(*tree)->children);
+
+    free(*tree);
+    *tree = NULL;
+}
+
+size_t mkTreeFindContext(const MarkovTree* tree, const int* data, const size_t n) {
+    if (!tree || !data)
+        return 0;
+
+    // Follow the series backwards from the root while the tree has the context
+    size_t node = 0;
+    for (size_t d = 0; d < tree->maxDepth && d < n; d++) {
+        const lli valID = markovIdValState(tree->state, data[n - 1 - d]);
+        if (valID == -1)
+            break;
+        const lli child = hashMapGet(tree->children, node * tree->state->nVals + (size_t)valID);
+        if (child == -1)
+            break;
+        node = (size_t)child;
+    }
+    return node;
+}
+
+// Choose the next value id from the counts of 'node': the first value with r*total <= cumulative count.
+// Returns -1 if the node has no counts
+static lli mkTreeSample(const MarkovTree* tree, const size_t node, const double r, double* cumOut) {
+    const uint64_t* counts = tree->counts + node * tree->state->nVals;
+    const uint64_t total = tree->totals[node];
+    *cumOut = 0.0;
+    if (total == 0)
+        return -1;
+
+    const double target = r * (double)total;
+    uint64_t cum = 0;
+    for (size_t v = 0; v < tree->state->nVals; v++) {
+        cum += counts[v];
+        if (counts[v] > 0 && target <= (double)cum) {
+            *cumOut = (double)cum / (double)total;
+            return (lli)v;
+        }
+    }
+    *cumOut = 1.0;
+    return -1;
+}
+
+int mkTreePredictNext(const MarkovTree* tree, const int* data, const size_t n, Rng* rng, double* outConf) {
+    if (!tree || !data || !rng)
+        return INT_MAX;
+
+    const size_t node = mkTreeFindContext(tree, data, n);
+    double cumProb = 0.0;
+    const lli v = mkTreeSample(tree, node, rngUnit_d(rng), &cumProb);
+    if (outConf)
+        *outConf = cumProb;
+    // no counts at all, choose random
+    if (v == -1)
+        return tree->state->vals[ rngBelow(rng, tree->state->nVals) ];
+    return tree->state->vals[v];
+}
+
+void mkTreePredict(const MarkovTree* tree, const uint steps, const int* data, const size_t n, Rng* rng,
+                   int* predOut, double* confOut) {
+    if (!tree || !data || !rng || !predOut)
+        return;
+
+    // Only the last maxDepth values can match a context, keep them in a window
+    const size_t depth = tree->maxDepth;
+    int* window = malloc(sizeof(int) * (depth + 1));
+    if (!window) {
+        LOG_ERROR("malloc failed for the context window in mkTreePredict");
+        return;
+    }
+    size_t len = (n < depth) ? n : depth;
+    memcpy(window, data + n - len, sizeof(int) * len);
+
+    for (uint i = 0; i < steps; i++) {
+        double conf = 0.0;
+        predOut[i] = mkTreePredictNext(tree, window, len, rng, &conf);
+        if (confOut)
+            confOut[i] = conf;
+
+        // Then extend the series with the new value
+        if (depth == 0)
+            continue;
+        if (len == depth) {
+            memmove(window, window + 1, sizeof(int) * (depth - 1));
+            len--;
+        }
+        window[len++] = predOut[i];
+    }
+
+    free(window);
+}
+
+void mkTreePrintStats(const MarkovTree* tree) {
+    if (!tree)
+        return;
+
+    uint maxDepth = 0;
+    for (size_t node = 0; node < tree->nNodes; node++) {
+        if (tree->depths[node] > maxDepth)
+            maxDepth = tree->depths[node];
+    }
+
+    size_t* perDepth = calloc(maxDepth + 1, sizeof(size_t));
+    if (!perDepth) {
+        LOG_ERROR("malloc failed for tree stats in mkTreePrintStats");
+        return;
+    }
+    for (size_t node = 0; node < tree->nNodes; node++)
+        perDepth[tree->depths[node]]++;
+
+    printf("=====> TREE NODES: %lu (deepest context: %u), MEMORY: %.2lf MB\n", tree->nNodes, maxDepth,
+           (double)(tree->nNodes * mkTreeNodeBytes(tree->state->nVals)) / (1024.0 * 1024.0));
+    printf("=====> NODES PER DEPTH: ");
+    for (uint d = 0; d <= maxDepth; d++)
+        printf("%lu%s", perDepth[d], (d < maxDepth) ? ", " : "\n");
+
+    free(perDepth);
+}
@@ -0,0 +1,60 @@
+#ifndef MARKOVTREE_H
+#define MARKOVTREE_H
+
+#include <stdlib.h>
+
+#include "markov.h"
+#include "hashmap.h"
+
+/// Variable-order Markov model (Prediction Suffix Tree)
+
+// MarkovTree keeps the contexts of the series as a suffix tree: the root is the empty context,
+// and the child of a node through the value v is its context extended one value into the past
+// (so the path root -> v1 -> v2 is the context [..., v2, v1], with v1 the most recent value).
+// Each node has the counts of the values that followed its context in the data.
+//
+// Contexts only grow where they are supported (parent seen at least 'minCount' times), up to
+// 'maxDepth' values and 'maxNodes' nodes, and then the ones that don't predict better than their
+// parent are pruned. Memory grows with the data instead of nVals^order, and predictions use the
+// longest context of the tree matching the end of the series.
+//
+// Nodes are stored in flat arrays (node 0 is the root), with counts[node*nVals + valID].
+// The child of 'node' through 'valID' is found with the key node*nVals + valID in 'children'
+typedef struct {
+    const MarkovState* state;
+    uint maxDepth;
+    size_t maxNodes;
+
+    size_t nNodes;
+    size_t nodeCap;
+    uint64_t* counts;
+    uint64_t* totals;
+    size_t* parents;
+    size_t* syms;    // value id from the parent to the node
+    uint* depths;
+    HashMap* children;
+} MarkovTree;
+
+// Approximate memory used by each node of a tree over 'nVals' values (to turn a memory budget into maxNodes)
+size_t mkTreeNodeBytes(const size_t nVals);
+
+// Build the tree from the series. Only the alphabet of 'state' is used (its order doesn't matter).
+// A node is only extended if its context was seen at least 'minCount' times, and a node is kept if
+// total * KL(node || parent) >= pruneThreshold, or if it has a kept child
+MarkovTree* mkTreeBuild(const int* data, const size_t n, const MarkovState* state, const uint maxDepth,
+                        const size_t maxNodes, const uint64_t minCount, const double pruneThreshold);
+void mkTreeFree(MarkovTree** tree);
+
+// Node of the longest context in the tree matching the end of data[0..n) (the root if none)
+size_t mkTreeFindContext(const MarkovTree* tree, const int* data, const size_t n);
+
+// Predict the next value of the series, sampling from the counts of its longest matching context
+int mkTreePredictNext(const MarkovTree* tree, const int* data, const size_t n, Rng* rng, double* outConf);
+// Predicts the next 'steps' values, extending the series with every predicted value
+void mkTreePredict(const MarkovTree* tree, const uint steps, const int* data, const size_t n, Rng* rng,
+                   int* predOut, double* confOut);
+
+// Print the number of nodes per depth and the memory used
+void mkTreePrintStats(const MarkovTree* tree);
+
+#endif // MARKOVTREE_H
@@ -0,0 +1,516 @@
+#include "modelio.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+/* ----------------------------------- SAVING ----------------------------------- */
+typedef struct {
+    FILE* f;
+    uint64_t pos;
+    bool ok;
+} ModelWriter;
+
+// Pad the file with zeros up to the next aligned offset
+static void modelAlign(ModelWriter* w) {
+    static const ubyte zeros[MODEL_FILE_ALIGN] = {0};
+    const size_t pad = (MODEL_FILE_ALIGN - w->pos % MODEL_FILE_ALIGN) % MODEL_FILE_ALIGN;
+    if (w->ok && pad > 0 && fwrite(zeros, 1, pad, w->f) != pad)
+        w->ok = false;
+    w->pos += pad;
+}
+
+static void modelWrite(ModelWriter* w, const void* data, const size_t size) {
+    if (w->ok && size > 0 && fwrite(data, 1, size, w->f) != size)
+        w->ok = false;
+    w->pos += size;
+}
+
+// Write a block at the next aligned offset. Returns its offset (0 if there's nothing to write)
+static uint64_t modelWriteBlock(ModelWriter* w, const void* data, const size_t size) {
+    if (!data || size == 0)
+        return 0;
+    modelAlign(w);
+    const uint64_t offset = w->pos;
+    modelWrite(w, data, size);
+    return offset;
+}
+
+// Write a block of 'n' bytes equal to 'byte'
+static uint64_t modelWriteFill(ModelWriter* w, const ubyte byte, const size_t n) {
+    if (n == 0)
+        return 0;
+    ubyte chunk[4096];
+    memset(chunk, byte, sizeof(chunk));
+    modelAlign(w);
+    const uint64_t offset = w->pos;
+    for (size_t done = 0; done < n; done += sizeof(chunk))
+        modelWrite(w, chunk, (n - done < sizeof(chunk)) ? n - done : sizeof(chunk));
+    return offset;
+}
+
+// Write one element per row of a sparse matrix, rows in the order of 'order'
+static uint64_t modelWritePerRow(ModelWriter* w, const void* base, const size_t elemSize, const size_t nRows,
+                                 const size_t* order) {
+    if (!base || nRows == 0)
+        return 0;
+    modelAlign(w);
+    const uint64_t offset = w->pos;
+    for (size_t r = 0; r < nRows; r++)
+        modelWrite(w, (const ubyte*)base + order[r] * elemSize, elemSize);
+    return offset;
+}
+
+// Write the entries of every row of a sparse matrix, rows in the order of 'order'
+static uint64_t modelWriteRows(ModelWriter* w, const void* base, const size_t elemSize, const TransitionMatrix* m,
+                               const size_t* order) {
+    if (!base || m->nRows == 0)
+        return 0;
+    modelAlign(w);
+    const uint64_t offset = w->pos;
+    for (size_t r = 0; r < m->nRows; r++) {
+        const size_t begin = m->rowPtr[order[r]];
+        const size_t len = m->rowPtr[order[r] + 1] - begin;
+        modelWrite(w, (const ubyte*)base + begin * elemSize, len * elemSize);
+    }
+    return offset;
+}
+
+// Sampling cache block of the matrix and the size of its elements (NULL if it isn't built)
+static const void* modelCdfBlock(const TransitionMatrix* m, size_t* elemSize) {
+    const MarkovSampler* sampler = m->sampler;
+    if (!sampler || !sampler->ready)
+        return NULL;
+    if (sampler->precision == TM_PREC_FLOAT) {
+        *elemSize = sizeof(float);
+        return sampler->cdf32;
+    }
+    if (sampler->precision == TM_PREC_Q16) {
+        *elemSize = sizeof(uint16_t);
+        return sampler->cdfQ16;
+    }
+    *elemSize = sizeof(double);
+    return sampler->cdf;
+}
+
+static const TransitionMatrix* _sortMatrix = NULL;
+static int _cmpRowStateAsc(const void* a, const void* b) {
+    const size_t x = _sortMatrix->rowStates[*(const size_t*)a], y = _sortMatrix->rowStates[*(const size_t*)b];
+    return (x > y) - (x < y);
+}
+
+// Write every block of a matrix, filling its record
+static bool modelWriteMatrix(ModelWriter* w, const TransitionMatrix* m, ModelMatrixRecord* rec) {
+    const MarkovState* state = m->state;
+    // rows are saved as clean, so their probabilities must be normalized already (see markovPrepareSampler)
+    const size_t nDirty = (m->dirty) ? markovNumRows(m) : 0;
+    for (size_t r = 0; r < nDirty; r++) {
+        if (m->dirty[r]) {
+            LOG_ERROR("Unable to save a transition matrix with rows not normalized yet");
+            return false;
+        }
+    }
+    // the cache is written as it is, only when every row is built (and then normalized too)
+    const bool sampled = markovSamplerReady(m);
+    size_t cdfSize = 0;
+    const void* cdf = (sampled) ? modelCdfBlock(m, &cdfSize) : NULL;
+
+    memset(rec, 0, sizeof(ModelMatrixRecord));
+    rec->layout = (uint32_t)m->layout;
+    rec->precision = (uint32_t)m->sampler->precision;
+    rec->lastStateID = m->lastStateID;
+    rec->lastFilled = m->lastFilled;
+
+    if (m->layout == TM_DENSE) {
+        const size_t nStates = state->nStates;
+        const size_t size = nStates * state->nVals;
+        rec->nRows = nStates;
+        rec->nnz = size;
+        rec->probs = modelWriteBlock(w, m->probs, sizeof(double) * size);
+        rec->counts = modelWriteBlock(w, m->counts, sizeof(uint64_t) * size);
+        rec->rowTotals = modelWriteBlock(w, m->rowTotals, sizeof(uint64_t) * nStates);
+        rec->dirty = modelWriteFill(w, 0, nStates);
+        if (cdf) {
+            rec->cdf = modelWriteBlock(w, cdf, cdfSize * size);
+            rec->ready = modelWriteFill(w, 1, nStates);
+        }
+        return w->ok;
+    }
+
+    // Sparse rows are written sorted by state, so they can be found by binary search without an index
+    const size_t nRows = m->nRows;
+    const size_t nnz = (m->rowPtr) ? m->rowPtr[nRows] : 0;
+    size_t* order = malloc(sizeof(size_t) * (nRows + 1));
+    size_t* rowPtr = malloc(sizeof(size_t) * (nRows + 1));
+    if (!order || !rowPtr) {
+        LOG_ERROR("malloc failed for the row order in modelWriteMatrix");
+        free(order);
+        free(rowPtr);
+        return false;
+    }
+    for (size_t r = 0; r < nRows; r++)
+        order[r] = r;
+    _sortMatrix = m;
+    qsort(order, nRows, sizeof(size_t), _cmpRowStateAsc);
+    rowPtr[0] = 0;
+    for (size_t r = 0; r < nRows; r++)
+        rowPtr[r+1] = rowPtr[r] + (m->rowPtr[order[r] + 1] - m->rowPtr[order[r]]);
+
+    rec->nRows = nRows;
+    rec->nnz = nnz;
+    rec->rowStates = modelWritePerRow(w, m->rowStates, sizeof(size_t), nRows, order);
+    rec->rowPtr = modelWriteBlock(w, rowPtr, sizeof(size_t) * (nRows + 1));
+    rec->colIds = modelWriteRows(w, m->colIds, sizeof(size_t), m, order);
+    rec->sparseProbs = modelWriteRows(w, m->sparseProbs, sizeof(double), m, order);
+    rec->counts = modelWriteRows(w, m->counts, sizeof(uint64_t), m, order);
+    rec->rowTotals = modelWritePerRow(w, m->rowTotals, sizeof(uint64_t), nRows, order);
+    rec->dirty = modelWriteFill(w, 0, nRows);
+    if (cdf) {
+        rec->cdf = modelWriteRows(w, cdf, cdfSize, m, order);
+        rec->ready = modelWriteFill(w, 1, nRows);
+    }
+
+    free(order);
+    free(rowPtr);
+    return w->ok;
+}
+
+static bool modelSave(const char* file, const ModelKind kind, const MarkovState* state,
+                      const TransitionMatrix** matrices, const size_t nMatrices, const double* weights,
+                      const double* errFactors) {
+    ModelWriter w = {fopen(file, "wb"), 0, true};
+    if (!w.f) {
+        LOG_ERROR("Unable to open model file for writing:");
+        fprintf(stderr, "%s\n", file);
+        return false;
+    }
+    ModelFileHeader header;
+    ModelMatrixRecord* records = calloc(nMatrices, sizeof(ModelMatrixRecord));
+    if (!records) {
+        LOG_ERROR("calloc failed for model records");
+        fclose(w.f);
+        return false;
+    }
+
+    // Header and records are written again at the end, when the offsets are known
+    memset(&header, 0, sizeof(header));
+    modelWrite(&w, &header, sizeof(header));
+    header.records = modelWriteBlock(&w, records, sizeof(ModelMatrixRecord) * nMatrices);
+    header.vals = modelWriteBlock(&w, state->vals, sizeof(int) * state->nVals);
+    header.weights = modelWriteBlock(&w, weights, (weights) ? sizeof(double) * nMatrices : 0);
+    header.errFactors = modelWriteBlock(&w, errFactors, (errFactors) ? sizeof(double) * nMatrices : 0);
+    for (size_t i = 0; i < nMatrices && w.ok; i++) {
+        if (!modelWriteMatrix(&w, matrices[i], &records[i]))
+            w.ok = false;
+    }
+    modelAlign(&w);
+
+    memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC));
+    header.version = MODEL_FILE_VERSION;
+    header.byteOrder = MODEL_FILE_BYTE_ORDER;
+    header.kind = (uint32_t)kind;
+    header.order = state->order;
+    header.fileSize = w.pos;
+    header.nVals = state->nVals;
+    header.nMatrices = nMatrices;
+    if (w.ok && fseek(w.f, 0, SEEK_SET) != 0)
+        w.ok = false;
+    if (w.ok && fwrite(&header, sizeof(header), 1, w.f) != 1)
+        w.ok = false;
+    if (w.ok && fseek(w.f, (long)header.records, SEEK_SET) != 0)
+        w.ok = false;
+    if (w.ok && fwrite(records, sizeof(ModelMatrixRecord), nMatrices, w.f) != nMatrices)
+        w.ok = false;
+
+    free(records);
+    if (fclose(w.f) != 0)
+        w.ok = false;
+    if (!w.ok) {
+        LOG_ERROR("Unable to write model file:");
+        fprintf(stderr, "%s\n", file);
+    }
+    return w.ok;
+}
+
+bool modelSaveChain(const TransitionMatrix* m, const char* file) {
+    if (!m || !m->state || !file)
+        return false;
+    return modelSave(file, MODEL_CHAIN, m->state, &m, 1, NULL, NULL);
+}
+
+bool modelSaveNetwork(const MarkovNetwork* net, const char* file) {
+    if (!net || !file || net->nMatNodes == 0)
+        return false;
+
+    const TransitionMatrix** matrices = malloc(sizeof(TransitionMatrix*) * net->nMatNodes);
+    double* weights = malloc(sizeof(double) * net->nMatNodes);
+    double* errFactors = malloc(sizeof(double) * net->nMatNodes);
+    if (!matrices || !weights || !errFactors) {
+        LOG_ERROR("malloc failed for network nodes in modelSaveNetwork");
+        free(matrices);
+        free(weights);
+        free(errFactors);
+        return false;
+    }
+    for (size_t i = 0; i < net->nMatNodes; i++) {
+        matrices[i] = net->input[i]->dest->matrix;
+        weights[i] = net->output[i]->weight;
+        errFactors[i] = net->input[i]->errFac;
+    }
+
+    const bool ok = modelSave(file, MODEL_NETWORK, matrices[0]->state, matrices, net->nMatNodes, weights, errFactors);
+    free(matrices);
+    free(weights);
+    free(errFactors);
+    return ok;
+}
+/* ------------------------------------------------------------------------------ */
+
+/* ----------------------------------- LOADING ----------------------------------- */
+// Whether a block of 'count' elements of 'elemSize' bytes at 'offset' is inside the file and aligned
+// (a missing block, offset 0, is only fine if it's optional)
+static bool modelBlockOk(const MarkovModel* model, const uint64_t offset, const uint64_t count,
+                         const size_t elemSize, const bool optional) {
+    if (offset == 0)
+        return optional || count == 0;
+    if (offset % MODEL_FILE_ALIGN != 0 || offset > model->size)
+        return false;
+    if (elemSize > 0 && count > (model->size - offset) / elemSize)
+        return false;
+    return true;
+}
+
+// Whether the 'count' bytes at 'offset' (already checked) are all 0
+static bool modelBytesZero(const MarkovModel* model, const uint64_t offset, const uint64_t count) {
+    const ubyte* bytes = (const ubyte*)model->mapping + offset;
+    for (uint64_t i = 0; i < count; i++) {
+        if (bytes[i])
+            return false;
+    }
+    return true;
+}
+
+// The mapped matrix is used as it is, so its indices are checked once here: rowPtr never decreases,
+// rows are sorted by state (markovSparseRow searches them) and the values of a row by id (markovTransProb)
+static bool modelSparseIndexOk(const MarkovModel* model, const ModelMatrixRecord* rec) {
+    const MarkovState* state = model->state;
+    const size_t* rowPtr = (const size_t*)((const ubyte*)model->mapping + rec->rowPtr);
+    const size_t* rowStates = (const size_t*)((const ubyte*)model->mapping + rec->rowStates);
+    const size_t* colIds = (const size_t*)((const ubyte*)model->mapping + rec->colIds);
+    for (size_t r = 0; r < rec->nRows; r++) {
+        if (rowPtr[r] > rowPtr[r+1] || rowStates[r] >= state->nStates || (r > 0 && rowStates[r] <= rowStates[r-1]))
+            return false;
+        for (size_t e = rowPtr[r]; e < rowPtr[r+1]; e++) {
+            if (colIds[e] >= state->nVals || (e > rowPtr[r] && colIds[e] <= colIds[e-1]))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool modelRecordOk(const MarkovModel* model, const ModelMatrixRecord* rec) {
+    const MarkovState* state = model->state;
+    if (rec->lastStateID >= state->nStates || rec->lastFilled > state->order)
+        return false;
+    if (rec->layout > TM_SPARSE || rec->precision > TM_PREC_Q16)
+        return false;
+
+    const size_t cdfSize = (rec->precision == TM_PREC_Q16) ? sizeof(uint16_t)
+                         : (rec->precision == TM_PREC_FLOAT) ? sizeof(float) : sizeof(double);
+    if (rec->layout == TM_DENSE) {
+        const uint64_t size = (uint64_t)state->nStates * state->nVals;
+        return rec->nRows == state->nStates && rec->nnz == size &&
+               modelBlockOk(model, rec->probs, size, sizeof(double), true) &&
+               modelBlockOk(model, rec->counts, size, sizeof(uint64_t), true) &&
+               modelBlockOk(model, rec->rowTotals, state->nStates, sizeof(uint64_t), true) &&
+               modelBlockOk(model, rec->dirty, state->nStates, sizeof(ubyte), false) &&
+               modelBytesZero(model, rec->dirty, state->nStates) &&
+               modelBlockOk(model, rec->cdf, size, cdfSize, true) &&
+               modelBlockOk(model, rec->ready, state->nStates, sizeof(ubyte), rec->cdf == 0);
+    }
+
+    if (!modelBlockOk(model, rec->rowPtr, rec->nRows + 1, sizeof(size_t), false))
+        return false;
+    const size_t* rowPtr = (const size_t*)((const ubyte*)model->mapping + rec->rowPtr);
+    return rec->nRows <= state->nStates && rowPtr[0] == 0 && rowPtr[rec->nRows] == rec->nnz &&
+           modelBlockOk(model, rec->rowStates, rec->nRows, sizeof(size_t), false) &&
+           modelBlockOk(model, rec->colIds, rec->nnz, sizeof(size_t), false) &&
+           modelBlockOk(model, rec->sparseProbs, rec->nnz, sizeof(double), false) &&
+           modelBlockOk(model, rec->counts, rec->nnz, sizeof(uint64_t), true) &&
+           modelBlockOk(model, rec->rowTotals, rec->nRows, sizeof(uint64_t), true) &&
+           modelBlockOk(model, rec->dirty, rec->nRows, sizeof(ubyte), false) &&
+           modelBytesZero(model, rec->dirty, rec->nRows) &&
+           modelBlockOk(model, rec->cdf, rec->nnz, cdfSize, true) &&
+           modelBlockOk(model, rec->ready, rec->nRows, sizeof(ubyte), rec->cdf == 0) &&
+           modelSparseIndexOk(model, rec);
+}
+
+MarkovModel* modelOpen(const char* file) {
+    if (!file)
+        return NULL;
+    if (sizeof(size_t) != sizeof(uint64_t)) {
+        LOG_ERROR("Model files need 64-bit size_t");
+        return NULL;
+    }
+
+    const int fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        LOG_ERROR("Unable to open model file:");
+        fprintf(stderr, "%s\n", file);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ModelFileHeader)) {
+        LOG_ERROR("Model file is too small");
+        close(fd);
+        return NULL;
+    }
+    void* mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        LOG_ERROR("Unable to map model file");
+        return NULL;
+    }
+
+    MarkovModel* model = calloc(1, sizeof(MarkovModel));
+    if (!model) {
+        LOG_ERROR("calloc failed for MarkovModel");
+        munmap(mapping, (size_t)st.st_size);
+        return NULL;
+    }
+    model->mapping = mapping;
+    model->size = (size_t)st.st_size;
+    model->header = (const ModelFileHeader*)mapping;
+
+    const ModelFileHeader* h = model->header;
+    if (memcmp(h->magic, MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC)) != 0 || h->version != MODEL_FILE_VERSION ||
+        h->byteOrder != MODEL_FILE_BYTE_ORDER || h->fileSize != model->size || h->kind > MODEL_NETWORK ||
+        h->nMatrices == 0 || !modelBlockOk(model, h->records, h->nMatrices, sizeof(ModelMatrixRecord), false) ||
+        !modelBlockOk(model, h->vals, h->nVals, sizeof(int), false) ||
+        !modelBlockOk(model, h->weights, h->nMatrices, sizeof(double), h->kind == MODEL_CHAIN) ||
+        !modelBlockOk(model, h->errFactors, h->nMatrices, sizeof(double), h->kind == MODEL_CHAIN)) {
+        LOG_ERROR("Invalid model file (or saved with another version or byte order):");
+        fprintf(stderr, "%s\n", file);
+        modelClose(&model);
+        return NULL;
+    }
+    model->records = (const ModelMatrixRecord*)((const ubyte*)mapping + h->records);
+
+    // only the alphabet is needed to decode the states
+    model->state = markovBuildLazyStates(h->order, (const int*)((const ubyte*)mapping + h->vals), h->nVals);
+    if (!model->state) {
+        LOG_ERROR("Unable to build the states of the model file");
+        modelClose(&model);
+        return NULL;
+    }
+    for (size_t i = 0; i < h->nMatrices; i++) {
+        if (!modelRecordOk(model, &model->records[i])) {
+            LOG_ERROR("Invalid matrix in model file:");
+            fprintf(stderr, "%s\n", file);
+            modelClose(&model);
+            return NULL;
+        }
+    }
+
+    return model;
+}
+
+void modelClose(MarkovModel** model) {
+    if (!model || !(*model))
+        return;
+
+    markovFreeState(&(*model)->state);
+    if ((*model)->mapping)
+        munmap((*model)->mapping, (*model)->size);
+    free(*model);
+    *model = NULL;
+}
+
+// Pointer to the block at 'offset' of the mapping (NULL for missing blocks)
+static void* modelBlock(const MarkovModel* model, const uint64_t offset) {
+    return (offset == 0) ? NULL : (ubyte*)model->mapping + offset;
+}
+
+TransitionMatrix* modelMatrix(const MarkovModel* model, const size_t i) {
+    if (!model || i >= model->header->nMatrices)
+        return NULL;
+
+    const ModelMatrixRecord* rec = &model->records[i];
+    TransitionMatrix* m = (rec->layout == TM_SPARSE) ? markovInitSparseTransMatrix(model->state)
+                                                     : markovInitTransMatrix(NULL, model->state);
+    if (!m)
+        return NULL;
+
+    m->readOnly = true;
+    m->lastStateID = rec->lastStateID;
+    m->lastFilled = (uint)rec->lastFilled;
+    m->probs = modelBlock(model, rec->probs);
+    m->rowStates = modelBlock(model, rec->rowStates);
+    m->rowPtr = modelBlock(model, rec->rowPtr);
+    m->colIds = modelBlock(model, rec->colIds);
+    m->sparseProbs = modelBlock(model, rec->sparseProbs);
+    m->counts = modelBlock(model, rec->counts);
+    m->rowTotals = modelBlock(model, rec->rowTotals);
+    m->dirty = modelBlock(model, rec->dirty);
+    if (rec->layout == TM_SPARSE) {
+        m->nRows = rec->nRows;
+        m->rowCap = rec->nRows;
+        m->entryCap = rec->nnz;
+    }
+
+    // the sampling cache is already built in the file
+    MarkovSampler* sampler = m->sampler;
+    sampler->precision = (TransMatrixPrecision)rec->precision;
+    if (rec->cdf) {
+        if (sampler->precision == TM_PREC_FLOAT)
+            sampler->cdf32 = modelBlock(model, rec->cdf);
+        else if (sampler->precision == TM_PREC_Q16)
+            sampler->cdfQ16 = modelBlock(model, rec->cdf);
+        else
+            sampler->cdf = modelBlock(model, rec->cdf);
+        sampler->ready = modelBlock(model, rec->ready);
+        sampler->mapped = true;
+    }
+    else
+        markovPrepareSampler(m);
+    return m;
+}
+
+MarkovNetwork* modelNetwork(const MarkovModel* model) {
+    if (!model)
+        return NULL;
+    const ModelFileHeader* h = model->header;
+    if (h->kind != MODEL_NETWORK) {
+        LOG_ERROR("The model file doesn't have a Markov Network");
+        return NULL;
+    }
+
+    // Init the network with empty matrices, then swap them for the views of the file
+    const double* weights = modelBlock(model, h->weights);
+    const double* errFactors = modelBlock(model, h->errFactors);
+    MarkovNetwork* net = mkNetInit(model->state, h->nMatrices, errFactors, NULL,
+                                   (TransMatrixLayout)model->records[0].layout);
+    if (!net) {
+        LOG_ERROR("Unable to initialize Markov Network in modelNetwork");
+        return NULL;
+    }
+    for (size_t i = 0; i < net->nMatNodes; i++) {
+        TransitionMatrix* view = modelMatrix(model, i);
+        if (!view) {
+            LOG_ERROR("Unable to map the node matrices in modelNetwork");
+            mkNetFree(&net);
+            return NULL;
+        }
+        markovFreeTransMatrix(&net->input[i]->dest->matrix);
+        net->input[i]->dest->matrix = view;
+        net->output[i]->weight = weights[i];
+    }
+    return net;
+}
+/* ------------------------------------------------------------------------------- */
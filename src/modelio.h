@@ -0,0 +1,92 @@
+#ifndef MODELIO_H
+#define MODELIO_H
+
+#include "markov.h"
+#include "markovnetwork.h"
+
+/// Binary model files, memory mapped when loaded
+
+// A model file has the transition matrices of a Default Markov Chain (one matrix) or of a Markov
+// Network (one per node, with the weights and error factors of the nodes), over the same alphabet.
+// It starts with a ModelFileHeader, followed by one ModelMatrixRecord per matrix, and then every
+// block (values, probabilities, CSR arrays, counts, cumulative probabilities...) at an offset from
+// the start of the file aligned to MODEL_FILE_ALIGN. Numbers are stored in the byte order of the
+// machine that saved the file, which is checked when it's opened.
+//
+// Opening a model maps the file read-only: the matrices point straight into the mapping, with the
+// sampling cache already built, so predictions start without parsing or copying anything, and
+// processes opening the same file share its pages
+#define MODEL_FILE_MAGIC "MKMODEL"
+#define MODEL_FILE_VERSION 1
+#define MODEL_FILE_ALIGN 64
+#define MODEL_FILE_BYTE_ORDER 0x01020304u
+
+typedef enum {
+    MODEL_CHAIN = 0,
+    MODEL_NETWORK = 1,
+} ModelKind;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t kind;
+    uint32_t order;
+    uint64_t fileSize;
+    uint64_t nVals;
+    uint64_t nMatrices;
+    // offsets of the blocks shared by every matrix (0 when missing)
+    uint64_t records;    // nMatrices ModelMatrixRecords
+    uint64_t vals;       // nVals ints
+    uint64_t weights;    // nMatrices doubles, networks only
+    uint64_t errFactors; // nMatrices doubles, networks only
+} ModelFileHeader;
+
+typedef struct {
+    uint32_t layout;
+    uint32_t precision;
+    uint64_t nRows;
+    uint64_t nnz;
+    uint64_t lastStateID;
+    uint64_t lastFilled;
+    // offsets of the blocks of the matrix (0 when missing). Rows and entries are laid out like in
+    // TransitionMatrix, with the sparse rows sorted by state
+    uint64_t probs;
+    uint64_t rowStates;
+    uint64_t rowPtr;
+    uint64_t colIds;
+    uint64_t sparseProbs;
+    uint64_t counts;
+    uint64_t rowTotals;
+    uint64_t dirty; // every byte is 0: the mapping is read-only, so rows are never normalized again
+    uint64_t cdf;
+    uint64_t ready;
+} ModelMatrixRecord;
+
+// Save the matrix of a Default Markov Chain (its sampling cache is built first). Returns false on error
+bool modelSaveChain(const TransitionMatrix* m, const char* file);
+// Save every node matrix of the network with its weight and error factor. Returns false on error
+bool modelSaveNetwork(const MarkovNetwork* net, const char* file);
+
+// An open model file. 'state' has the (lazy) states of the alphabet in the file, shared by every
+// matrix taken from the model, so the model must stay open while they are used
+typedef struct {
+    void* mapping;
+    size_t size;
+    const ModelFileHeader* header;
+    const ModelMatrixRecord* records;
+    MarkovState* state;
+} MarkovModel;
+
+// Map a model file. Returns NULL if it can't be read or isn't a valid model file
+MarkovModel* modelOpen(const char* file);
+void modelClose(MarkovModel** model);
+
+// Read-only view of the matrix 'i' of the model, freed with markovFreeTransMatrix (which leaves the
+// mapping alone). Use markovCopyTransMatrix to get a matrix that can be updated
+TransitionMatrix* modelMatrix(const MarkovModel* model, const size_t i);
+// Markov Network with the node matrices (read-only views), weights and error factors of a network
+// model, ready to predict after mkNetSetLastState. Freed with mkNetFree
+MarkovNetwork* modelNetwork(const MarkovModel* model);
+
+#endif // MODELIO_H
@@ -0,0 +1,220 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+typedef struct {
+    ParallelBody body;
+    void* ctx;
+    size_t begin;
+    size_t end;
+    uint thread;
+} ParallelChunk;
+
+static void* parallelRun(void* arg) {
+    ParallelChunk* chunk = (ParallelChunk*)arg;
+    chunk->body(chunk->ctx, chunk->begin, chunk->end, chunk->thread);
+    return NULL;
+}
+
+uint parallelDefaultThreads() {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return (online > 0) ? (uint)online : 1;
+}
+
+// Split [0, n) in nThreads chunks: chunk t of the loop
+static void parallelChunk(ParallelChunk* chunk, const size_t n, const uint nThreads, const uint t,
+                          ParallelBody body, void* ctx) {
+    chunk->body = body;
+    chunk->ctx = ctx;
+    chunk->begin = n / nThreads * t + ((t < n % nThreads) ? t : n % nThreads);
+    chunk->end = chunk->begin + n / nThreads + ((t < n % nThreads) ? 1 : 0);
+    chunk->thread = t;
+}
+
+/* ----------------------------------------- THREAD POOL ----------------------------------------- */
+// Workers started by the first parallel loops and kept until the program exits, so loops run every
+// iteration of a solver don't start threads each time. Worker w (from 1) runs the chunk w of every loop
+// with more than w chunks. A single loop uses the pool at a time: loops started while it's busy (from
+// another thread or from a loop body) start their own threads
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t* workers;
+    uint nWorkers;
+    bool busy;
+    bool shutdown;
+    // current loop, numbered by 'round'
+    size_t round;
+    size_t n;
+    uint nThreads;
+    ParallelBody body;
+    void* ctx;
+    // workers that didn't finish the round yet
+    uint pending;
+} ParallelPool;
+
+static ParallelPool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                            NULL, 0, false, false, 0, 0, 0, NULL, NULL, 0};
+
+typedef struct {
+    uint id;
+    size_t round;
+} ParallelWorker;
+
+static void* parallelWorkerRun(void* arg) {
+    const ParallelWorker worker = *(ParallelWorker*)arg;
+    free(arg);
+    size_t seen = worker.round;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.shutdown && pool.round == seen)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        if (pool.shutdown)
+            break;
+        seen = pool.round;
+        ParallelChunk chunk;
+        const bool active = (worker.id < pool.nThreads);
+        if (active)
+            parallelChunk(&chunk, pool.n, pool.nThreads, worker.id, pool.body, pool.ctx);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (active)
+            parallelRun(&chunk);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// Stop and join the workers when the program exits
+static void parallelPoolShutdown() {
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for (uint w = 0; w < pool.nWorkers; w++)
+        pthread_join(pool.workers[w], NULL);
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.nWorkers = 0;
+}
+
+// Start workers until there are 'count' of them (called with the lock held, while the pool is busy).
+// Returns the number of workers, which is lower if some couldn't be started
+static uint parallelPoolGrow(const uint count) {
+    if (pool.nWorkers >= count)
+        return pool.nWorkers;
+    pthread_t* workers = realloc(pool.workers, sizeof(pthread_t) * count);
+    if (!workers)
+        return pool.nWorkers;
+    pool.workers = workers;
+    if (pool.nWorkers == 0)
+        atexit(parallelPoolShutdown);
+
+    while (pool.nWorkers < count) {
+        ParallelWorker* worker = malloc(sizeof(ParallelWorker));
+        if (!worker)
+            break;
+        worker->id = pool.nWorkers + 1;
+        worker->round = pool.round;
+        if (pthread_create(&pool.workers[pool.nWorkers], NULL, parallelWorkerRun, worker) != 0) {
+            free(worker);
+            LOG_WARNING("Unable to start thread in parallelFor, running its chunk in the calling thread");
+            break;
+        }
+        pool.nWorkers++;
+    }
+    return pool.nWorkers;
+}
+
+// Run the loop over the pool. Returns false (without running anything) if the pool is busy
+static bool parallelPoolFor(const size_t n, const uint nThreads, ParallelBody body, void* ctx) {
+    pthread_mutex_lock(&pool.lock);
+    if (pool.busy || pool.shutdown) {
+        pthread_mutex_unlock(&pool.lock);
+        return false;
+    }
+    pool.busy = true;
+    const uint nWorkers = parallelPoolGrow(nThreads - 1);
+    pool.n = n;
+    pool.nThreads = nThreads;
+    pool.body = body;
+    pool.ctx = ctx;
+    pool.pending = nWorkers;
+    pool.round++;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    // The calling thread runs the first chunk, and those without a worker
+    ParallelChunk chunk;
+    for (uint t = 0; t < nThreads; t++) {
+        if (t == 0 || t > nWorkers) {
+            parallelChunk(&chunk, n, nThreads, t, body, ctx);
+            parallelRun(&chunk);
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pool.busy = false;
+    pthread_mutex_unlock(&pool.lock);
+    return true;
+}
+
+uint parallelFor(const size_t n, uint nThreads, ParallelBody body, void* ctx) {
+    if (!body)
+        return 0;
+    if (nThreads == 0)
+        nThreads = parallelDefaultThreads();
+    if ((size_t)nThreads > n)
+        nThreads = (n > 0) ? (uint)n : 1;
+
+    if (nThreads == 1) {
+        body(ctx, 0, n, 0);
+        return 1;
+    }
+    if (parallelPoolFor(n, nThreads, body, ctx))
+        return nThreads;
+
+    // The pool is busy: fork-join with threads of our own
+    pthread_t* threads = malloc(sizeof(pthread_t) * nThreads);
+    ParallelChunk* chunks = malloc(sizeof(ParallelChunk) * nThreads);
+    if (!threads || !chunks) {
+        LOG_ERROR("malloc failed for threads in parallelFor");
+        free(threads);
+        free(chunks);
+        return 0;
+    }
+
+    // The calling thread runs the first chunk while the others run theirs
+    uint started = 1;
+    for (uint t = 0; t < nThreads; t++)
+        parallelChunk(&chunks[t], n, nThreads, t, body, ctx);
+    for (uint t = 1; t < nThreads; t++) {
+        if (pthread_create(&threads[t], NULL, parallelRun, &chunks[t]) != 0) {
+            LOG_WARNING("Unable to start thread in parallelFor, running its chunk in the calling thread");
+            break;
+        }
+        started++;
+    }
+    parallelRun(&chunks[0]);
+    // chunks whose thread couldn't be started
+    for (uint t = started; t < nThreads; t++)
+        parallelRun(&chunks[t]);
+
+    for (uint t = 1; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    free(threads);
+    free(chunks);
+    return nThreads;
+}
@@ -0,0 +1,20 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "typedefs.h"
+
+// Body of a parallel loop: handles the items [begin, end) in the thread 'thread' (0 to nThreads-1),
+// so it can use per-thread accumulators without locks
+typedef void (*ParallelBody)(void* ctx, const size_t begin, const size_t end, const uint thread);
+
+// Number of threads to use when 0 is requested (online processors)
+uint parallelDefaultThreads();
+
+// Split [0, n) in contiguous chunks, one per thread, and run 'body' on each (fork-join). The chunks run
+// in a pool of workers kept between calls, so loops inside iterative solvers don't start threads each
+// time; while the pool runs another loop, the call starts its own threads. Runs in the calling thread
+// when there's a single thread or too few items, and the chunks of threads that can't be started also
+// run in the calling thread. Returns the number of chunks (0 if nothing ran)
+uint parallelFor(const size_t n, uint nThreads, ParallelBody body, void* ctx);
+
+#endif // PARALLEL_H
@@ -0,0 +1,18 @@
+#include "rng.h"
+
+#include "utils.h"
+
+void rngInit(Rng* rng, const uint64_t seed, const uint64_t stream) {
+    if (!rng)
+        return;
+
+    // Fill the state with splitmix64 from a mix of seed and stream (never all zeros in practice,
+    // but the generator would be stuck there, so guard it anyway)
+    uint64_t x = seed ^ splitmix64(stream ^ 0x6A09E667F3BCC909ULL);
+    for (int i = 0; i < 4; i++) {
+        x += 0x9E3779B97F4A7C15ULL;
+        rng->s[i] = splitmix64(x);
+    }
+    if (!(rng->s[0] | rng->s[1] | rng->s[2] | rng->s[3]))
+        rng->s[0] = 1;
+}
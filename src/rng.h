@@ -0,0 +1,54 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include "typedefs.h"
+
+/// Random number generators with explicit state (xoshiro256**)
+
+// Every stochastic function takes its own Rng instead of sharing the global rand() state, so
+// threads don't contend for it and results only depend on how each generator was seeded.
+// A generator is identified by (seed, stream): different streams of the same seed are independent
+// sequences, so every thread, node or path can have its own one and still be reproducible
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+void rngInit(Rng* rng, const uint64_t seed, const uint64_t stream);
+
+static inline uint64_t rngRotl(const uint64_t x, const int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rngNext(Rng* rng) {
+    uint64_t* s = rng->s;
+    const uint64_t result = rngRotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rngRotl(s[3], 45);
+    return result;
+}
+
+// Uniform double in [0, 1) (top 53 bits, exactly representable)
+static inline double rngUnit_d(Rng* rng) {
+    return (double)(rngNext(rng) >> 11) * 0x1.0p-53;
+}
+
+// Uniform integer in [0, n), without the bias of rand() % n (multiply-shift with rejection)
+static inline size_t rngBelow(Rng* rng, const size_t n) {
+    unsigned __int128 m = (unsigned __int128)rngNext(rng) * n;
+    uint64_t low = (uint64_t)m;
+    if (low < n) {
+        const uint64_t threshold = -(uint64_t)n % n;
+        while (low < threshold) {
+            m = (unsigned __int128)rngNext(rng) * n;
+            low = (uint64_t)m;
+        }
+    }
+    return (size_t)(m >> 64);
+}
+
+#endif // RNG_H
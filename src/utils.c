@@ -34,10 +34,9 @@ uint countSubsetIn_i(const int* arr, const size_t n, const int* subset, const si
     return count;
 }
 
-void combineRecursive(int* comb, const int* vals, const size_t n, const size_t len, size_t depth, int** combs, size_t* combIdx) {
+void combineRecursive(int* comb, const int* vals, const size_t n, const size_t len, size_t depth, int* combs, size_t* combIdx) {
     if (depth == len) {
-        for (size_t i = 0; i < len; i++)
-            combs[*combIdx][i] = comb[i];
+        memcpy(combs + (*combIdx) * len, comb, len * sizeof(int));
         (*combIdx)++;
         return;
     }
@@ -48,7 +47,7 @@ void combineRecursive(int* comb, const int* vals, const size_t n, const size_t l
     }
 }
 
-void buildCombinations_i(const int* vals, const size_t n, const size_t len, int** out, size_t* outNComb) {
+void buildCombinations_i(const int* vals, const size_t n, const size_t len, int* out, size_t* outNComb) {
     if (!vals || !out)
         return;
 
@@ -79,8 +78,10 @@ void printArr_d(const double* arr, const size_t n) {
     putchar('\n');
 }
 
-double rand01_d() {
-    return (double)rand() / (double)((unsigned)RAND_MAX + 1);
+void* alignedAlloc(const size_t size) {
+    // aligned_alloc requires the size to be a multiple of the alignment
+    const size_t rounded = ((size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) * CACHE_LINE_SIZE;
+    return aligned_alloc(CACHE_LINE_SIZE, (rounded > 0) ? rounded : CACHE_LINE_SIZE);
 }
 
 int _cmpAsc(const void* a, const void* b) {
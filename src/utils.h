@@ -5,11 +5,29 @@
 
 lli findSubsetIn_i(const int* arr, const size_t n, const size_t start, const int* subset, const size_t s);
 uint countSubsetIn_i(const int* arr, const size_t n, const int* subset, const size_t s);
-void buildCombinations_i(const int* vals, const size_t n, const size_t len, int** out, size_t* outNComb);
+// 'out' is a single block of n^len * len values, combination i is out[i*len .. (i+1)*len)
+void buildCombinations_i(const int* vals, const size_t n, const size_t len, int* out, size_t* outNComb);
 
 void printArr_i(const int* arr, const size_t n);
 void printArr_d(const double* arr, const size_t n);
-double rand01_d();
+// Counter-based random numbers: the splitmix64 finalizer of (seed, counter), so the i-th number
+// of a seed is the same whatever order or thread it's generated in. hashUnit_d is in [0, 1).
+// Inline so loops generating blocks of numbers can be vectorized
+static inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static inline double hashUnit_d(const uint64_t seed, const uint64_t counter) {
+    // top 53 bits, exactly representable as a double
+    return (double)(splitmix64(seed ^ splitmix64(counter)) >> 11) * 0x1.0p-53;
+}
+
+// Allocate 'size' bytes aligned to the cache line (CACHE_LINE_SIZE), freed with free()
+#define CACHE_LINE_SIZE 64
+void* alignedAlloc(const size_t size);
 
 void findDistinct_i(const int* data, const size_t n, int** out, size_t* outSize);
 int* loadData_i(const char* file, size_t* outN);